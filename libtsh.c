@@ -0,0 +1,765 @@
+/*
+ * libtsh - The tsh job engine as a library (see libtsh.h)
+ *
+ * The routines follow their counterparts in tsh.c (addjob, deletejob,
+ * sigchld_handler, waitfg, ...), with the job list and the options
+ * moved into a struct tsh_ctx_t. Errors are returned (-1 or NULL, with
+ * errno set) rather than reported with unix_error, since a library
+ * must not exit its caller.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include "libtsh.h"
+
+#define REAPBATCH 64      /* exited jobs collected per epoll_wait */
+#define CACHELINE 64      /* keeps the two ends of a queue apart */
+
+struct tsh_ctx_t {          /* An engine */
+    struct tsh_job_t *jobs; /* the job list */
+    int maxjobs;            /* its size */
+    int nextjid;            /* next job ID to allocate */
+    int verbose;            /* if true, log what the engine does */
+    FILE *log;              /* where to (stdout by default, as in tsh) */
+    tsh_notify_t *notify;   /* called on job state changes, or NULL */
+    void *notifyarg;
+    int epfd;               /* watches the pidfds of the jobs */
+};
+
+struct lfq_t {              /* Bounded multi-producer/multi-consumer queue */
+    atomic_size_t head;
+    char pad1[CACHELINE - sizeof(atomic_size_t)];
+    atomic_size_t tail;
+    char pad2[CACHELINE - sizeof(atomic_size_t)];
+    size_t mask;            /* cells - 1 (a power of 2) */
+    size_t size;            /* bytes of data in a cell */
+    char *cells;            /* each a sequence number, then the data */
+};
+
+struct sub_t {              /* A submitted launch, as it sits in the queue */
+    void *tag;
+    int argc;
+    short argoff[TSH_MAXARGS]; /* where each argument starts in buf */
+    char buf[TSH_MAXLINE];
+    char cmdline[TSH_MAXLINE];
+};
+
+struct tsh_queue_t {        /* Launches submitted by other threads */
+    struct tsh_ctx_t *ctx;  /* the engine, used only by the owner */
+    struct lfq_t subq;      /* launches: any thread -> owner */
+    struct lfq_t doneq;     /* exit records: owner -> any thread */
+    int subfd;              /* eventfd that wakes the owner */
+    int donefd;             /* eventfd counting posted exit records */
+    atomic_int sleeping;    /* the owner is (about to be) asleep in tsh_serve */
+    int running;            /* (owner) jobs started, not yet posted */
+    int posted;             /* (owner) records posted by this tsh_serve */
+};
+
+extern char **environ;
+
+/* clearjob - Clear the entries in a job struct */
+static void clearjob(struct tsh_job_t *job)
+{
+    job->pid = 0;
+    job->jid = 0;
+    job->state = TSH_UNDEF;
+    job->stopsig = 0;
+    job->pidfd = -1;
+    job->cmdline[0] = '\0';
+    job->data = NULL;
+}
+
+/* maxjid - Returns largest allocated job ID */
+static int maxjid(struct tsh_ctx_t *ctx)
+{
+    int i, max = 0;
+
+    for (i = 0; i < ctx->maxjobs; i++)
+	if (ctx->jobs[i].jid > max)
+	    max = ctx->jobs[i].jid;
+    return max;
+}
+
+/*
+ * tsh_open - Create an engine with room for maxjobs jobs. Returns NULL
+ *    (with errno set) if it cannot be created.
+ */
+struct tsh_ctx_t *tsh_open(int maxjobs, int flags)
+{
+    struct tsh_ctx_t *ctx;
+    int i;
+
+    if (maxjobs < 1) {
+	errno = EINVAL;
+	return NULL;
+    }
+    if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+	return NULL;
+    if ((ctx->jobs = calloc(maxjobs, sizeof(struct tsh_job_t))) == NULL
+	|| (ctx->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	free(ctx->jobs);
+	free(ctx);
+	return NULL;
+    }
+    for (i = 0; i < maxjobs; i++)
+	clearjob(&ctx->jobs[i]);
+    ctx->maxjobs = maxjobs;
+    ctx->nextjid = 1;
+    ctx->verbose = (flags & TSH_VERBOSE) != 0;
+    ctx->log = stdout;
+    return ctx;
+}
+
+/*
+ * tsh_close - Free an engine. Its jobs keep running; they are simply
+ *    no longer tracked (reap them first if that matters).
+ */
+void tsh_close(struct tsh_ctx_t *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->maxjobs; i++)
+	if (ctx->jobs[i].pidfd >= 0)
+	    close(ctx->jobs[i].pidfd);
+    close(ctx->epfd);
+    free(ctx->jobs);
+    free(ctx);
+}
+
+/* tsh_setlog - Send the engine's verbose output to log */
+void tsh_setlog(struct tsh_ctx_t *ctx, FILE *log)
+{
+    ctx->log = log;
+}
+
+/* tsh_setnotify - Have fn called on every job state change */
+void tsh_setnotify(struct tsh_ctx_t *ctx, tsh_notify_t *fn, void *arg)
+{
+    ctx->notify = fn;
+    ctx->notifyarg = arg;
+}
+
+/* tsh_fd - Return the descriptor that is readable when a job has exited */
+int tsh_fd(struct tsh_ctx_t *ctx)
+{
+    return ctx->epfd;
+}
+
+/*
+ * tsh_addjob - Add a job the caller started itself (a child of this
+ *    process, in its own process group) to the job list
+ */
+struct tsh_job_t *tsh_addjob(struct tsh_ctx_t *ctx, pid_t pid, int state, const char *cmdline)
+{
+    struct epoll_event ev;
+    struct tsh_job_t *job;
+    int i, fd;
+
+    if (pid < 1) {
+	errno = EINVAL;
+	return NULL;
+    }
+    for (i = 0; i < ctx->maxjobs; i++)
+	if (ctx->jobs[i].pid == 0)
+	    break;
+    if (i == ctx->maxjobs) {
+	errno = EAGAIN;
+	return NULL;
+    }
+    if ((fd = syscall(SYS_pidfd_open, pid, 0)) < 0)
+	return NULL;
+    ev.events = EPOLLIN;
+    ev.data.u64 = i;
+    if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	close(fd);
+	return NULL;
+    }
+    job = &ctx->jobs[i];
+    job->pid = pid;
+    job->state = state;
+    job->pidfd = fd;
+    job->jid = ctx->nextjid++;
+    if (ctx->nextjid > ctx->maxjobs)
+	ctx->nextjid = 1;
+    snprintf(job->cmdline, sizeof(job->cmdline), "%s", cmdline);
+    if (ctx->verbose)
+	fprintf(ctx->log, "Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+    return job;
+}
+
+/* tsh_deletejob - Delete a job whose PID=pid from the job list */
+int tsh_deletejob(struct tsh_ctx_t *ctx, pid_t pid)
+{
+    struct tsh_job_t *job;
+
+    if ((job = tsh_getjobpid(ctx, pid)) == NULL)
+	return 0;
+    epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, job->pidfd, NULL);
+    close(job->pidfd);
+    clearjob(job);
+    ctx->nextjid = maxjid(ctx) + 1;
+    return 1;
+}
+
+/*
+ * tsh_spawn - Run argv[0] (a path) as a new job in its own process
+ *    group, with the environment envp (NULL = ours). Signal handlers
+ *    and the signal mask are reset in the child. Returns the job, or
+ *    NULL with errno set if it could not be started.
+ */
+struct tsh_job_t *tsh_spawn(struct tsh_ctx_t *ctx, char *const argv[], char *const envp[],
+			    int state, const char *cmdline)
+{
+    posix_spawnattr_t attr;
+    struct tsh_job_t *job;
+    sigset_t empty, all;
+    pid_t pid;
+    int err;
+
+    sigemptyset(&empty);
+    sigfillset(&all);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK
+			     | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setsigdefault(&attr, &all);
+    err = posix_spawn(&pid, argv[0], NULL, &attr, argv, envp ? envp : environ);
+    posix_spawnattr_destroy(&attr);
+    if (err) {
+	errno = err;
+	return NULL;
+    }
+    if ((job = tsh_addjob(ctx, pid, state, cmdline)) == NULL) {
+	err = errno;
+	kill(-pid, SIGKILL);	/* can't track it: don't leave it running */
+	waitpid(pid, NULL, 0);
+	errno = err;
+    }
+    return job;
+}
+
+/* tsh_getjobpid - Find a job (by PID) on the job list */
+struct tsh_job_t *tsh_getjobpid(struct tsh_ctx_t *ctx, pid_t pid)
+{
+    int i;
+
+    if (pid < 1)
+	return NULL;
+    for (i = 0; i < ctx->maxjobs; i++)
+	if (ctx->jobs[i].pid == pid)
+	    return &ctx->jobs[i];
+    return NULL;
+}
+
+/* tsh_getjobjid - Find a job (by JID) on the job list */
+struct tsh_job_t *tsh_getjobjid(struct tsh_ctx_t *ctx, int jid)
+{
+    int i;
+
+    if (jid < 1)
+	return NULL;
+    for (i = 0; i < ctx->maxjobs; i++)
+	if (ctx->jobs[i].jid == jid)
+	    return &ctx->jobs[i];
+    return NULL;
+}
+
+/* tsh_pid2jid - Map process ID to job ID */
+int tsh_pid2jid(struct tsh_ctx_t *ctx, pid_t pid)
+{
+    struct tsh_job_t *job = tsh_getjobpid(ctx, pid);
+
+    return job ? job->jid : 0;
+}
+
+/* tsh_fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t tsh_fgpid(struct tsh_ctx_t *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->maxjobs; i++)
+	if (ctx->jobs[i].state == TSH_FG)
+	    return ctx->jobs[i].pid;
+    return 0;
+}
+
+/* tsh_numjobs - Return the number of jobs in the job list */
+int tsh_numjobs(struct tsh_ctx_t *ctx)
+{
+    int i, n = 0;
+
+    for (i = 0; i < ctx->maxjobs; i++)
+	if (ctx->jobs[i].pid != 0)
+	    n++;
+    return n;
+}
+
+/* tsh_listjobs - Print the job list (as the jobs builtin) */
+void tsh_listjobs(struct tsh_ctx_t *ctx, FILE *fp)
+{
+    struct tsh_job_t *job;
+    int i;
+
+    for (i = 0; i < ctx->maxjobs; i++) {
+	job = &ctx->jobs[i];
+	if (job->pid == 0)
+	    continue;
+	fprintf(fp, "[%d] (%d) %s%s", job->jid, job->pid,
+		job->state == TSH_BG ? "Running " :
+		job->state == TSH_FG ? "Foreground " : "Stopped ", job->cmdline);
+	if (job->cmdline[0] == '\0' || job->cmdline[strlen(job->cmdline)-1] != '\n')
+	    fputc('\n', fp);
+    }
+}
+
+/*
+ * job_status - Update the job list for a job that stopped, continued
+ *    or ended with the given wait status (child_status in tsh)
+ */
+static void job_status(struct tsh_ctx_t *ctx, struct tsh_job_t *job, int status)
+{
+    if (WIFSTOPPED(status)) {
+	job->state = TSH_ST;
+	job->stopsig = WSTOPSIG(status);
+	if (ctx->verbose)
+	    fprintf(ctx->log, "Job [%d] (%d) stopped by signal %d\n", job->jid, job->pid,
+		    WSTOPSIG(status));
+    }
+    else if (WIFCONTINUED(status)) {
+	if (job->state == TSH_ST)	/* (continued from outside) */
+	    job->state = TSH_BG;
+    }
+    else if (ctx->verbose) {
+	if (WIFSIGNALED(status))
+	    fprintf(ctx->log, "Job [%d] (%d) terminated by signal %d\n", job->jid, job->pid,
+		    WTERMSIG(status));
+	else
+	    fprintf(ctx->log, "Job [%d] (%d) exited with status %d\n", job->jid, job->pid,
+		    WEXITSTATUS(status));
+    }
+    if (ctx->notify)
+	ctx->notify(ctx, job, status, ctx->notifyarg);
+    if ((WIFEXITED(status) || WIFSIGNALED(status)) && job->pid != 0)
+	tsh_deletejob(ctx, job->pid);
+}
+
+/* 
+ * job_wait - waitid on one job's pidfd and handle what it reports, with
+ *    its wait status in *status. Returns 1 if there was something to
+ *    handle, 0 if not (WNOHANG), -1 on error. (A clean exit's status is
+ *    0, so the status itself can't say whether anything happened.)
+ */
+static int job_wait(struct tsh_ctx_t *ctx, struct tsh_job_t *job, int options, int *status)
+{
+    siginfo_t si;
+
+    si.si_pid = 0;
+    while (waitid(P_PIDFD, job->pidfd, &si, options) < 0)
+	if (errno != EINTR)
+	    return -1;
+    if (si.si_pid == 0)
+	return 0;		/* (WNOHANG: nothing yet) */
+    *status = tsh_wait_status(&si);
+    job_status(ctx, job, *status);
+    return 1;
+}
+
+/*
+ * tsh_reap - Handle the jobs that have exited, without blocking. With
+ *    all set, also check every job for stops and continues that came
+ *    from outside (the descriptor only announces exits). Returns the
+ *    number of state changes handled, -1 on error.
+ */
+int tsh_reap(struct tsh_ctx_t *ctx, int all)
+{
+    struct epoll_event evs[REAPBATCH];
+    struct tsh_job_t *job;
+    int i, n, status, handled = 0;
+
+    do {
+	if ((n = epoll_wait(ctx->epfd, evs, REAPBATCH, 0)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	for (i = 0; i < n; i++) {
+	    job = &ctx->jobs[evs[i].data.u64];
+	    if (job->pid != 0 && job_wait(ctx, job, WEXITED|WNOHANG, &status) > 0)
+		handled++;
+	}
+    } while (n == REAPBATCH);
+    for (i = 0; all && i < ctx->maxjobs; i++) {
+	job = &ctx->jobs[i];
+	if (job->pid != 0 && job_wait(ctx, job, WEXITED|WSTOPPED|WCONTINUED|WNOHANG, &status) > 0)
+	    handled++;
+    }
+    return handled;
+}
+
+/*
+ * tsh_waitfg - Block until there is no running foreground job, that
+ *    is, until it ends or stops. Returns its last wait status, 0 if
+ *    there was no foreground job, -1 on error.
+ */
+int tsh_waitfg(struct tsh_ctx_t *ctx)
+{
+    struct tsh_job_t *job;
+    int status = 0;
+
+    while ((job = tsh_getjobpid(ctx, tsh_fgpid(ctx))) != NULL)
+	if (job_wait(ctx, job, WEXITED|WSTOPPED, &status) < 0)
+	    return -1;
+    if (ctx->verbose)
+	fprintf(ctx->log, "waitfg: no foreground job\n");
+    return status;
+}
+
+/* tsh_signal - Send sig to the process group of a job */
+int tsh_signal(struct tsh_ctx_t *ctx, struct tsh_job_t *job, int sig)
+{
+    if (ctx->verbose)
+	fprintf(ctx->log, "signal %d to job [%d] (%d)\n", sig, job->jid, job->pid);
+    return kill(-job->pid, sig);
+}
+
+/*
+ * tsh_fgsignal - Forward a keyboard signal (SIGINT, SIGTSTP, ...) to
+ *    the foreground job, as tsh's handlers do. Returns -1 (ESRCH) if
+ *    there is no foreground job.
+ */
+int tsh_fgsignal(struct tsh_ctx_t *ctx, int sig)
+{
+    struct tsh_job_t *job;
+
+    if ((job = tsh_getjobpid(ctx, tsh_fgpid(ctx))) == NULL) {
+	errno = ESRCH;
+	return -1;
+    }
+    return tsh_signal(ctx, job, sig);
+}
+
+/* tsh_bg - Continue a job in the background */
+int tsh_bg(struct tsh_ctx_t *ctx, struct tsh_job_t *job)
+{
+    if (tsh_signal(ctx, job, SIGCONT) < 0)
+	return -1;
+    job->state = TSH_BG;
+    return 0;
+}
+
+/* tsh_fg - Continue a job in the foreground (then call tsh_waitfg) */
+int tsh_fg(struct tsh_ctx_t *ctx, struct tsh_job_t *job)
+{
+    if (tsh_signal(ctx, job, SIGCONT) < 0)
+	return -1;
+    job->state = TSH_FG;
+    return 0;
+}
+
+
+/*****************************************************
+ * Submission from many threads
+ *
+ * Launches and exit records travel through two lock-free queues (the
+ * same bounded design as tsh's spawner pool, with the data copied into
+ * the cells). Only the owner thread, inside tsh_serve, touches the
+ * context, so there is no lock around the job list. Eventfds wake the
+ * owner when it sleeps and tell the other threads when records arrive.
+ *****************************************************/
+
+/* lfq_init - Make an empty queue of at least n cells of size bytes */
+static int lfq_init(struct lfq_t *q, size_t n, size_t size)
+{
+    size_t i, cells = 1;
+
+    while (cells < n)
+	cells <<= 1;
+    q->size = size;
+    q->mask = cells - 1;
+    if ((q->cells = malloc(cells * (sizeof(atomic_size_t) + size))) == NULL)
+	return -1;
+    for (i = 0; i < cells; i++)
+	atomic_init((atomic_size_t *)(q->cells + i * (sizeof(atomic_size_t) + size)), i);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return 0;
+}
+
+/* lfq_cell - Return the cell for position pos */
+static atomic_size_t *lfq_cell(struct lfq_t *q, size_t pos)
+{
+    return (atomic_size_t *)(q->cells + (pos & q->mask) * (sizeof(atomic_size_t) + q->size));
+}
+
+/* lfq_push - Copy data onto the end of the queue, return 0 if it is full */
+static int lfq_push(struct lfq_t *q, const void *data)
+{
+    atomic_size_t *cell;
+    size_t pos, seq;
+    long dif;
+
+    pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (;;) {
+	cell = lfq_cell(q, pos);
+	seq = atomic_load_explicit(cell, memory_order_acquire);
+	dif = (long)seq - (long)pos;
+	if (dif == 0) {
+	    if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+		    memory_order_relaxed, memory_order_relaxed))
+		break;
+	}
+	else if (dif < 0)
+	    return 0;
+	else
+	    pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+    memcpy(cell + 1, data, q->size);
+    atomic_store_explicit(cell, pos + 1, memory_order_release);
+    return 1;
+}
+
+/* lfq_pop - Copy out and remove the oldest entry, return 0 if there is none */
+static int lfq_pop(struct lfq_t *q, void *data)
+{
+    atomic_size_t *cell;
+    size_t pos, seq;
+    long dif;
+
+    pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (;;) {
+	cell = lfq_cell(q, pos);
+	seq = atomic_load_explicit(cell, memory_order_acquire);
+	dif = (long)seq - (long)(pos + 1);
+	if (dif == 0) {
+	    if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+		    memory_order_relaxed, memory_order_relaxed))
+		break;
+	}
+	else if (dif < 0)
+	    return 0;
+	else
+	    pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+    memcpy(data, cell + 1, q->size);
+    atomic_store_explicit(cell, pos + q->mask + 1, memory_order_release);
+    return 1;
+}
+
+/* lfq_ready - Return true if the queue has an entry to pop */
+static int lfq_ready(struct lfq_t *q)
+{
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    return atomic_load_explicit(lfq_cell(q, pos), memory_order_acquire) == pos + 1;
+}
+
+/* queue_wake - Wake the owner if it is asleep in tsh_serve */
+static void queue_wake(struct tsh_queue_t *q)
+{
+    uint64_t one = 1;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->sleeping, memory_order_relaxed)
+	&& atomic_exchange(&q->sleeping, 0))
+	write(q->subfd, &one, sizeof(one));
+}
+
+/* queue_post - (owner) Post an exit record */
+static void queue_post(struct tsh_queue_t *q, void *tag, pid_t pid, int status, int err)
+{
+    struct tsh_exit_t rec;
+
+    rec.tag = tag;
+    rec.pid = pid;
+    rec.status = status;
+    rec.err = err;
+    lfq_push(&q->doneq, &rec);	/* (queue_room made sure it fits) */
+    q->posted++;
+}
+
+/* queue_note - (owner) Notify function: post the records of ended jobs */
+static void queue_note(struct tsh_ctx_t *ctx, struct tsh_job_t *job, int status, void *arg)
+{
+    struct tsh_queue_t *q = arg;
+
+    if (!WIFEXITED(status) && !WIFSIGNALED(status))
+	return;
+    queue_post(q, job->data, job->pid, status, 0);
+    q->running--;
+}
+
+/*
+ * queue_room - (owner) Return true if another launch can be started:
+ *    the job list has room, and so does the done queue for the record
+ *    of every job that is running, whoever is slow to collect them.
+ */
+static int queue_room(struct tsh_queue_t *q)
+{
+    size_t used = atomic_load(&q->doneq.tail) - atomic_load(&q->doneq.head);
+
+    return q->running < q->ctx->maxjobs && used + q->running < q->doneq.mask + 1;
+}
+
+/*
+ * tsh_queue_open - Create a submission queue of at least size entries
+ *    for ctx. The queue installs its own notify function on ctx, and
+ *    from then on ctx belongs to the thread that calls tsh_serve.
+ */
+struct tsh_queue_t *tsh_queue_open(struct tsh_ctx_t *ctx, int size)
+{
+    struct tsh_queue_t *q;
+
+    if (size < 1) {
+	errno = EINVAL;
+	return NULL;
+    }
+    if ((q = calloc(1, sizeof(*q))) == NULL)
+	return NULL;
+    q->subfd = q->donefd = -1;
+    if (lfq_init(&q->subq, size, sizeof(struct sub_t)) < 0
+	|| lfq_init(&q->doneq, size, sizeof(struct tsh_exit_t)) < 0
+	|| (q->subfd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK)) < 0
+	|| (q->donefd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK)) < 0) {
+	tsh_queue_close(q);
+	return NULL;
+    }
+    q->ctx = ctx;
+    atomic_init(&q->sleeping, 0);
+    tsh_setnotify(ctx, queue_note, q);
+    return q;
+}
+
+/* tsh_queue_close - Free a queue (its context is left open) */
+void tsh_queue_close(struct tsh_queue_t *q)
+{
+    if (q->ctx)
+	tsh_setnotify(q->ctx, NULL, NULL);
+    if (q->subfd >= 0)
+	close(q->subfd);
+    if (q->donefd >= 0)
+	close(q->donefd);
+    free(q->subq.cells);
+    free(q->doneq.cells);
+    free(q);
+}
+
+/*
+ * tsh_submit - (any thread) Queue argv (argv[0] a path) to be started
+ *    as a background job. Its exit record will carry tag. Returns -1
+ *    with errno EAGAIN if the queue is full, E2BIG if argv is too long.
+ */
+int tsh_submit(struct tsh_queue_t *q, char *const argv[], const char *cmdline, void *tag)
+{
+    struct sub_t sub;
+    size_t len, used = 0;
+
+    for (sub.argc = 0; argv[sub.argc]; sub.argc++) {
+	len = strlen(argv[sub.argc]) + 1;
+	if (sub.argc == TSH_MAXARGS - 1 || used + len > sizeof(sub.buf)) {
+	    errno = E2BIG;
+	    return -1;
+	}
+	memcpy(sub.buf + used, argv[sub.argc], len);
+	sub.argoff[sub.argc] = used;
+	used += len;
+    }
+    snprintf(sub.cmdline, sizeof(sub.cmdline), "%s", cmdline ? cmdline : argv[0]);
+    sub.tag = tag;
+    if (!lfq_push(&q->subq, &sub)) {
+	errno = EAGAIN;
+	return -1;
+    }
+    queue_wake(q);
+    return 0;
+}
+
+/*
+ * tsh_serve - (owner thread) Start the queued launches there is room
+ *    for and post the records of the jobs that ended, waiting up to
+ *    timeout ms (-1 = forever) if there is nothing to do. Returns the
+ *    number of launches and records handled.
+ */
+int tsh_serve(struct tsh_queue_t *q, int timeout)
+{
+    char *argv[TSH_MAXARGS];
+    struct tsh_job_t *job;
+    struct pollfd fds[2];
+    struct sub_t sub;
+    uint64_t n;
+    int i, handled;
+
+    for (;;) {
+	handled = 0;
+	q->posted = 0;
+	while (queue_room(q) && lfq_pop(&q->subq, &sub)) {
+	    for (i = 0; i < sub.argc; i++)
+		argv[i] = sub.buf + sub.argoff[i];
+	    argv[i] = NULL;
+	    if ((job = tsh_spawn(q->ctx, argv, NULL, TSH_BG, sub.cmdline)) != NULL) {
+		job->data = sub.tag;
+		q->running++;
+	    }
+	    else
+		queue_post(q, sub.tag, 0, 0, errno);
+	    handled++;
+	}
+	tsh_reap(q->ctx, 0);
+	if (q->posted > 0) {
+	    n = q->posted;
+	    write(q->donefd, &n, sizeof(n));
+	    handled += q->posted;
+	}
+	if (handled > 0 || timeout == 0)
+	    return handled;
+
+	/* Sleep until a submission, an exit or a collected record */
+	atomic_store(&q->sleeping, 1);
+	if (queue_room(q) && lfq_ready(&q->subq)) {
+	    atomic_store(&q->sleeping, 0);
+	    continue;
+	}
+	fds[0].fd = q->subfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = tsh_fd(q->ctx);
+	fds[1].events = POLLIN;
+	i = poll(fds, 2, timeout);
+	atomic_store(&q->sleeping, 0);
+	read(q->subfd, &n, sizeof(n));
+	if (i == 0)
+	    return 0;
+	timeout = 0;		/* (just collect what woke us) */
+    }
+}
+
+/*
+ * tsh_donefd - (any thread) Return the eventfd that is readable when
+ *    exit records have been posted. Read it, then call tsh_done until
+ *    it returns 0.
+ */
+int tsh_donefd(struct tsh_queue_t *q)
+{
+    return q->donefd;
+}
+
+/* tsh_done - (any thread) Take an exit record, return 0 if there is none */
+int tsh_done(struct tsh_queue_t *q, struct tsh_exit_t *rec)
+{
+    if (!lfq_pop(&q->doneq, rec))
+	return 0;
+    queue_wake(q);		/* (the owner may be waiting for room) */
+    return 1;
+}
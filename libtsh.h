@@ -0,0 +1,129 @@
+/*
+ * libtsh - The tsh job engine as a library
+ *
+ * The job-control core of tsh (spawning, the job list, state tracking,
+ * reaping and signal forwarding) for programs that want to run and
+ * control jobs themselves instead of driving a tsh process.
+ *
+ * Everything the engine knows lives in a context created by tsh_open:
+ * there are no globals, so a program can run as many engines as it
+ * likes. A context must only be used by one thread at a time.
+ *
+ * Children are watched with pidfds rather than a SIGCHLD handler, so
+ * the library installs no signal handlers and each context reaps only
+ * its own children. tsh_fd returns a descriptor that becomes readable
+ * whenever one of the context's jobs exits: add it to your own event
+ * loop and call tsh_reap when it is readable.
+ *
+ * Programs with many threads can hand launches to a tsh_queue_t
+ * instead: any thread may tsh_submit and collect exit records with
+ * tsh_done, while one owner thread calls tsh_serve and is the only one
+ * that touches the context, spawns or reaps.
+ *
+ * Build: gcc -c libtsh.c (Linux 5.4 or later for pidfds)
+ */
+#ifndef LIBTSH_H
+#define LIBTSH_H
+
+#include <stdio.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#define TSH_MAXLINE 1024  /* longest command line kept for a job */
+#define TSH_MAXARGS   64  /* most arguments of a submitted command */
+
+/* Job states (as in tsh) */
+#define TSH_UNDEF 0 /* undefined */
+#define TSH_FG    1 /* running in foreground */
+#define TSH_BG    2 /* running in background */
+#define TSH_ST    3 /* stopped */
+
+/* tsh_open flags */
+#define TSH_VERBOSE 1 /* log what the engine does (as tsh -v) */
+
+struct tsh_job_t {          /* A job */
+    pid_t pid;              /* job PID, also its process group */
+    int jid;                /* job ID [1, 2, ...] */
+    int state;              /* TSH_FG, TSH_BG or TSH_ST */
+    int stopsig;            /* signal that stopped the job (TSH_ST state) */
+    int pidfd;              /* readable once the job has exited */
+    char cmdline[TSH_MAXLINE]; /* command line */
+    void *data;             /* for the caller; the engine leaves it alone */
+};
+
+struct tsh_ctx_t;           /* An engine: its job list and options */
+struct tsh_queue_t;         /* Launches submitted by other threads */
+
+struct tsh_exit_t {         /* What happened to a submitted launch */
+    void *tag;              /* as given to tsh_submit */
+    pid_t pid;              /* the job's PID, 0 if it could not start */
+    int status;             /* its wait status (as from waitpid) */
+    int err;                /* errno from starting it, 0 if it started */
+};
+
+/*
+ * A notify function is called from tsh_reap and tsh_waitfg whenever a
+ * job stops, continues or ends, with the wait status (as from waitpid).
+ * When the job has ended it is deleted right after the call returns.
+ */
+typedef void tsh_notify_t(struct tsh_ctx_t *ctx, struct tsh_job_t *job, int status, void *arg);
+
+/* Contexts */
+struct tsh_ctx_t *tsh_open(int maxjobs, int flags);
+void tsh_close(struct tsh_ctx_t *ctx);
+void tsh_setlog(struct tsh_ctx_t *ctx, FILE *log);
+void tsh_setnotify(struct tsh_ctx_t *ctx, tsh_notify_t *fn, void *arg);
+int tsh_fd(struct tsh_ctx_t *ctx);
+
+/* Starting jobs */
+struct tsh_job_t *tsh_spawn(struct tsh_ctx_t *ctx, char *const argv[], char *const envp[],
+			    int state, const char *cmdline);
+struct tsh_job_t *tsh_addjob(struct tsh_ctx_t *ctx, pid_t pid, int state, const char *cmdline);
+int tsh_deletejob(struct tsh_ctx_t *ctx, pid_t pid);
+
+/* The job list */
+struct tsh_job_t *tsh_getjobpid(struct tsh_ctx_t *ctx, pid_t pid);
+struct tsh_job_t *tsh_getjobjid(struct tsh_ctx_t *ctx, int jid);
+int tsh_pid2jid(struct tsh_ctx_t *ctx, pid_t pid);
+pid_t tsh_fgpid(struct tsh_ctx_t *ctx);
+int tsh_numjobs(struct tsh_ctx_t *ctx);
+void tsh_listjobs(struct tsh_ctx_t *ctx, FILE *fp);
+
+/* Reaping and job control */
+int tsh_reap(struct tsh_ctx_t *ctx, int all);
+int tsh_waitfg(struct tsh_ctx_t *ctx);
+int tsh_signal(struct tsh_ctx_t *ctx, struct tsh_job_t *job, int sig);
+int tsh_fgsignal(struct tsh_ctx_t *ctx, int sig);
+int tsh_bg(struct tsh_ctx_t *ctx, struct tsh_job_t *job);
+int tsh_fg(struct tsh_ctx_t *ctx, struct tsh_job_t *job);
+
+/*
+ * tsh_wait_status - Turn what waitid reports into a waitpid status, so
+ * the WIF* macros work on it. Shared with tsh, which also reaps with
+ * waitid.
+ */
+static inline int tsh_wait_status(const siginfo_t *si)
+{
+    switch (si->si_code) {
+    case CLD_EXITED:
+	return (si->si_status & 0xff) << 8;
+    case CLD_KILLED:
+	return si->si_status;
+    case CLD_DUMPED:
+	return si->si_status | 0x80;
+    case CLD_CONTINUED:
+	return 0xffff;
+    default:			/* stopped or trapped */
+	return (si->si_status & 0xff) << 8 | 0x7f;
+    }
+}
+
+/* Submission from many threads */
+struct tsh_queue_t *tsh_queue_open(struct tsh_ctx_t *ctx, int size);
+void tsh_queue_close(struct tsh_queue_t *q);
+int tsh_submit(struct tsh_queue_t *q, char *const argv[], const char *cmdline, void *tag);
+int tsh_serve(struct tsh_queue_t *q, int timeout);
+int tsh_donefd(struct tsh_queue_t *q);
+int tsh_done(struct tsh_queue_t *q, struct tsh_exit_t *rec);
+
+#endif /* LIBTSH_H */
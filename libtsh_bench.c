@@ -0,0 +1,163 @@
+/*
+ * libtsh_bench - Throughput of the libtsh submission queue
+ *
+ * Several threads submit launches to one tsh_queue_t and collect the
+ * exit records, while the main thread owns the engine and serves the
+ * queue. Prints launches per second and submit-to-exit latencies.
+ *
+ * Build: gcc -O2 -pthread -o libtsh_bench libtsh_bench.c libtsh.c
+ * Usage: libtsh_bench [-t threads] [-n launches] [-j maxjobs] [-q size] [path args ...]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include "libtsh.h"
+
+struct tsh_queue_t *q;
+char **cmd;                 /* what every launch runs */
+int nthreads = 16;          /* submitting threads */
+long nlaunch = 20000;       /* launches in all */
+long long *t0;              /* submit time of each launch, by tag */
+long long *lat;             /* submit-to-exit latency of each record */
+atomic_long ndone;          /* records collected so far */
+atomic_long nfull;          /* submits refused because the queue was full */
+atomic_long nfailed;        /* launches that could not start */
+
+/* now_ns - Return a monotonic timestamp in nanoseconds */
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* collect - Take the exit records there are, return how many */
+int collect(void)
+{
+    struct tsh_exit_t rec;
+    long i = 0, k;
+    uint64_t n;
+
+    read(tsh_donefd(q), &n, sizeof(n));
+    while (tsh_done(q, &rec)) {
+	k = atomic_fetch_add(&ndone, 1);
+	lat[k] = now_ns() - t0[(intptr_t)rec.tag];
+	if (rec.err)
+	    atomic_fetch_add(&nfailed, 1);
+	i++;
+    }
+    return i;
+}
+
+/* submitter - Submit this thread's share of the launches, collecting records */
+void *submitter(void *arg)
+{
+    long id = (intptr_t)arg, i;
+    struct pollfd pfd;
+
+    pfd.fd = tsh_donefd(q);
+    pfd.events = POLLIN;
+    for (i = id; i < nlaunch; i += nthreads) {
+	t0[i] = now_ns();
+	while (tsh_submit(q, cmd, NULL, (void *)(intptr_t)i) < 0) {
+	    if (errno != EAGAIN) {
+		perror("tsh_submit");
+		exit(1);
+	    }
+	    atomic_fetch_add(&nfull, 1);
+	    if (collect() == 0)
+		poll(&pfd, 1, 1);	/* full: wait for records to free room */
+	    t0[i] = now_ns();
+	}
+    }
+    while (atomic_load(&ndone) < nlaunch)
+	if (collect() == 0)
+	    poll(&pfd, 1, 10);
+    return NULL;
+}
+
+/* cmp_ll - qsort comparison for long longs */
+int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    static char *dflt[] = { "/bin/true", NULL };
+    struct tsh_ctx_t *ctx;
+    pthread_t *tids;
+    long long start, secs;
+    int c, maxjobs = 256, qsize = 1024;
+    long i;
+
+    while ((c = getopt(argc, argv, "+t:n:j:q:")) != EOF) {
+	switch (c) {
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'n':
+	    nlaunch = atol(optarg);
+	    break;
+	case 'j':
+	    maxjobs = atoi(optarg);
+	    break;
+	case 'q':
+	    qsize = atoi(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "Usage: %s [-t threads] [-n launches] [-j maxjobs] [-q size] [path args ...]\n",
+		    argv[0]);
+	    exit(1);
+	}
+    }
+    cmd = (optind < argc) ? argv + optind : dflt;
+    if (nthreads < 1 || nlaunch < 1 || maxjobs < 1 || qsize < 1) {
+	fprintf(stderr, "%s: counts must be positive\n", argv[0]);
+	exit(1);
+    }
+
+    if ((ctx = tsh_open(maxjobs, 0)) == NULL || (q = tsh_queue_open(ctx, qsize)) == NULL) {
+	perror("tsh_open");
+	exit(1);
+    }
+    t0 = calloc(nlaunch, sizeof(long long));
+    lat = calloc(nlaunch, sizeof(long long));
+    tids = calloc(nthreads, sizeof(pthread_t));
+    if (!t0 || !lat || !tids) {
+	perror("calloc");
+	exit(1);
+    }
+
+    start = now_ns();
+    for (i = 0; i < nthreads; i++)
+	pthread_create(&tids[i], NULL, submitter, (void *)(intptr_t)i);
+    while (atomic_load(&ndone) < nlaunch)
+	tsh_serve(q, 10);		/* this thread owns the engine */
+    for (i = 0; i < nthreads; i++)
+	pthread_join(tids[i], NULL);
+    secs = now_ns() - start;
+
+    qsort(lat, nlaunch, sizeof(long long), cmp_ll);
+    printf("%ld launches of %s from %d threads (%d jobs at a time, queue %d) in %.3f s: %.1f launches/s\n",
+	   nlaunch, cmd[0], nthreads, maxjobs, qsize, secs / 1e9, nlaunch / (secs / 1e9));
+    printf("latency ms: p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+	   lat[nlaunch / 2] / 1e6, lat[nlaunch * 9 / 10] / 1e6,
+	   lat[nlaunch * 99 / 100] / 1e6, lat[nlaunch - 1] / 1e6);
+    printf("%ld submits refused (queue full), %ld launches failed\n",
+	   atomic_load(&nfull), atomic_load(&nfailed));
+    tsh_queue_close(q);
+    tsh_close(ctx);
+    return 0;
+}
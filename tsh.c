@@ -3,7 +3,9 @@
  * 
  * <Charlie Severson>
  */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -12,18 +14,115 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <netdb.h>
+#include <zlib.h>
+#include <dirent.h>
+#include "libtsh.h"
 
 /* Misc manifest constants */
 #define MAXLINE    1024   /* max line size */
 #define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
+#define MAXJOBS    1024   /* max jobs at any point in time */
 #define MAXJID    1<<16   /* max job ID */
+#define MAXSPAWNERS  64   /* max spawner threads */
+#define SPAWNQ      256   /* spawn queue slots (power of 2) */
+#define MAXEVENTS    64   /* epoll events handled per wakeup */
+#define RIO_BUFSIZE 8192  /* buffered input size */
+#define CAPLINE    4096   /* longest captured line kept whole */
+#define OUTBUFSIZE (256*1024) /* multiplexed output buffer */
+#define GZCHUNK  (128*1024) /* bytes compressed per event loop pass */
+#define THROTTLE_TICK  20   /* ms between checks of backpressured jobs */
+#define MAXAGENTS    64   /* max connected worker agents */
+#define AGENTBUF (128*1024) /* unparsed input from one agent */
+#define AGENTOUT (16*1024)  /* max job output carried per message */
+#define AGENT_TIMEOUT 5000  /* ms to wait for an agent to start a job */
+#define RPID_BASE 4194304   /* remote jobs' pids: RPID_BASE+rid, above any local pid */
+#define DISOWNTAB  2048   /* disowned pid table slots (power of 2) */
+#define FUNCTAB      64   /* alias and function hash buckets (power of 2) */
+#define MAXDEPTH     64   /* max nesting of function calls and sourced files */
+#define MAXPENDING (8*MAXLINE) /* longest command spread over several lines */
+#define VARTAB     1024   /* shell variable hash buckets (power of 2) */
+#define RIO_MAXFD    64   /* fds the read builtin keeps a buffer for */
+#define EXECCACHE    32   /* programs kept open for execveat */
+#define EXEC_RECHECK 1000000000LL /* ns between checks that a cached path is the same file */
+#define MAXCOPROCS   16   /* coprocesses with fds open at once */
+#define MAXSTAGES    16   /* pipeline stages pipestat measures */
+#define RELAYCHUNK (1<<20) /* most bytes one tee or splice call moves */
+#define MAXLIMITS     8   /* resource limits set by one limit prefix */
+#define OOM_UNSET (-1001) /* limits_t.oom: leave oom_score_adj alone */
+#define RINGSIZE    256   /* io_uring submission queue entries */
+#define RINGWAITS    32   /* child waits kept queued on the ring */
+#define RINGSRCS (MAXJOBS+MAXAGENTS+16) /* fds the ring can poll at once */
+#define RING_OP_WAITID 50 /* IORING_OP_WAITID (Linux 6.7), missing from older headers */
+#define AIMD_HIST    16   /* concurrency limits remembered for jobs */
+#define AIMD_MINWIN   4   /* fewest completions in one measuring window */
+#define AIMD_TOL    1.5   /* mean latency over baseline*AIMD_TOL is degraded */
+#define AIMD_DRIFT   64   /* the baseline moves 1/AIMD_DRIFT toward slower windows */
+#define MAXTAGS      32   /* fair share tags of batch lines (tag 0 is untagged) */
+#define TAGLEN       32   /* longest tag name */
+#define BATCHAHEAD 4096   /* batch lines read ahead into the pending queue */
+#define MAXRESQ     256   /* launches waiting for their declared resources */
+#define RESWAIT      30   /* default seconds a big job waits before backfill stops */
+#define NAMECHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_"
+
+/* Background stdin policies */
+#define IN_TTY  0 /* inherit the terminal (reads stop the job with SIGTTIN) */
+#define IN_NULL 1 /* /dev/null */
+#define IN_FILE 2 /* a file */
+#define IN_PIPE 3 /* a pipe the shell writes to with the feed builtin */
+
+/* What an io_uring completion is for (top byte of its user_data) */
+#define RING_NONE  0 /* nothing: cancellations */
+#define RING_SRC   1 /* a poll for an event source */
+#define RING_WAIT  2 /* a child wait */
+#define RING_TIMER 3 /* the evl_wait timeout */
+
+/* Command node types */
+#define CMD_SIMPLE   0 /* a program or builtin and its arguments */
+#define CMD_SUBSHELL 1 /* ( list ): run in a forked child */
+#define CMD_GROUP    2 /* { list; }: run in the shell itself */
+#define CMD_FUNCDEF  3 /* name() group: define a function */
+#define CMD_WHILE    4 /* while list; do list; done */
+#define CMD_PIPE     5 /* cmd | cmd ...: the stages are the body */
+#define CMD_FANOUT   6 /* |> ( pipe, pipe ... ): last stage, the consumers are the body */
+
+/* Unquoted brace characters, as the lexer marks them for brace expansion */
+#define BR_OPEN  '\001'
+#define BR_CLOSE '\002'
+#define BR_COMMA '\003'
+
+/* Output throttle modes */
+#define THR_DROP  0 /* read everything, drop what is over budget */
+#define THR_BLOCK 1 /* stop reading, so the job blocks on a full pipe */
+
+/* Values of job_t.batch */
+#define BATCH_JOB  1 /* started by the batch builtin */
+#define REPEAT_JOB 2 /* started by the repeat builtin, latency is recorded */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
 #define FG 1    /* running in foreground */
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
+#define SL 4    /* background, but stopped by gang between time slices */
 
 /* 
  * Jobs states: FG (foreground), BG (background), ST (stopped)
@@ -32,6 +131,9 @@
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
+ *     BG -> SL  : its time slice is over (gang)
+ *     SL -> BG  : its next time slice, or kill
+ *     SL -> FG  : fg command
  * At most 1 job can be in the FG state.
  */
 
@@ -47,8 +149,358 @@ struct job_t {              /* The job struct */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
     char cmdline[MAXLINE];  /* command line */
+    int batch;              /* BATCH_JOB, REPEAT_JOB, or 0 for other jobs */
+    struct capture_t *cap;  /* output pipe, if the shell reads the output */
+    int stopsig;            /* signal that stopped the job (ST state) */
+    int feedfd;             /* write end of the job's stdin pipe, or -1 */
+    int agent;              /* agent running the job, 0 if it is local */
+    int rid;                /* the job's launch ID on that agent */
+    pid_t rpid;             /* its pid on that agent */
+    long long t0;           /* (batch, repeat) time its launch was requested */
+    struct pstat_t *pstat;  /* pipeline measurements (pipestat on), or NULL */
+    struct termios tmodes;  /* its terminal modes when it last stopped */
+    int tmodes_saved;       /* if true, tmodes is set */
+    long long deadline;     /* (batch) when it should be done, 0 for none */
+    long long sliced;       /* (gang) when it last ran to the end of a time slice */
+    int cpus;               /* CPUs reserved for it (cmd & cpus=N), 0 for none */
+    long long mem;          /* bytes reserved for it (cmd & mem=SIZE), 0 for none */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
+
+struct var_t {              /* A shell variable */
+    char *name;
+    char *value;
+    size_t size;            /* bytes allocated for value */
+    struct var_t *next;     /* next in the hash bucket */
+};
+
+struct func_t {             /* A shell function or an alias */
+    char *name;
+    struct cmd_t *body;     /* parsed once, when it is defined */
+    char *value;            /* (alias) the text it was defined with */
+    int busy;               /* calls in progress; the body must stay */
+    int dead;               /* unset or redefined while busy: the last call frees it */
+    struct func_t *next;    /* next in the hash bucket */
+};
+
+struct cmd_t {              /* One command of a parsed list */
+    int type;               /* CMD_SIMPLE, CMD_SUBSHELL, CMD_PIPE ... */
+    int bg;                 /* followed by '&' */
+    char **argv;            /* CMD_SIMPLE: arguments, in one allocation */
+    struct cmd_t *body;     /* the list inside a group or loop, the group of a FUNCDEF,
+                               the stages of a pipeline */
+    struct cmd_t *cond;     /* CMD_WHILE: the condition list */
+    struct cmd_t *next;     /* next command of the list */
+    char *text;             /* source text, for the job list */
+    int dyn;                /* has $var or $((...)) to expand on each run */
+};
+
+struct rlimname_t {         /* A resource ulimit and limit know about */
+    char opt;               /* ulimit option letter */
+    char *name;             /* limit keyword */
+    int res;                /* RLIMIT_* */
+    int unit;               /* bytes in one unit of a plain ulimit value */
+    char *desc;
+};
+
+struct limits_t {           /* Limits for one job: limit name=value ... -- cmd */
+    int n;                  /* entries used in res[] and val[] */
+    int res[MAXLIMITS];     /* RLIMIT_* */
+    rlim_t val[MAXLIMITS];
+    int oom;                /* oom_score_adj for the job, or OOM_UNSET */
+};
+
+struct pstage_t {           /* The relay between two stages of a measured pipeline */
+    long long bytes;        /* bytes passed on */
+    long long inwait;       /* ns it waited for the stage before (pipe empty) */
+    long long outwait;      /* ns it waited for the stage after (pipe full) */
+    long long t0, t1;       /* when it started, and last moved data or woke */
+};
+
+struct pstat_t {            /* Measurements of a pipeline job, shared with its relays */
+    int n;                  /* stages measured */
+    char name[MAXSTAGES][32];
+    struct pstage_t b[MAXSTAGES-1]; /* b[i] is between stage i and stage i+1 */
+};
+
+struct exec_t {             /* A program kept open for execveat (exec cache) */
+    char path[MAXLINE/4];   /* as it was given on the command line */
+    int fd;                 /* O_PATH, close-on-exec; -1 if the slot is free */
+    dev_t dev;              /* the file it was when opened */
+    ino_t ino;
+    struct timespec mtime;
+    long long checked;      /* when path last led to it (ns) */
+    long long used;         /* LRU clock at its last launch */
+    int hits;               /* launches through the fd */
+};
+
+struct coproc_t {           /* A coprocess started with the coproc builtin */
+    char name[32];          /* NAME: its fds are in $NAME_0 and $NAME_1 */
+    pid_t pid;              /* its pid, 0 if the slot is free */
+    int rfd;                /* read end of a pipe from its stdout */
+    int wfd;                /* write end of a pipe to its stdin, -1 once closed */
+};
+
+struct argbuf {             /* An argv being built by the lexer */
+    char *buf;              /* the words, each null-terminated */
+    size_t len, size;
+    size_t *off;            /* where each word starts in buf */
+    int argc, max;
+};
+
+struct spawn_req {          /* A launch handed to the spawner pool */
+    char *argv[MAXARGS];    /* argument vector (points into buf) */
+    char buf[MAXLINE];      /* private copy of the parsed arguments */
+    char cmdline[MAXLINE];  /* command line, for the job list */
+    pid_t pid;              /* new pid, filled in by the spawner */
+    int err;                /* posix_spawn error, 0 on success */
+    struct capture_t *cap;  /* output pipe for the job, or NULL */
+    int infd;               /* stdin pipe read end for the job, or -1 */
+    int feedfd;             /* ... and its write end, kept by the shell */
+    long long t0;           /* time the request was made */
+    long long deadline;     /* (batch) deadline of the line, 0 for none */
+};
+
+struct aimd_t {             /* Adaptive concurrency of batch and repeat -j auto */
+    int on;                 /* if true, completions are being measured */
+    int limit;              /* jobs allowed to run at once */
+    int max;                /* ... never more than this */
+    int lo, hi;             /* smallest and largest limit of the run */
+    int slow;               /* if true, still doubling (no backoff yet) */
+    long long wstart;       /* when the current window started */
+    int wdone;              /* completions in the current window */
+    long long wlat;         /* ... and their latencies added up, in ns */
+    double tput;            /* completions per second in the last window */
+    double lat;             /* mean latency in the last window, in ns */
+    double base;            /* baseline latency, in ns */
+    int nwin;               /* windows measured */
+    int hist[AIMD_HIST];    /* limit after each window, circular */
+};
+
+struct tag_t {              /* A fair share tag of batch lines */
+    char name[TAGLEN];
+    double weight;          /* its share relative to the other tags */
+    double vfinish;         /* virtual finish time of its last queued line */
+};
+
+struct pend_t {             /* A batch line waiting for a slot */
+    int prio;               /* higher starts first */
+    long long deadline;     /* then earliest deadline first, LLONG_MAX for none */
+    double vfinish;         /* then by fair share across tags */
+    long seq;               /* then in file order */
+    int tag;                /* index in tags[] */
+    char *line;             /* the command (malloc'd, ends in a newline) */
+};
+
+struct pq_t {               /* The pending queue: a binary min-heap of pend_t */
+    struct pend_t *v;
+    int n, size;
+};
+
+struct res_t {              /* Resources declared for a job: cmd & cpus=N mem=SIZE */
+    int cpus;
+    long long mem;
+};
+
+struct resreq_t {           /* A launch waiting until its resources fit */
+    char buf[MAXLINE];      /* its arguments, each ending in a null */
+    int argc;
+    char cmdline[MAXLINE];  /* command line, for the job list */
+    struct res_t res;       /* what it declared */
+    long long t0;           /* when it was queued */
+};
+
+struct lfq_cell {           /* One slot of a lock-free queue */
+    atomic_size_t seq;
+    void *data;
+};
+struct lfq {                /* Bounded multi-producer/multi-consumer queue */
+    struct lfq_cell cell[SPAWNQ];
+    atomic_size_t head;
+    atomic_size_t tail;
+};
+
+struct evsrc_t {            /* Something the event loop waits on */
+    int fd;
+    void (*handler)(struct evsrc_t *src, unsigned events);
+    int ring;               /* (io_uring) its slot in ringsrcs[] */
+};
+
+struct ringsrc_t {          /* An event source polled through the ring */
+    struct evsrc_t *src;    /* NULL if the slot is free */
+    unsigned gen;           /* bumped whenever the slot's poll is replaced */
+    unsigned events;        /* events watched for, 0 = paused */
+    int armed;              /* a poll for this generation is queued */
+};
+
+struct uring_t {            /* The shell's io_uring instance (tsh -u) */
+    int fd;                 /* -1 if the event loop uses epoll */
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    int nwaits;             /* child waits queued */
+    int nochild;            /* the last wait found no children */
+    long long deadline;     /* when the queued timer fires, 0 = none */
+    unsigned timergen;      /* generation of the queued timer */
+    struct __kernel_timespec ts; /* its timeout */
+};
+
+struct capture_t {          /* A job's output pipe, read by the shell */
+    struct evsrc_t src;     /* read end, registered with the event loop */
+    int wfd;                /* write end, until it is handed to the job */
+    int jid;                /* job that owns the pipe */
+    pid_t pid;              /* pid of that job */
+    int logfd;              /* spool file, or -1 to multiplex to the terminal */
+    off_t logsize;          /* bytes in the current spool segment */
+    int seg;                /* spool segments rotated so far */
+    long spoolid;           /* start time in its spool file name */
+    int prefix;             /* if true, prefix lines with [jid] */
+    long long rate;         /* output budget in bytes/s, 0 = unlimited */
+    int mode;               /* THR_DROP or THR_BLOCK */
+    long long tokens;       /* bytes the job may still write now */
+    long long refill;       /* time tokens were last topped up (ns) */
+    long long passed;       /* bytes passed on */
+    long long dropped;      /* bytes dropped (THR_DROP) */
+    long long noted;        /* dropped bytes already reported */
+    long long notetime;     /* time of the last report (ns) */
+    int skipline;           /* drop input up to the next newline */
+    int paused;             /* not reading, job is backpressured */
+    struct capture_t *pnext; /* next capture on the paused list */
+    size_t len;             /* bytes of an unfinished line in line[] */
+    char line[CAPLINE];
+};
+
+struct gzjob_t {            /* A rotated spool segment waiting to be compressed */
+    int in;                 /* the segment, open for reading */
+    gzFile out;             /* path.gz.tmp, renamed to path.gz when done */
+    char path[MAXLINE];
+    struct gzjob_t *next;
+};
+
+struct agent_t {            /* A worker tsh connected to this shell */
+    struct evsrc_t src;     /* the connection */
+    int id;                 /* agent ID [1, 2, ...] */
+    char pool[32];          /* pool named by @pool on a command line */
+    int slots;              /* jobs it runs at once (its CPUs) */
+    int running;            /* jobs it is running for us */
+    size_t len;             /* bytes in buf */
+    char buf[AGENTBUF];     /* unparsed messages */
+};
+
+struct launch_t {           /* A remote launch waiting for its START */
+    int rid;                /* launch ID, 0 if none is waiting */
+    int agent;
+    int state;              /* FG or BG */
+    char *cmdline;
+    pid_t pid;              /* its pid in jobs[] (RPID_BASE+rid), once started */
+    int done;               /* set when the agent has answered */
+};
+
+struct disown_t {           /* A process that was dropped from jobs[] */
+    pid_t pid;              /* 0 if the slot is free */
+    char cmd[64];           /* start of its command line */
+};
+
+struct task_t {             /* (agent side) A job run for the coordinator */
+    struct evsrc_t src;     /* the job's output pipe, -1 once closed */
+    int id;                 /* launch ID from the coordinator */
+    pid_t pid;              /* 0 once reaped */
+};
+
+typedef struct {            /* Buffered input (as in the CS:APP Rio package) */
+    int rio_fd;             /* descriptor for this internal buf */
+    int rio_pipe;           /* fd can't seek, so buffered bytes can't be handed back */
+    int rio_cnt;            /* unread bytes in internal buf */
+    char *rio_bufptr;       /* next unread byte in internal buf */
+    char rio_buf[RIO_BUFSIZE];
+} rio_t;
+
+int nspawners = 0;          /* spawner threads (0 = spawn from main thread) */
+struct lfq spawnq;          /* requests: main thread -> spawners */
+struct lfq doneq;           /* results: spawners -> main thread */
+sem_t spawn_sem;            /* counts requests waiting in spawnq */
+sem_t done_sem;             /* counts results waiting in doneq */
+struct spawn_req spawnreqs[SPAWNQ]; /* request slots for one launch burst */
+
+int epfd = -1;              /* the shell's epoll instance */
+int use_ring = 0;           /* if true, try io_uring for the event loop */
+struct uring_t ring = { -1 }; /* the io_uring backend, if in use */
+struct ringsrc_t ringsrcs[RINGSRCS];
+siginfo_t ringwaits[RINGWAITS]; /* where queued child waits report */
+char ringwaiting[RINGWAITS]; /* which of them are queued */
+int outmux = 0;             /* if true, bg job output goes through capture pipes */
+int outmux_ts = 0;          /* if true, prefix captured lines with a timestamp */
+int ncaptures = 0;          /* capture pipes still open */
+char outbuf[OUTBUFSIZE];    /* complete lines waiting to be written */
+size_t outlen = 0;          /* bytes used in outbuf */
+rio_t rio_stdin;            /* the shell's command input */
+char spooldir[MAXLINE/2];   /* if set, bg job output is spooled here */
+long long spoolmax = 64<<20; /* rotate spool files at this size */
+struct gzjob_t *gzq = NULL; /* segments waiting to be compressed */
+struct gzjob_t *gzqtail = NULL;
+long long throttle_rate = 0; /* output budget for new bg jobs, 0 = none */
+int throttle_mode = THR_DROP;
+struct capture_t *pausedq = NULL; /* captures held back for their budget */
+struct agent_t *agents[MAXAGENTS+1]; /* connected agents, by ID */
+struct evsrc_t agent_lsrc = { -1, NULL }; /* listening socket for agents */
+struct launch_t rlaunch;    /* the remote launch in progress */
+int nextrid = 1;            /* next remote launch ID */
+int agent_conn = -1;        /* (agent side) connection to the coordinator */
+struct task_t *tasks[MAXJOBS]; /* (agent side) jobs being run */
+struct disown_t disowned[DISOWNTAB]; /* open-addressed by pid */
+int ndisowned = 0;          /* disowned processes not yet reaped */
+int subreaper = 0;          /* if true, orphaned descendants are reparented to us */
+int ttyfd = -1;             /* the controlling terminal, if the shell runs on one */
+pid_t shell_pgid;           /* the shell's process group */
+struct termios shell_tmodes; /* the shell's terminal modes */
+volatile sig_atomic_t fgstatus; /* wait status of the last foreground job */
+struct func_t *funcs[FUNCTAB]; /* shell functions, hashed by name */
+struct func_t *aliases[FUNCTAB]; /* aliases, hashed by name */
+char **fargv = NULL;        /* arguments of the running function ($1 ...) */
+int depth = 0;              /* function calls and sources in progress */
+char pending[MAXPENDING];   /* lines of a command that is not complete yet */
+struct var_t *vars[VARTAB]; /* shell variables, hashed by name */
+int exitstatus = 0;         /* status of the last command ($?) */
+rio_t *rio_fds[RIO_MAXFD];  /* read -u buffers, by fd (fd 0 uses rio_stdin) */
+long long *replat = NULL;   /* (repeat) latency of each finished run, in ns */
+volatile int repdone = 0;   /* (repeat) entries filled in replat */
+int repmax = 0;             /* (repeat) size of replat */
+volatile sig_atomic_t intrpending = 0; /* ctrl-c with no foreground job */
+struct aimd_t aimd;         /* the -j auto controller of the last batch or repeat */
+struct tag_t tags[MAXTAGS]; /* fair share tags seen by batch, tags[0] is "" */
+int ntags = 0;              /* tags in use */
+double vclock = 0;          /* (batch) virtual time: vfinish of the last line started */
+int deadmiss = 0;           /* (batch) jobs that ended past their deadline */
+int gang_slots = 0;         /* gang: bg jobs running at once, 0 = no time slicing */
+int gang_quantum = 200;     /* gang: length of a time slice, in ms */
+long long gang_next = 0;    /* gang: when the current slice ends, 0 if not slicing */
+pid_t gang_owner;           /* gang: the shell (subshells leave the jobs alone) */
+struct res_t resbudget;     /* resources the shell may reserve, cpus 0 until set */
+int reswait = RESWAIT;      /* seconds backfill may pass over the oldest waiting launch */
+struct resreq_t resq[MAXRESQ]; /* waiting launches, oldest first */
+int nresq = 0;              /* entries in resq */
+pid_t res_owner;            /* the shell that queued them (not a subshell) */
+int parse_partial = 0;      /* set when parse_list ran out of input */
+struct exec_t execs[EXECCACHE]; /* exec cache, fd -1 in free slots */
+long long execclock = 0;    /* LRU clock of the exec cache */
+struct coproc_t coprocs[MAXCOPROCS]; /* coprocesses, by slot */
+int pipestat = 0;           /* if true, pipelines are measured between stages */
+struct pstat_t *pstat = NULL; /* (pipeline job) where its relays record */
+int parse_fanout = 0;       /* parsing the consumers of |> (...): ',' ends a word */
+struct rlimname_t rlimnames[] = { /* ulimit -a order */
+    { 'c', "core",   RLIMIT_CORE,   1024, "core file size (kbytes)" },
+    { 'd', "data",   RLIMIT_DATA,   1024, "data seg size (kbytes)" },
+    { 'f', "fsize",  RLIMIT_FSIZE,  1024, "file size (kbytes)" },
+    { 'n', "nofile", RLIMIT_NOFILE, 1,    "open files" },
+    { 's', "stack",  RLIMIT_STACK,  1024, "stack size (kbytes)" },
+    { 't', "cpu",    RLIMIT_CPU,    1,    "cpu time (seconds)" },
+    { 'u', "nproc",  RLIMIT_NPROC,  1,    "max user processes" },
+    { 'v', "mem",    RLIMIT_AS,     1024, "virtual memory (kbytes)" },
+    { 0, NULL, 0, 0, NULL }
+};
+int bgstdin = IN_TTY;       /* stdin policy for background jobs */
+char bgstdin_path[MAXLINE]; /* file for IN_FILE */
 /* End global variables */
 
 
@@ -56,11 +508,55 @@ struct job_t jobs[MAXJOBS]; /* The job list */
 
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
+void run_simple(char **argv, int bg, char *cmdline);
+pid_t launch(char **argv, struct cmd_t *group, int bg, char *cmdline, int nohup, struct limits_t *lim);
+void exec_cmd(char **argv);
+int run_list(struct cmd_t *c);
+int run_group(struct cmd_t *c, int last);
+int run_pipe(struct cmd_t *c);
+int call_func(struct func_t *f, char **argv, int bg, char *cmdline, int sub);
+char **alias_apply(char **argv, char **args);
+char **expand_args(char **argv);
+void do_source(char **argv);
+void do_alias(char **argv);
+void do_read(char **argv);
+void do_print(char **argv);
+void do_coproc(char **argv);
+void coproc_close(struct coproc_t *cp);
+void coproc_reap(void);
+void do_hash(char **argv);
+void do_ulimit(char **argv);
 int builtin_cmd(char **argv);
 void do_bgfg(char **argv);
 void waitfg(pid_t pid);
+void do_batch(char **argv);
+void do_repeat(char **argv);
+void do_outmux(char **argv);
+void do_spool(char **argv);
+void do_joblog(char **argv);
+void do_throttle(char **argv);
+void do_gang(char **argv);
+void do_resources(char **argv);
+void do_bgstdin(char **argv);
+void do_feed(char **argv);
+void do_agents(char **argv);
+void do_kill(char **argv);
+void do_disown(char **argv);
+void reap_untracked(pid_t pid, int status);
+void signaljob(struct job_t *job, int sig);
+int bgstdin_open(int *feedfd);
+void bgstdin_child(int infd);
+void tty_init(void);
+int tty_owner(void);
+void tty_handoff(pid_t pgid);
+void tty_give(struct job_t *job);
+void tty_take(struct job_t *job);
+void tee_relay(int in, int out, int next);
+void stat_relay(int in, int out, struct pstage_t *st);
+void do_pipestat(char **argv);
 
 void sigchld_handler(int sig);
+void child_status(pid_t pid, int status);
 void sigtstp_handler(int sig);
 void sigint_handler(int sig);
 
@@ -70,9 +566,103 @@ int Sigemptyset(sigset_t *set);
 int Sigaddset(sigset_t *set, int signum); 
 int Sigprocmask(int SIG, sigset_t *set,sigset_t * rewrite); 
 
+void lfq_init(struct lfq *q);
+int lfq_push(struct lfq *q, void *data);
+void *lfq_pop(struct lfq *q);
+void spawner_init(int n);
+void *spawner_thread(void *arg);
+void spawn_one(struct spawn_req *req, posix_spawnattr_t *attr);
+void spawn_attr_init(posix_spawnattr_t *attr);
+int spawn_burst(struct spawn_req *reqs, int n);
+int batchjobs(struct job_t *jobs);
+void aimd_start(int max);
+void aimd_done(long long lat);
+void aimd_print(void);
+int tag_find(const char *name, int add);
+char *pend_parse(char *line, struct pend_t *e, long long start);
+void pq_push(struct pq_t *q, struct pend_t *e);
+void pq_pop(struct pq_t *q, struct pend_t *e);
+void gang_tick(void);
+void gang_release(void);
+int res_strip(char *cmdline, struct res_t *res);
+void res_init(void);
+void res_used(struct res_t *used);
+void res_queue(char **argv, char *cmdline, struct res_t *res);
+void res_sched(void);
+
+void evl_init(void);
+void evl_add(struct evsrc_t *src, unsigned events);
+void evl_mod(struct evsrc_t *src, unsigned events);
+void evl_del(struct evsrc_t *src);
+int evl_wait(int timeout, sigset_t *mask);
+void evl_waitfd(int fd);
+void evl_ready(struct evsrc_t *src, unsigned events);
+struct capture_t *capture_open(void);
+struct capture_t *capture_new(void);
+void capture_prefix(struct capture_t *cap);
+void capture_attach(struct capture_t *cap, int jid, pid_t pid);
+void capture_read(struct evsrc_t *src, unsigned events);
+void capture_emit(struct capture_t *cap, const char *data, size_t n);
+void outmux_line(struct capture_t *cap, const char *data, size_t n, int addnl);
+void outmux_flush(void);
+int evl_active(void);
+int uring_init(void);
+void uring_forget(void);
+void uring_add(struct evsrc_t *src, unsigned events);
+void uring_mod(struct evsrc_t *src, unsigned events);
+void uring_del(struct evsrc_t *src);
+int uring_wait(int timeout, sigset_t *mask);
+int uring_reap(void);
+void spool_path(char *path, pid_t pid, long id);
+long spool_find(pid_t pid);
+void spool_write(struct capture_t *cap, const char *data, size_t n);
+void spool_rotate(struct capture_t *cap);
+void spool_work(void);
+void throttle_refill(struct capture_t *cap);
+size_t throttle_drop(struct capture_t *cap, char **data, size_t n);
+void throttle_note(struct capture_t *cap, int force);
+void throttle_resume(void);
+
+int sock_open(char *addr, int server);
+int sock_write(int fd, const char *buf, size_t n);
+void agent_accept(struct evsrc_t *src, unsigned events);
+void agent_read(struct evsrc_t *src, unsigned events);
+void agent_msg(struct agent_t *a, char *line, char *data, int n);
+void agent_drop(struct agent_t *a);
+void agent_send(struct agent_t *a, char *fmt, ...);
+struct job_t *agent_job(struct agent_t *a, int rid);
+void agent_launch(char *cmdline, int bg);
+int agent_main(char *addr, char *pool, int slots);
+void agent_conn_read(struct evsrc_t *src, unsigned events);
+void agent_run(int id, char *cmdline);
+void agent_task_read(struct evsrc_t *src, unsigned events);
+void agent_reap(struct evsrc_t *src, unsigned events);
+void agent_task_release(struct task_t *t);
+ssize_t agent_task_forward(struct task_t *t);
+
+void rio_readinitb(rio_t *rp, int fd);
+ssize_t rio_fill(rio_t *rp);
+ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+void rio_sync(rio_t *rp);
+int numjobs(struct job_t *jobs);
+
 
 /* Here are helper routines that we've provided for you */
 int parseline(const char *cmdline, char **argv); 
+struct cmd_t *parse_list(const char *cmdline);
+struct cmd_t *parse_cmds(const char **sp, const char *close, int *err);
+struct cmd_t *parse_pipe(const char **sp, int *err);
+struct cmd_t *parse_cmd(const char **sp, int *err);
+void free_cmds(struct cmd_t *c);
+long long arith(const char *s, size_t n, int *err);
+const char *arith_end(const char *s);
+struct func_t *func_find(struct func_t **tab, char *name);
+struct func_t *func_define(struct func_t **tab, char *name, struct cmd_t *body);
+void func_remove(struct func_t **tab, char *name);
+void func_free(struct func_t *f);
+char *var_get(const char *name, size_t n);
+void var_set(const char *name, const char *value, size_t n);
+void var_unset(const char *name);
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
@@ -83,10 +673,25 @@ int deletejob(struct job_t *jobs, pid_t pid);
 pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
 struct job_t *getjobjid(struct job_t *jobs, int jid); 
+struct job_t *getjobarg(struct job_t *jobs, char *arg);
 int pid2jid(pid_t pid); 
-void listjobs(struct job_t *jobs);
+void disown_add(pid_t pid, char *cmdline);
+struct disown_t *disown_find(pid_t pid);
+void disown_remove(struct disown_t *d);
+void listjobs(struct job_t *jobs, int details);
+void jobdetails(struct job_t *job);
+struct pstat_t *pstat_open(struct cmd_t *pipe);
+void pstat_print(struct pstat_t *ps);
 
 void usage(void);
+long long parse_size(const char *s);
+struct rlimname_t *rlim_find(int opt, const char *name);
+int rlim_value(struct rlimname_t *r, const char *s, int units, rlim_t *val);
+char **limit_parse(char **argv, struct limits_t *lim);
+int limits_apply(struct limits_t *lim);
+int exec_cache(const char *path, int add);
+void exec_flush(void);
+long long now_ns(void);
 void unix_error(char *msg);
 void app_error(char *msg);
 typedef void handler_t(int);
@@ -99,14 +704,36 @@ int main(int argc, char **argv)
 {
     char c;
     char cmdline[MAXLINE];
+    ssize_t n;
     int emit_prompt = 1; /* emit prompt (default) */
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
+    /* tsh --agent ADDR [--pool NAME] [--slots N] runs a worker for a
+     * coordinating shell instead of an interactive shell */
+    if (argc > 1 && !strcmp(argv[1], "--agent")) {
+	char *pool = "default";
+	int i, slots = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (argc < 3)
+	    usage();
+	for (i = 3; i + 1 < argc; i += 2) {
+	    if (!strcmp(argv[i], "--pool"))
+		pool = argv[i+1];
+	    else if (!strcmp(argv[i], "--slots") && atoi(argv[i+1]) > 0)
+		slots = atoi(argv[i+1]);
+	    else
+		usage();
+	}
+	if (i != argc)
+	    usage();
+	exit(agent_main(argv[2], pool, slots));
+    }
+
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvprus:")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -117,6 +744,17 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
 	    break;
+        case 'r':             /* reap orphaned descendants too */
+            subreaper = 1;
+	    break;
+        case 'u':             /* run the event loop on io_uring */
+            use_ring = 1;
+	    break;
+        case 's':             /* start a pool of spawner threads */
+            nspawners = atoi(optarg);
+            if (nspawners < 0 || nspawners > MAXSPAWNERS)
+                usage();
+	    break;
 	default:
             usage();
 	}
@@ -132,8 +770,20 @@ int main(int argc, char **argv)
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler); 
 
-    /* Initialize the job list */
+    if (subreaper && prctl(PR_SET_CHILD_SUBREAPER, 1) < 0)
+	unix_error("prctl error");
+
+    /* Take the terminal, if we were started on one */
+    tty_init();
+
+    /* Initialize the job list, the event loop and the input buffer */
     initjobs(jobs);
+    exec_flush();		/* (marks the exec cache empty) */
+    evl_init();
+    rio_readinitb(&rio_stdin, STDIN_FILENO);
+
+    /* Start the spawner threads, if any were requested */
+    spawner_init(nspawners);
 
     /* Execute the shell's read/eval loop */
     while (1) {
@@ -143,15 +793,22 @@ int main(int argc, char **argv)
 	    printf("%s", prompt);
 	    fflush(stdout);
 	}
-	if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-	    app_error("fgets error");
-	if (feof(stdin)) { /* End of file (ctrl-d) */
+	if ((n = rio_readlineb(&rio_stdin, cmdline, MAXLINE - 1)) < 0)
+	    app_error("rio_readlineb error");
+	if (n == 0) { /* End of file (ctrl-d) */
+	    gang_release();
+	    outmux_flush();
 	    fflush(stdout);
 	    exit(0);
 	}
+	if (cmdline[n-1] != '\n') { /* last line without a newline */
+	    cmdline[n++] = '\n';
+	    cmdline[n] = '\0';
+	}
 
 	/* Evaluate the command line */
 	eval(cmdline);
+	coproc_reap();
 	fflush(stdout);
 	fflush(stdout);
     } 
@@ -228,555 +885,6345 @@ int Sigprocmask(int SIG, sigset_t *set, sigset_t * rewrite)
 void eval(char *cmdline) 
 {
 	char* argv[MAXARGS];         				/* Array that will hold command line arguments */ 
-	char buf[MAXLINE];					/* Holds modified command line */
 	int bg; 	                   			/* Boolean for telling if command is bg or fg */           
-	sigset_t mask;                	 			/* Used to create the blocking set */ 
-	pid_t pid;                   				/* Process id */
-		
-	strcpy(buf, cmdline);
+	struct cmd_t *list;					/* Parsed command list */
+	char *amp;						/* A '&' in the line, if any */
+	struct res_t res;					/* Declared as cmd & cpus=N mem=SIZE */
+	int resd;
+
+	if(ring.fd >= 0)
+		uring_reap();					/* Catch up on children (io_uring: no SIGCHLD reaping) */
+	if(pending[0])						/* Continue an unfinished command */
+		{
+		if(strlen(pending) + strlen(cmdline) >= MAXPENDING)
+			{
+			printf("command too long \n");
+			pending[0] = '\0';
+			return;
+			}
+		cmdline = strcat(pending, cmdline);
+		}
+	if((resd = res_strip(cmdline, &res)) < 0)		/* Take a resource declaration off the end */
+		{
+		printf("bad cpus= or mem= declaration \n");
+		pending[0] = '\0';
+		return;
+		}
+	amp = strchr(cmdline, '&');
+	if(cmdline == pending || strpbrk(cmdline, ";(){}$|") || (amp && amp[1 + strspn(amp + 1, " \t\n")])
+	   || !strncmp(cmdline + strspn(cmdline, " \t"), "while", 5))
+								/* Lists and groups need the list parser */
+		{
+		if(resd)
+			{
+			printf("cpus= and mem= are for simple commands \n");
+			pending[0] = '\0';
+			return;
+			}
+		list = parse_list(cmdline);
+		if(list == NULL && parse_partial)		/* e.g. f() { ... over several lines */
+			{
+			if(cmdline != pending)
+				strcpy(pending, cmdline);
+			return;
+			}
+		pending[0] = '\0';
+		if(list != NULL)
+			{
+			run_list(list);
+			free_cmds(list);
+			}
+		return;
+		}
 	bg = parseline(cmdline, argv);    			/* Parse the command line */ 
 
 								/* Return right away if nothing is on the command line */
 	if(argv[0] == NULL)      
 		return; 					/* Ignore empty lines */
-								/* Check to see if the command is built-in.  Run it, if so.  */ 
-	if (!builtin_cmd(argv)) 
+	if(resd && argv[0][0] == '@')
+		{
+		printf("cpus= and mem= are for local commands \n");
+		return;
+		}
+	if(resd)
+		{
+		res_queue(argv, cmdline, &res);			/* Starts when its resources fit */
+		return;
+		}
+	run_simple(argv, bg, cmdline);
+    return;   
+}
+
+/* 
+ * run_simple - Run one parsed command: remotely for @pool, as a
+ *    variable assignment, an alias or function, a builtin, or a new job.
+ */
+void run_simple(char **argv, int bg, char *cmdline)
+{
+	int nohup = 0;						/* Started as nohup cmd ... */
+	struct limits_t lim, *limp = NULL;			/* Started as limit ... -- cmd */
+	char *args[MAXARGS];					/* argv with an alias applied */
+	struct func_t *f;
+	char *eq;
+
+	if(argv[0][0] == '@')					/* @pool cmd: run the job on an agent */
 		{
+		agent_launch(cmdline, bg);
+		return;
+		}
+	if(!argv[1] && (eq = strchr(argv[0], '=')) != NULL && eq > argv[0]
+	   && strspn(argv[0], NAMECHARS) == (size_t)(eq - argv[0]))
+		{
+		var_set(argv[0], eq + 1, eq - argv[0]);	/* name=value */
+		exitstatus = 0;
+		return;
+		}
+	if((f = func_find(aliases, argv[0])) != NULL && (f->body->type != CMD_SIMPLE || f->body->next))
+		{
+		call_func(f, argv, bg, cmdline, 0);		/* An alias for a list runs like a function */
+		return;
+		}
+	argv = alias_apply(argv, args);
+	if((f = func_find(funcs, argv[0])) != NULL)
+		{
+		call_func(f, argv, bg, cmdline, 0);
+		return;
+		}
+	if(!strcmp(argv[0], "limit"))				/* limit name=value ... -- cmd: limits for this job */
+		{
+		if((argv = limit_parse(argv, &lim)) == NULL)
+			{
+			exitstatus = 2;
+			return;
+			}
+		limp = &lim;
+		}
+	if(!strcmp(argv[0], "nohup") && argv[1])		/* nohup cmd: skip the prefix, remember it */
+		{
+		argv++;
+		nohup = 1;
+		}
+	exitstatus = 0;						/* (builtins that fail set it) */
+								/* Check to see if the command is built-in.  Run it, if so.  */ 
+	if (limp || !builtin_cmd(argv)) 			/* (limits are for a new process) */
+		launch(argv, NULL, bg, cmdline, nohup, limp);
+}
+
+/* 
+ * launch - Fork a job for a program (argv) or a group of commands
+ *    (group), and wait for it if it runs in the foreground. Returns the
+ *    pid of the job. The child
+ *    gets its own process group, which a subshell shares with all the
+ *    processes it starts, so the job is stopped and signaled as one.
+ */
+pid_t launch(char **argv, struct cmd_t *group, int bg, char *cmdline, int nohup, struct limits_t *lim)
+{
+	sigset_t mask;                	 			/* Used to create the blocking set */ 
+	pid_t pid;                   				/* Process id */
+	struct capture_t *cap = NULL;				/* Output pipe of a multiplexed bg job */
+	int fd;
+	int infd = -1, feedfd = -1;				/* Stdin pipe of a bg job (IN_PIPE) */
+	int hand = !bg && tty_owner();				/* The job gets the terminal */
+
 								/* Set up for blocking SIGCHLD */ 
-		Sigemptyset(&mask);
-		Sigaddset(&mask, SIGCHLD); 
-		Sigprocmask(SIG_BLOCK, &mask, NULL); 		/* Block SIGCHLD */
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGCHLD); 
+	Sigprocmask(SIG_BLOCK, &mask, NULL); 			/* Block SIGCHLD */
+	if(bg && (outmux || spooldir[0] || throttle_rate))
+		cap = capture_open();				/* Route bg output through the shell */
+	if(bg && bgstdin == IN_PIPE)
+		infd = bgstdin_open(&feedfd);			/* Stdin the shell can feed later */
+	if(group)
+		fflush(stdout);					/* The subshell must not repeat our output */
+	if(group && group->type == CMD_PIPE && pipestat)
+		pstat = pstat_open(group);			/* Shared with the relays the job starts */
+	rio_sync(&rio_stdin);					/* Input we buffered but didn't use is the job's */
+	for(fd = 0; fd < RIO_MAXFD; fd++)
+		if(rio_fds[fd])
+			rio_sync(rio_fds[fd]);
+	if(argv)
+		exec_cache(argv[0], 1);				/* The child execs through the cached fd */
 								
 								/* As job list is edited, start processing child signals */
-		if((pid = Fork()) == 0) 			/* Child runs user job */
-			{  
+	if((pid = Fork()) == 0) 				/* Child runs user job */
+		{  
 								/* Inside child */ 
-			Sigprocmask(SIG_UNBLOCK, &mask, NULL);	/* Unblock SIGCHLD in new process */ 
-			setpgid(0,0);                  		/* Put child in a new process group */ 
-								/* Execute command */ 
-			if(execve(argv[0], argv, environ) < 0) 
-				{	
-				printf("%s: Command not found. \n", argv[0]); 
-				exit(0); 
-				}
-			}	
+		Sigprocmask(SIG_UNBLOCK, &mask, NULL);		/* Unblock SIGCHLD in new process */ 
+		setpgid(0,0);                  			/* Put child in a new process group */ 
+		if(hand)
+			tty_handoff(getpid());			/* (as the parent does: whoever is first) */
+		if(lim && limits_apply(lim) < 0)		/* Before anything of the job runs */
+			exit(1);
+		if(cap)
+			{
+			dup2(cap->wfd, STDOUT_FILENO);
+			dup2(cap->wfd, STDERR_FILENO);
+			}
+		if(bg)
+			bgstdin_child(infd);				/* Keep bg jobs off the terminal's input */
+		if(nohup)						/* Immune to hangups, output off the terminal */
+			{
+			signal(SIGHUP, SIG_IGN);
+			if(isatty(STDIN_FILENO) && (fd = open("/dev/null", O_RDONLY)) >= 0)
+				dup2(fd, STDIN_FILENO);
+			if(isatty(STDOUT_FILENO) && (fd = open("nohup.out", O_WRONLY|O_CREAT|O_APPEND, 0600)) >= 0)
+				dup2(fd, STDOUT_FILENO);
+			if(isatty(STDERR_FILENO))
+				dup2(STDOUT_FILENO, STDERR_FILENO);
+			}
+		if(group)						/* Subshell: run the list, exit with its status */
+			{
+			signal(SIGINT, SIG_DFL);			/* Signals act on us like on any job */
+			signal(SIGTSTP, SIG_DFL);
+			signal(SIGCHLD, SIG_DFL);
+			signal(SIGQUIT, SIG_DFL);
+			fd = run_group(group, 1);
+			fflush(stdout);
+			_exit(fd);
+			}
+		exec_cmd(argv);						/* Execute command */ 
+		}	
 								/* Inside shell / parent */ 
 								/* Parent waits for foreground job to terminate */
 								/* If fg job */ 
-		if(!bg)                              
-			{
-			if(addjob(jobs, pid, FG, cmdline)) 
-				{				/* Add job to shell data */
-				Sigprocmask(SIG_UNBLOCK, &mask, NULL);  /* Unblock SIGCHLD */
-				waitfg(pid);			/* Wait on fg process */ 
+	if(!bg)                              
+		{
+		if(addjob(jobs, pid, FG, cmdline)) 
+			{					/* Add job to shell data */
+			getjobpid(jobs, pid)->pstat = pstat;
+			pstat = NULL;
+			if(hand)
+				{
+				setpgid(pid, pid);			/* (the child may not have run yet) */
+				tty_give(getjobpid(jobs, pid));
 				}
-			}					/* If bg job */ 
+			Sigprocmask(SIG_UNBLOCK, &mask, NULL);  /* Unblock SIGCHLD */
+			waitfg(pid);				/* Wait on fg process */ 
+			exitstatus = WIFEXITED(fgstatus) ? WEXITSTATUS(fgstatus)
+				: 128 + (WIFSIGNALED(fgstatus) ? WTERMSIG(fgstatus) : WSTOPSIG(fgstatus));
+			}
+		}						/* If bg job */ 
+	else
+		{
+		if(addjob(jobs, pid, BG, cmdline))
+			{			 		/* Add job to shell data */
+			if(cap)
+				capture_attach(cap, pid2jid(pid), pid);
+			if(infd >= 0)
+				getjobpid(jobs, pid)->feedfd = feedfd;
+			getjobpid(jobs, pid)->pstat = pstat;
+			pstat = NULL;
+			printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline); 
+								/* Don't wait this time, so print out info */ 
+			Sigprocmask(SIG_UNBLOCK, &mask, NULL);	/* (after the printf: the job may be gone already) */
+			}
 		else
 			{
-			if(addjob(jobs, pid, BG, cmdline))
-				{			 	/* Add job to shell data */
-				Sigprocmask(SIG_UNBLOCK, &mask, NULL);
-				printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline); 
-								/* Don't wait this time, so print out info */ 							}
+			if(cap)
+				capture_attach(cap, 0, pid);		/* Still drain the pipe */
+			if(infd >= 0)
+				close(feedfd);				/* (no job to hold it) */
 			}
+		if(infd >= 0)
+			close(infd);
 		}
-	
-    return;   
+	if(pstat)						/* addjob failed: the mapping has no owner */
+		munmap(pstat, sizeof(struct pstat_t));
+	return pid;
 }
 
 /* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
+ * exec_cmd - Replace the (child) process with the program in argv, once
+ *    the fd redirections among its words are done: n>&m and n<&m make
+ *    fd n a copy of fd m (n defaults to 1 and 0), n>&- closes it.
  */
-int parseline(const char *cmdline, char **argv) 
+void exec_cmd(char **argv)
 {
-	static char array[MAXLINE]; 				/* holds command line local copy */
-	char *buf = array;        				/* ptr that traverses command line */
-	char *delim;              				/* points to delimiters (white space) */
-	int argc;                 				/* number of args */
-	int bg;                   				/* bg job? */
-
-	strcpy(buf, cmdline);					/* strcopy copies the C string pointed by source into the array 								 * pointed by destination, including the terminating null 
-								 * character (and stopping at that point) */
-	buf[strlen(buf)-1] = ' ';  				/* replace trailing '\n' with space */
-	while (*buf && (*buf == ' ')) 				/* ignore leading spaces */
-		buf++;
-
-    								/* Build the argv list */
-  	argc = 0;
-  	if (*buf == '\'')
-		{
-		buf++;
-		delim = strchr(buf, '\'');			/* strchr returns a pointer to the first occurrence of character 									 * in the C string str */
-	    	}
-	else 
-		{
-		delim = strchr(buf, ' ');
-		}
+	char **a, **w, *p;
+	int fd;
 
-	while (delim) 
+	for(a = w = argv; *a; a++)
 		{
-		argv[argc++] = buf;
-		*delim = '\0';
-		buf = delim + 1;
-		while (*buf && (*buf == ' ')) 	
-								/* Ignore spaces */
-		       	buf++;
-		if (*buf == '\'') 
+		p = *a;
+		fd = isdigit((unsigned char)*p) ? (int)strtol(p, &p, 10) : -1;
+		if((*p != '<' && *p != '>') || p[1] != '&' || !p[2]
+		   || (strcmp(p + 2, "-") && strspn(p + 2, "0123456789") != strlen(p + 2)))
 			{
-		    	buf++;
-		   	delim = strchr(buf, '\'');
+			*w++ = *a;				/* Not a redirection */
+			continue;
 			}
-		else 
+		if(fd < 0)
+			fd = (*p == '<') ? STDIN_FILENO : STDOUT_FILENO;
+		if(p[2] == '-')
+			close(fd);
+		else if(dup2(atoi(p + 2), fd) < 0)
 			{
-			delim = strchr(buf, ' ');
+			printf("%s: %s \n", *a, strerror(errno));
+			exit(1);
 			}
-	    	}
-	argv[argc] = NULL;
-	    
-	if (argc == 0)						/* Ignore blank line */				
-	    	{			
-		return 1;
 		}
-    								/* Should the job run in the background? */
-    if ((bg = (*argv[argc - 1] == '&')) != 0) 
-		{
-		argv[--argc] = NULL;
-   		}
-    return bg;
+	*w = NULL;
+	if(argv[0] == NULL)
+		exit(0);
+	if((fd = exec_cache(argv[0], 0)) >= 0)			/* Exec the file the shell holds open */
+		execveat(fd, "", argv, environ, AT_EMPTY_PATH);	/* (a #! script can't: it falls through) */
+	if(execve(argv[0], argv, environ) < 0) 
+		{	
+		printf("%s: Command not found. \n", argv[0]); 
+		exit(0); 
+		}
 }
 
 /* 
- * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.  
+ * run_list - Run a parsed list in the shell. Subshells and background
+ *    groups become one job each; a foreground brace group runs its
+ *    commands right here, with no fork of its own, and so does a while
+ *    loop. Returns nonzero if a foreground command was interrupted with
+ *    ctrl-c, which ends the rest of the list.
  */
-int builtin_cmd(char **argv) 
+int run_list(struct cmd_t *c)
 {
-								/* If argv[0] is quit, exit the shell */ 
-	if(!strcmp(argv[0], "quit"))				/* strcmp compares the C string str1 to the C string str2 */
-		{
-		exit(0);          
-		}          
-	else if((!strcmp(argv[0], "bg")) || (!strcmp(argv[0], "fg")))
-								/* If arv[0] is "bg" or "fg", do: */
-		{ 
-		do_bgfg(argv);     				/* Call fucntion that executes those commands */
-		return 1;
-		}
-	else if(!strcmp(argv[0], "jobs"))    			/* If arv[0] is "jobs", do: */ 
+	char **argv;						/* A command with $1 ... filled in */
+	struct cmd_t *next;
+	int intr, bg;
+
+	for(; c; c = c->next)
 		{
-		listjobs(jobs); 				/* Call fucntion that executes those commands */		
-		return 1;
+		fgstatus = 0;
+		if(c->type == CMD_FUNCDEF)
+			{
+			if(c->body)
+				func_define(funcs, c->argv[0], c->body);
+			c->body = NULL;				/* The function owns it now */
+			}
+		else if(c->type == CMD_SIMPLE && (fargv || c->dyn))
+			{
+			argv = expand_args(c->argv);
+			if(argv[0])				/* ("$@" with no arguments: nothing to run) */
+				run_simple(argv, c->bg, c->text);
+			free(argv);
+			}
+		else if(c->type == CMD_SIMPLE)
+			run_simple(c->argv, c->bg, c->text);
+		else if((c->type == CMD_WHILE && c->bg) || c->type == CMD_PIPE)
+								/* The loop or pipeline alone is the job */
+			{
+			next = c->next;
+			bg = c->bg;
+			c->next = NULL;
+			c->bg = 0;				/* (in the job, it runs in the foreground) */
+			launch(NULL, c, bg, c->text, 0, NULL);
+			c->next = next;
+			c->bg = bg;
+			}
+		else if(c->type == CMD_WHILE)
+			{
+			while(!(intr = run_list(c->cond)) && exitstatus == 0)
+				if((intr = run_list(c->body)) != 0)
+					break;
+			if(intr)
+				return 1;
+			exitstatus = 0;
+			}
+		else if(c->type == CMD_SUBSHELL || c->bg)
+			launch(NULL, c->body, c->bg, c->text, 0, NULL);
+		else if(run_list(c->body))
+			return 1;
+		if(!c->bg && WIFSIGNALED(fgstatus) && WTERMSIG(fgstatus) == SIGINT)
+			return 1;
 		}
-	else
-		{						/* Not a builtin command */
-		return 0;
-		}    	
-} 
+	return 0;
+}
 
 /* 
- * do_bgfg - Execute the builtin bg and fg commands
+ * run_group - (subshell) Run a list inside a forked job and return its
+ *    exit status. Commands start in the job's process group. If nothing
+ *    runs after the list (last), its last command is exec'd in place
+ *    rather than forked.
  */
-void do_bgfg(char **argv) 
+int run_group(struct cmd_t *c, int last)
 {
+	pid_t pid;
+	int status = 0;
+	char *args2[MAXARGS];
+	char **argv = NULL, **expanded = NULL;			/* (expanded is freed with the next command) */
+	struct func_t *f;
 
-	int jobid;              				/* Pointers get information about process */ 
-	pid_t pidt; 	
-	struct job_t *jid; 
-	int is_BG = (!strcmp(argv[0], "bg"));  			/* True if argv is a bg process */ 	
-	
-	if(is_BG)
-								/* Error checking */  
+	for(; c; c = c->next)
 		{
-		if(!argv[1]) 					/* Bg job */			
+		free(expanded);
+		expanded = NULL;
+		if(c->type == CMD_FUNCDEF)
 			{
-			printf("bg command requires PID or %%jobid argument \n");
-			return; 
-			}					/* atoi parses the C string str interpreting its content as an 
-								 * integral number, which is returned as an int value. */
-		if((atoi(argv[1]+1) == 0 && argv[1][0] == '%') || (atoi(argv[1]) == 0 && argv[1][0] != '%')) 
+			if(c->body)
+				func_define(funcs, c->argv[0], c->body);
+			c->body = NULL;
+			continue;
+			}
+		if(c->type == CMD_GROUP && !c->bg)
 			{
-			printf("bg: argument must be a PID or %%jobid \n");
-			return;
+			exitstatus = status = run_group(c->body, last && !c->next);
+			continue;
 			}
-		}
-	else
-		{ 
-		if(!argv[1]) 					/* Fg job */
+		if(c->type == CMD_PIPE && !c->bg)
 			{
-			printf("fg command requires PID or %%jobid argument \n");
-			return; 
+			exitstatus = status = run_pipe(c->body);
+			continue;
 			}
-		if((atoi(argv[1]+1) == 0 && argv[1][0] == '%') || (atoi(argv[1]) == 0 && argv[1][0] != '%')) 
+		if(c->type == CMD_WHILE && !c->bg)
 			{
-			printf("fg: argument must be a PID or %%jobid \n");
-			return;
+			while((exitstatus = run_group(c->cond, 0)) == 0)
+				exitstatus = run_group(c->body, 0);
+			exitstatus = status = 0;
+			continue;
 			}
-		}			
-	if(argv[1][0] == '%')
-								/* If either command is denoting process by Job ID */ 
-		{
-		jobid = atoi(argv[1]+1);      
-								/* Get job ID from command line */ 
-		if((jid = getjobjid(jobs, jobid)) == NULL)
-								/* Get job struct of job ID */  
+		if(c->type == CMD_SIMPLE)
 			{
-			printf("%%%d: No such job \n", jobid);
-			return; 
+			argv = (fargv || c->dyn) ? (expanded = expand_args(c->argv)) : c->argv;
+			if(!argv[0])
+				continue;
+			if(!argv[1] && strchr(argv[0], '=') > argv[0])
+				{
+				run_simple(argv, 0, c->text);	/* (an assignment) */
+				status = 0;
+				continue;
+				}
+			if((f = func_find(aliases, argv[0])) != NULL && (f->body->type != CMD_SIMPLE || f->body->next))
+				{
+				status = call_func(f, argv, c->bg, c->text, 1);
+				continue;
+				}
+			argv = alias_apply(argv, args2);
+			if((f = func_find(funcs, argv[0])) != NULL)
+				{
+				status = call_func(f, argv, c->bg, c->text, 1);
+				continue;
+				}
+			exitstatus = 0;
+			if(builtin_cmd(argv))
+				{
+				status = exitstatus;
+				continue;
+				}
 			}
-		pidt = jid->pid;  
-								/* Get process ID of that job */ 
-		}
-								/* Similar idea for command using pid */ 
-	else 
-		{
-		pidt = atoi(argv[1]);
-			if((jid = getjobpid(jobs, pidt)) == NULL)
+		if(c->type == CMD_SIMPLE && !c->bg && !c->next && last)
 			{
-			printf("(%d): No such process \n", pidt); 
-			return;
+			fflush(stdout);
+			exec_cmd(argv);				/* Nothing follows: no fork */
 			}
-		jobid = jid->pid; 
-		}  
-	 
-								/* If command is bg */ 
-	if(is_BG) 
-		{ 
-		jid->state = BG;      				/* Change state to bg */ 
-		Kill(-pidt, SIGCONT);  				/* Reset and continue command */ 
-		printf("[%d] (%d) %s", jobid, pidt, jid->cmdline);   /* Print out info */ 
-		}
-								/* Similar idea for fg, but now we must wait since it is now in 								 * the fg */ 
-	else 
-		{
-		jid->state = FG; 				/* If command is fg */
-		Kill(-pidt, SIGCONT);				/* Change state to fg */ 
-		waitfg(pidt);		
+		fflush(stdout);
+		if((pid = Fork()) == 0)
+			{
+			if(c->type == CMD_SIMPLE)
+				exec_cmd(argv);
+			if(c->type == CMD_WHILE || c->type == CMD_PIPE)
+				c->bg = 0, c->next = NULL;	/* (run just the loop or pipeline, here) */
+			status = run_group((c->type == CMD_WHILE || c->type == CMD_PIPE) ? c : c->body, 1);
+			fflush(stdout);
+			_exit(status);
+			}
+		if(c->bg)
+			continue;
+		while(waitpid(pid, &status, 0) < 0 && errno == EINTR)
+			;
+		exitstatus = status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
 		}
- 	return;
+	free(expanded);
+	return status;
 }
 
 /* 
- * waitfg - Block until process pid is no longer the foreground process
+ * pipe_stage - (subshell) Fork a stage of a pipeline with in and out as
+ *    its stdin and stdout (-1 to leave one as it is). The child also
+ *    closes the fds in shut (ending with -1), the ends of pipes that
+ *    belong to other stages.
  */
-void waitfg(pid_t pid)
+static pid_t pipe_stage(struct cmd_t *c, int in, int out, int *shut)
 {
-	struct job_t *jid;
-	jid = getjobpid(jobs, pid);      			/* Get job struct from PID */ 
+	pid_t pid;
 
-								/* Run a loop while there is still a fg process 
-								 * and the fg process is not in ST joblist state */
-	while(fgpid(jobs) && jid->state != ST) 			
-		{
-		sleep(1);
-		} 
-	if(verbose)
+	if((pid = Fork()) == 0)
 		{
-		printf("waitfg: process (%d) is no longer the foreground process \n", pid); 
+		if(in >= 0)
+			{
+			dup2(in, STDIN_FILENO);
+			close(in);
+			}
+		if(out >= 0)
+			{
+			dup2(out, STDOUT_FILENO);
+			close(out);
+			}
+		for(; *shut >= 0; shut++)
+			close(*shut);
+		pstat = NULL;					/* (a pipeline inside isn't measured) */
+		c->next = NULL;
+		c->bg = 0;
+		_exit(run_group(c, 1));
 		}
-  return;
+	return pid;
 }
 
-
-/*****************
- * Signal handlers
- *****************/
-
 /* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+ * run_pipe - (subshell) Run the stages of a pipeline, each in a child
+ *    of its own with its stdout piped to the next one's stdin, wait for
+ *    them all and return the last one's status. A fan-out stage,
+ *    |> ( a, b, c ), hands the producer's output to every consumer by
+ *    a chain of tee relays: relay i duplicates its input to consumer i
+ *    and passes it on to relay i+1, and the last consumer reads what
+ *    is left. The data moves between pipes inside the kernel, and the
+ *    relays are in the job's process group, so they stop with it.
  */
-void sigchld_handler(int sig) 
+int run_pipe(struct cmd_t *c)
 {
-	if(verbose)
-		{ 
-		printf("sigchld_handler: entering \n"); 
-		pid_t pid; 
-		int status, jobid; 
-		}
-								/* While there are un-reaped children:
-		 						 * WNOHANG: Don't block waiting
-		 						 * WUNTRACED: Report status of stopped children */ 
-	while((pid = waitpid(-1, &status, WNOHANG|WUNTRACED)) > 0)
-  		{
-		jobid = pid2jid(pid);      			/* Get the job ID from the PID */
-								/* If the child is stopped */ 
-		if(WIFSTOPPED(status)) 				/* Returns true if the child that caused the return is stopped */
+	pid_t pids[MAXARGS], last = 0;
+	int n = 0, in = -1, fd[2], cfd[2], nfd[2], rfd[2], status = 0, st, i, k = 0;
+	int shut[5];
+	struct cmd_t *f;
+
+	fflush(stdout);
+	for(; c && n < MAXARGS - 3; c = c->next, k++)
+		{
+		if(c->type == CMD_FANOUT)
 			{
-			getjobpid(jobs, pid)->state = ST;  	/* Adjust the state of that job to stopped */ 
-			printf("Job [%d] (%d) stopped by signal %d \n", jobid, pid, WSTOPSIG(status));
+			for(f = c->body; f && n < MAXARGS - 2; f = f->next)
+				{
+				if(!f->next)				/* The last consumer reads the rest */
+					{
+					shut[0] = -1;
+					pids[n++] = last = pipe_stage(f, in, -1, shut);
+					close(in);
+					break;
+					}
+				if(pipe(cfd) < 0 || pipe(nfd) < 0)
+					unix_error("pipe error");
+				shut[0] = cfd[1], shut[1] = nfd[0], shut[2] = nfd[1], shut[3] = in, shut[4] = -1;
+				pids[n++] = pipe_stage(f, cfd[0], -1, shut);
+				close(cfd[0]);
+				if((pids[n++] = Fork()) == 0)	/* The relay */
+					{
+					close(nfd[0]);
+					tee_relay(in, cfd[1], nfd[1]);
+					_exit(0);
+					}
+				close(in);
+				close(cfd[1]);
+				close(nfd[1]);
+				in = nfd[0];
+				}
+			if(f == NULL)					/* (too many stages) */
+				close(in);
+			in = -1;
+			break;
 			}
-								/* If the process was terminated by a signal */ 
-		if(WIFSIGNALED(status)) 			/* Return true if the child process terminated because of a
-								 * signal that was not caught */
+		if(c->next && pipe(fd) < 0)
+			unix_error("pipe error");
+		shut[0] = c->next ? fd[0] : -1, shut[1] = -1;
+		pids[n++] = last = pipe_stage(c, in, c->next ? fd[1] : -1, shut);
+		if(in >= 0)
+			close(in);
+		in = -1;
+		if(c->next)
 			{
-								/* Delete the job */ 
-			deletejob(jobs,pid); 
-			if(verbose) 
-				printf("sigchld_handler: Job [%d] (%d) deleted \n", jobid, pid );
-				printf("Job [%d] (%d) terminated by signal %d \n", jobid, pid, WTERMSIG(status));
+			close(fd[1]);
+			in = fd[0];
 			}
-		if(WIFEXITED(status))				/* Returns true if child terminates normally */ 		
+		if(c->next && pstat && k < pstat->n - 1)	/* Measure what passes to the next stage */
 			{
-			deletejob(jobs,pid); 
-			if(verbose) 
+			if(pipe(rfd) < 0)
+				unix_error("pipe error");
+			if((pids[n++] = Fork()) == 0)
 				{
-				printf("sigchld_handler: Job [%d] (%d) deleted \n", jobid, pid );
-				printf("sigchld_handler: Job [%d] (%d) terminated okay (status 0) \n", jobid, pid );
+				close(rfd[0]);
+				stat_relay(in, rfd[1], &pstat->b[k]);
+				_exit(0);
 				}
+			close(in);
+			close(rfd[1]);
+			in = rfd[0];
 			}
 		}
-								/* Allow ECHILD and EINTR errors */ 
-								/* i.e., if the calling process has not children (ECHILD),
-								 * or waitpid was interrupted (EINTR) */
-	if(ECHILD != errno && EINTR != errno) 
+	if(in >= 0)						/* (too many stages) */
 		{
-		unix_error("waitpid error");
-		} 
-	if(verbose) 
+		printf("pipeline too long \n");
+		close(in);
+		}
+	for(i = 0; i < n; i++)
 		{
-		printf("sigchld_handler: exiting \n"); 	
-		}				
-	return;
+		while(waitpid(pids[i], &st, 0) < 0 && errno == EINTR)
+			;
+		if(pids[i] == last)
+			status = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+		}
+	return status;
 }
 
 /* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenver the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.  
+ * tee_relay - (relay of a fan-out) Copy the pipe in to the pipe out
+ *    with tee, which only links the pages into out, then splice the
+ *    same bytes on to the pipe next. If the consumer on out goes away
+ *    the rest is only passed on; if everything after next does, it is
+ *    dropped. Returns at end of input, or when both are gone.
  */
-void sigint_handler(int sig) 
+void tee_relay(int in, int out, int next)
 {
-								/* Search jobs for fg process */
-	if(verbose)
-		{ 
-		printf("sigint_handler: entering \n");
-		}
-	pid_t pid = fgpid(jobs);
-	int jobid = pid2jid(pid);
-								/* Send SIGINT to fg porcess. */ 
-	 							/* Negative PID kills the entire process group */
-	Kill(-pid, sig);
-	if(verbose)
-		{ 
-		printf("sigint_handler: Job [%d] (%d) killed \n",jobid, pid);
-		}
-	if(verbose)
-		{ 
-		printf("sigint_handler: exiting \n");
+	ssize_t n, m, k;
+	int dropping = 0;					/* next is /dev/null now */
+
+	signal(SIGPIPE, SIG_IGN);				/* (EPIPE tells us instead) */
+	for(;;)
+		{
+		if(out < 0)					/* Consumer gone: just move */
+			{
+			if(dropping || (k = splice(in, NULL, next, NULL, RELAYCHUNK, SPLICE_F_MOVE)) == 0
+			   || (k < 0 && errno != EINTR))
+				return;
+			continue;
+			}
+		if((n = tee(in, out, RELAYCHUNK, 0)) < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && errno == EPIPE)
+			{
+			close(out);
+			out = -1;
+			continue;
+			}
+		if(n <= 0)
+			return;					/* End of input */
+		for(m = 0; m < n; m += k)			/* Exactly the bytes out got */
+			if((k = splice(in, NULL, next, NULL, n - m, SPLICE_F_MOVE)) == 0)
+				return;
+			else if(k < 0)
+				{
+				k = 0;
+				if(errno == EPIPE && !dropping)	/* Only out is left */
+					{
+					close(next);
+					if((next = open("/dev/null", O_WRONLY)) < 0)
+						return;
+					dropping = 1;
+					}
+				else if(errno != EINTR)
+					return;
+				}
 		}
-  	return;
 }
 
-/*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.  
+/* 
+ * stat_relay - (relay of a measured pipeline) Splice the pipe in to the
+ *    pipe out, counting the bytes and the time spent waiting on either
+ *    side in st: for input when the stage before is the slow one, for
+ *    room in out when the stage after is. Returns at end of input, or
+ *    when the stage after has gone away.
  */
-void sigtstp_handler(int sig) 
+void stat_relay(int in, int out, struct pstage_t *st)
 {
-								/* Search jobs for fg process */
-	if(verbose) 
+	struct pollfd pfd;
+	ssize_t k;
+	long long t;
+
+	signal(SIGPIPE, SIG_IGN);
+	st->t0 = st->t1 = now_ns();
+	for(;;)
 		{
-		printf("sigtstp_handler: entering \n");
+		if((k = splice(in, NULL, out, NULL, RELAYCHUNK, SPLICE_F_MOVE|SPLICE_F_NONBLOCK)) > 0)
+			{
+			st->bytes += k;
+			st->t1 = now_ns();
+			continue;
+			}
+		if(k == 0 || (errno != EAGAIN && errno != EINTR))
+			return;					/* End of input, or EPIPE */
+		pfd.fd = in;					/* Which side is holding us up? */
+		pfd.events = POLLIN;
+		t = now_ns();
+		if(poll(&pfd, 1, 0) == 0)
+			{
+			poll(&pfd, 1, -1);			/* Nothing to read */
+			st->t1 = now_ns();
+			st->inwait += st->t1 - t;
+			}
+		else
+			{
+			pfd.fd = out;				/* No room to write */
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, -1);
+			st->t1 = now_ns();
+			st->outwait += st->t1 - t;
+			}
 		}
-	pid_t pid = fgpid(jobs);
-	int jobid = pid2jid(pid);
-								/* Send SIGINT to fg porcess. */ 
-	 							/* Negative PID kills the entire process group */
-	Kill(-pid, SIGTSTP);   
-	if(verbose) 
+}
+
+/* 
+ * parseline - Parse the command line and build the argv array.
+ * 
+ * Characters enclosed in single quotes are treated as a single
+ * argument.  Return true if the user has requested a BG job, false if
+ * the user has requested a FG job.  
+ */
+int parseline(const char *cmdline, char **argv) 
+{
+	static char array[MAXLINE]; 				/* holds command line local copy */
+	char *buf = array;        				/* ptr that traverses command line */
+	char *delim;              				/* points to delimiters (white space) */
+	int argc;                 				/* number of args */
+	int bg;                   				/* bg job? */
+
+	strcpy(buf, cmdline);					/* strcopy copies the C string pointed by source into the array 								 * pointed by destination, including the terminating null 
+								 * character (and stopping at that point) */
+	buf[strlen(buf)-1] = ' ';  				/* replace trailing '\n' with space */
+	while (*buf && (*buf == ' ')) 				/* ignore leading spaces */
+		buf++;
+
+    								/* Build the argv list */
+  	argc = 0;
+  	if (*buf == '\'')
 		{
-		printf("sigtstp_handler: Job [%d] (%d) stopped \n",jobid, pid);
+		buf++;
+		delim = strchr(buf, '\'');			/* strchr returns a pointer to the first occurrence of character 									 * in the C string str */
+	    	}
+	else 
+		{
+		delim = strchr(buf, ' ');
 		}
-	if(verbose) 
+
+	while (delim) 
 		{
-		printf("sigtstp_handler: exiting \n");
+		argv[argc++] = buf;
+		*delim = '\0';
+		buf = delim + 1;
+		while (*buf && (*buf == ' ')) 	
+								/* Ignore spaces */
+		       	buf++;
+		if (*buf == '\'') 
+			{
+		    	buf++;
+		   	delim = strchr(buf, '\'');
+			}
+		else 
+			{
+			delim = strchr(buf, ' ');
+			}
+	    	}
+	argv[argc] = NULL;
+	    
+	if (argc == 0)						/* Ignore blank line */				
+	    	{			
+		return 1;
 		}
-  	return;
+    								/* Should the job run in the background? */
+    if ((bg = (*argv[argc - 1] == '&')) != 0) 
+		{
+		argv[--argc] = NULL;
+   		}
+    return bg;
 }
 
-/*********************
- * End signal handlers
- *********************/
+/* 
+ * call_func - Run a function (or an alias for a list) with argv as its
+ *    arguments. Its body was parsed when it was defined, so a call
+ *    parses nothing. A background call is one forked job; in a
+ *    subshell (sub) the body runs with run_group. Returns the status.
+ */
+int call_func(struct func_t *f, char **argv, int bg, char *cmdline, int sub)
+{
+	char **saved = fargv;
+	int status = 0;
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+	if(depth >= MAXDEPTH)
+		{
+		printf("%s: maximum nesting depth exceeded \n", argv[0]);
+		return 1;
+		}
+	fargv = argv;
+	f->busy++;
+	depth++;
+	if(!sub && f->body->type == CMD_SUBSHELL && !f->body->next)
+		launch(NULL, f->body->body, bg, cmdline, 0, NULL);	/* name() ( list ): one job */
+	else if(bg && !sub)
+		launch(NULL, f->body, 1, cmdline, 0, NULL);
+	else if(sub)
+		status = run_group(f->body, 0);
+	else
+		run_list(f->body);
+	if(!sub)
+		status = exitstatus;
+	depth--;
+	if(--f->busy == 0 && f->dead)				/* Unset or redefined by its own body */
+		func_free(f);
+	fargv = saved;
+	return status;
+}
 
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+/* 
+ * alias_apply - If argv[0] is an alias for a simple command, return
+ *    the alias's words followed by argv[1] ... (built in args).
+ *    Otherwise return argv unchanged.
+ */
+char **alias_apply(char **argv, char **args)
+{
+	struct func_t *a;
+	int i = 0, j;
+
+	if((a = func_find(aliases, argv[0])) == NULL || a->body->type != CMD_SIMPLE || a->body->next)
+		return argv;
+	for(j = 0; a->body->argv[j] && i < MAXARGS - 1; j++)
+		args[i++] = a->body->argv[j];
+	for(j = 1; argv[j] && i < MAXARGS - 1; j++)
+		args[i++] = argv[j];
+	args[i] = NULL;
+	return args;
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
+static void ab_word(struct argbuf *ab);
+static void ab_putc(struct argbuf *ab, int ch);
+static void ab_puts(struct argbuf *ab, const char *s);
+static char **ab_argv(struct argbuf *ab);
+
+/* 
+ * put_param - Append the value of the parameter at *wp ($N, $#, $?,
+ *    $name or ${name}) to ab, leaving *wp on its last character.
+ *    Returns 0, appending nothing, if *wp is a plain '$'.
+ */
+static int put_param(struct argbuf *ab, const char **wp)
+{
+	const char *w = *wp, *name;
+	char *val, num[16];
+	size_t n;
+	int nargs = 0, brace;
+
+	while(fargv && fargv[nargs + 1])
+		nargs++;
+	if(w[1] == '#' || w[1] == '?')
+		{
+		snprintf(num, sizeof(num), "%d", w[1] == '#' ? nargs : exitstatus);
+		ab_puts(ab, num);
+		}
+	else if(w[1] >= '0' && w[1] <= '9')
+		{
+		if(w[1] - '0' <= nargs)
+			ab_puts(ab, fargv[w[1] - '0']);
+		}
+	else
+		{
+		brace = (w[1] == '{');
+		name = w + 1 + brace;
+		if((n = strspn(name, NAMECHARS)) == 0 || isdigit((unsigned char)name[0])
+		   || (brace && name[n] != '}'))
+			return 0;
+		if((val = var_get(name, n)) != NULL)
+			ab_puts(ab, val);
+		*wp = name + n - 1 + brace;
+		return 1;
+		}
+	(*wp)++;
+	return 1;
+}
+
+/* 
+ * expand_args - Expand the words of a command as it is run: variables,
+ *    $? and the running function's arguments, $1 ... $9 and $# anywhere
+ *    in a word and "$@" or "$*" as words of their own (all of the
+ *    arguments), and $(( expr )) using them. Returns the new argv in
+ *    one malloc'd block, with no limit on its size; the caller frees it.
+ */
+char **expand_args(char **argv)
+{
+	struct argbuf ab, ex;
+	int i, j, err;
+	const char *w, *e;
+	char num[32];
+
+	memset(&ab, 0, sizeof(ab));
+	memset(&ex, 0, sizeof(ex));
+	for(i = 0; argv[i]; i++)
+		{
+		w = argv[i];
+		if(!strcmp(w, "$@") || !strcmp(w, "$*"))
+			{
+			for(j = 1; fargv && fargv[j]; j++)
+				{
+				ab_word(&ab);
+				ab_puts(&ab, fargv[j]);
+				ab_putc(&ab, '\0');
+				}
+			continue;
+			}
+		ab_word(&ab);
+		for(; *w; w++)
+			{
+			if(w[0] == '$' && w[1] == '(' && w[2] == '(' && (e = arith_end(w + 3)) != NULL)
+				{
+				for(ex.len = 0, w += 3; w < e; w++)	/* The expression, parameters filled in */
+					if(w[0] != '$' || !put_param(&ex, &w))
+						ab_putc(&ex, *w);
+				ab_putc(&ex, '\0');
+				snprintf(num, sizeof(num), "%lld", arith(ex.buf, ex.len - 1, &err));
+				if(err)
+					printf("%s: bad arithmetic expression \n", ex.buf);
+				ab_puts(&ab, num);
+				w = e + 1;				/* The second ')' */
+				}
+			else if(w[0] != '$' || !put_param(&ab, &w))
+				ab_putc(&ab, *w);
+			}
+		ab_putc(&ab, '\0');
+		}
+	free(ex.buf);
+	return ab_argv(&ab);
+}
+
+/* 
+ * parse_list - Parse a command line with lists and groups: commands
+ *    separated by ';', '&' or newlines, "( list )" subshells, "{ list; }"
+ *    brace groups and "name() { list; }" function definitions. Words
+ *    are split as in parseline, then $(( expr )) and {a,b} or {1..n}
+ *    are expanded as the words are built. Returns the list, or NULL after
+ *    reporting a syntax error; free it with free_cmds. If the input
+ *    ends inside a group or quote, NULL is returned quietly with
+ *    parse_partial set, and the caller may retry with more lines.
+ */
+struct cmd_t *parse_list(const char *cmdline)
+{
+    const char *s = cmdline;
+    struct cmd_t *list;
+    int err = 0, len;
+
+    parse_partial = 0;
+    list = parse_cmds(&s, NULL, &err);
+    if (!err && *s != '\0')	/* a ')' or '}' with nothing to close */
+	err = 1;
+    if (err < 0) {		/* already reported */
+	free_cmds(list);
+	return NULL;
+    }
+    if (err && *s == '\0') {	/* ran out of input */
+	parse_partial = 1;
+	free_cmds(list);
+	return NULL;
+    }
+    if (err) {
+	if ((len = strcspn(s, "\n")) == 0)
+	    printf("syntax error near newline\n");
+	else
+	    printf("syntax error near '%.*s'\n", len < 8 ? len : 8, s);
+	free_cmds(list);
+	return NULL;
+    }
+    return list;
+}
+
+/* isword - Is s the one-character word w followed by a delimiter? */
+static int isword(const char *s, int w)
+{
+    return s[0] == w && (s[1] == '\0' || strchr(" \t\n;&()|", s[1]));
+}
+
+/* iskeyword - Does s start with the reserved word kw? */
+static int iskeyword(const char *s, const char *kw)
+{
+    size_t n = strlen(kw);
+
+    return !strncmp(s, kw, n) && (s[n] == '\0' || strchr(" \t\n;&()|", s[n]));
+}
+
+/* 
+ * parse_cmds - Parse commands up to the end of the line, a ')', or the
+ *    "}", "do" or "done" given by close (left in *sp for the caller).
+ */
+struct cmd_t *parse_cmds(const char **sp, const char *close, int *err)
+{
+    struct cmd_t *head = NULL, **tail = &head, *c;
+    const char *s, *start, *end;
+    size_t len;
+
+    for (;;) {
+	s = start = *sp + strspn(*sp, " \t\n");
+	*sp = s;
+	if (*s == '\0' || *s == ')' || (close && iskeyword(s, close)))
+	    return head;
+	if ((c = parse_pipe(sp, err)) == NULL)
+	    return head;
+	*tail = c;
+	tail = &c->next;
+	s = end = *sp + strspn(*sp, " \t");
+	if (*s == ';' || *s == '\n')
+	    s++;
+	else if (*s == '&')
+	    end = ++s, c->bg = 1;
+	else if (*s && *s != ')' && !(close && iskeyword(s, close))) {
+	    *sp = s;		/* e.g. a word after ')' */
+	    *err = 1;
+	    return head;
+	}
+	*sp = s;
+	for (len = end - start; len > 0 && isspace((unsigned char)start[len-1]); len--)
+	    ;
+	if ((c->text = malloc(len + 2)) == NULL)
+	    unix_error("malloc error");
+	memcpy(c->text, start, len);
+	strcpy(c->text + len, "\n");
+    }
+}
+
+/* ab_word - Start a new word in ab */
+static void ab_word(struct argbuf *ab)
+{
+    if (ab->argc + 1 >= ab->max) {
+	ab->max = ab->max ? 2 * ab->max : MAXARGS;
+	if ((ab->off = realloc(ab->off, ab->max * sizeof(size_t))) == NULL)
+	    unix_error("realloc error");
+    }
+    ab->off[ab->argc++] = ab->len;
+}
+
+/* ab_putc - Append a character to the word being built */
+static void ab_putc(struct argbuf *ab, int ch)
+{
+    if (ab->len == ab->size) {
+	ab->size = ab->size ? 2 * ab->size : MAXLINE;
+	if ((ab->buf = realloc(ab->buf, ab->size)) == NULL)
+	    unix_error("realloc error");
+    }
+    ab->buf[ab->len++] = ch;
+}
+
+/* ab_puts - Append a string to the word being built */
+static void ab_puts(struct argbuf *ab, const char *s)
+{
+    while (*s)
+	ab_putc(ab, *s++);
+}
+
+/*
+ * ab_argv - Turn the words in ab into a null-terminated argv, in one
+ *    malloc'd block with the words after the pointers, and free ab's
+ *    buffers.
+ */
+static char **ab_argv(struct argbuf *ab)
+{
+    char **argv;
+    int i;
+
+    if ((argv = malloc((ab->argc + 1) * sizeof(char *) + ab->len)) == NULL)
+	unix_error("malloc error");
+    if (ab->len)
+	memcpy(argv + ab->argc + 1, ab->buf, ab->len);
+    for (i = 0; i < ab->argc; i++)
+	argv[i] = (char *)(argv + ab->argc + 1) + ab->off[i];
+    argv[ab->argc] = NULL;
+    free(ab->buf);
+    free(ab->off);
+    return argv;
+}
+
+/* brace_char - The character that a lexer mark stands for */
+static int brace_char(int ch)
+{
+    return ch == BR_OPEN ? '{' : ch == BR_CLOSE ? '}' : ch == BR_COMMA ? ',' : ch;
+}
+
+/* 
+ * brace_gen - Emit the words of pattern rest, each preceded by the
+ *    plen bytes in pre. The first {a,b} or {x..y[..step]} is expanded
+ *    one element at a time, straight into ab: the element is appended
+ *    to pre and the rest of the pattern is expanded after it, so a
+ *    range of any length takes no memory beyond the words themselves.
+ *    Returns -1 if a word would not fit in pre, 0 otherwise.
+ */
+static int brace_gen(struct argbuf *ab, char *pre, size_t plen, const char *rest)
+{
+    const char *open, *p = NULL, *alt;
+    char range[64], *pat, *r;
+    long long lo, hi, v;
+    unsigned long long step;
+    int depth, comma = 0, chars;
+    size_t n;
+
+    for (open = rest; (open = strchr(open, BR_OPEN)) != NULL; open++) {
+	for (depth = 0, p = open; *p; p++)
+	    if (*p == BR_OPEN)
+		depth++;
+	    else if (*p == BR_CLOSE && --depth == 0)
+		break;
+	    else if (*p == BR_COMMA && depth == 1)
+		comma = 1;
+	if (*p)
+	    break;		/* open is matched by p */
+	comma = 0;
+    }
+    n = open ? (size_t)(open - rest) : strlen(rest);
+    if (plen + n + 32 >= MAXPENDING)
+	return -1;		/* word too long */
+    for (; n > 0; n--)		/* text up to the brace joins the prefix */
+	pre[plen++] = brace_char(*rest++);
+    if (open == NULL) {		/* nothing left to expand: a word */
+	ab_word(ab);
+	for (n = 0; n < plen; n++)
+	    ab_putc(ab, pre[n]);
+	ab_putc(ab, '\0');
+	return 0;
+    }
+
+    if (comma) {		/* {a,b,...}: each alternative, then the rest */
+	for (alt = open + 1; alt < p; alt++) {
+	    for (depth = 0, r = (char *)alt; r < p && (depth || *r != BR_COMMA); r++)
+		depth += (*r == BR_OPEN) - (*r == BR_CLOSE);
+	    if ((pat = malloc((r - alt) + strlen(p + 1) + 1)) == NULL)
+		unix_error("malloc error");
+	    memcpy(pat, alt, r - alt);
+	    strcpy(pat + (r - alt), p + 1);
+	    depth = brace_gen(ab, pre, plen, pat);
+	    free(pat);
+	    if (depth < 0)
+		return -1;
+	    alt = r;
+	}
+	return 0;
+    }
+
+    /* {x..y[..step]} over integers or single letters */
+    snprintf(range, sizeof(range), "%.*s", (int)(p - open - 1), open + 1);
+    chars = isalpha((unsigned char)range[0]) && !strncmp(range + 1, "..", 2)
+	&& isalpha((unsigned char)range[3]) && (range[4] == '\0' || range[4] == '.');
+    if (chars) {
+	lo = range[0];
+	hi = range[3];
+	r = range + 4;
+    } else {
+	lo = strtoll(range, &r, 10);
+	if (r == range || strncmp(r, "..", 2)) {
+	    pre[plen] = '{';	/* not a range: the brace is literal */
+	    return brace_gen(ab, pre, plen + 1, open + 1);
+	}
+	hi = strtoll(alt = r + 2, &r, 10);
+	if (r == alt) {
+	    pre[plen] = '{';
+	    return brace_gen(ab, pre, plen + 1, open + 1);
+	}
+    }
+    step = 1;
+    if (!strncmp(r, "..", 2) && (v = strtoll(r + 2, &r, 10)) != 0)
+	step = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+    if (*r != '\0') {
+	pre[plen] = '{';
+	return brace_gen(ab, pre, plen + 1, open + 1);
+    }
+    for (v = lo; ; v = lo <= hi ? (long long)((unsigned long long)v + step)
+	     : (long long)((unsigned long long)v - step)) {
+	if (chars)
+	    n = sprintf(pre + plen, "%c", (int)v);
+	else
+	    n = sprintf(pre + plen, "%lld", v);
+	if (brace_gen(ab, pre, plen + n, p + 1) < 0)
+	    return -1;
+	if ((lo <= hi ? (unsigned long long)hi - v : (unsigned long long)v - hi) < step)
+	    break;		/* (checked before the step, which could overflow) */
+    }
+    return 0;
+}
+
+/* 
+ * brace_word - The lexer has finished a word in ab. Expand its braces
+ *    in place, or just turn the marks back into characters. Returns -1
+ *    (after saying so) if a word it makes is too long.
+ */
+static int brace_word(struct argbuf *ab)
+{
+    static char pre[MAXPENDING];
+    char *w = ab->buf + ab->off[ab->argc - 1], *pat;
+    int rc;
+
+    if (!strchr(w, BR_OPEN) || !strchr(w, BR_CLOSE)) {
+	for (; *w; w++)
+	    *w = brace_char(*w);
+	return 0;
+    }
+    if ((pat = strdup(w)) == NULL)
+	unix_error("strdup error");
+    ab->len = ab->off[--ab->argc];	/* the pattern's words replace it */
+    if ((rc = brace_gen(ab, pre, 0, pat)) < 0)
+	printf("brace expansion: word too long\n");
+    free(pat);
+    return rc;
+}
+
+/* arith_end - Find the "))" closing a $(( at s, NULL if it is not closed */
+const char *arith_end(const char *s)
+{
+    int depth = 0;
+
+    for (; *s && *s != '\n'; s++)
+	if (*s == '(')
+	    depth++;
+	else if (*s == ')' && depth-- == 0)
+	    return s[1] == ')' ? s : NULL;
+    return NULL;
+}
+
+/* arith_dynamic - Does an expression use parameters or variables? */
+static int arith_dynamic(const char *s, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	if (s[i] == '$' || s[i] == '_'
+	    || (isalpha((unsigned char)s[i]) && (i == 0 || !isalnum((unsigned char)s[i-1]))
+		&& !(i > 0 && s[i-1] == '0' && (s[i] == 'x' || s[i] == 'X'))))
+	    return 1;
+    return 0;
+}
+
+/* Binary operators of $(( )), two-character ones first */
+static const struct { char op[3]; int prec; } arith_ops[] = {
+    {"||", 1}, {"&&", 2}, {"==", 6}, {"!=", 6}, {"<=", 7}, {">=", 7},
+    {"<<", 8}, {">>", 8}, {"|", 3}, {"^", 4}, {"&", 5}, {"<", 7},
+    {">", 7}, {"+", 9}, {"-", 9}, {"*", 10}, {"/", 10}, {"%", 10},
+};
+
+static long long arith_binary(const char **sp, int minprec, int *err);
+
+/* arith_unary - A number, a variable, a (parenthesized expression) or -x +x !x ~x */
+static long long arith_unary(const char **sp, int *err)
+{
+    const char *s = *sp + strspn(*sp, " \t");
+    char *end, *val;
+    long long v;
+    size_t n;
+
+    *sp = s + 1;
+    switch (*s) {
+    case '-':
+	if ((v = arith_unary(sp, err)) == LLONG_MIN)
+	    *err = 1;		/* -LLONG_MIN overflows */
+	return *err ? 0 : -v;
+    case '+': return arith_unary(sp, err);
+    case '!': return !arith_unary(sp, err);
+    case '~': return ~arith_unary(sp, err);
+    case '(':
+	v = arith_binary(sp, 1, err);
+	*sp += strspn(*sp, " \t");
+	if (**sp != ')')
+	    *err = 1;
+	else
+	    (*sp)++;
+	return v;
+    }
+    if (isalpha((unsigned char)*s) || *s == '_') {	/* a variable */
+	n = strspn(s, NAMECHARS);
+	*sp = s + n;
+	return (val = var_get(s, n)) != NULL ? strtoll(val, NULL, 0) : 0;
+    }
+    v = strtoll(s, &end, 0);
+    if (end == s)
+	*err = 1;
+    *sp = end;
+    return v;
+}
+
+/* arith_binary - Operators of precedence minprec and up, left to right */
+static long long arith_binary(const char **sp, int minprec, int *err)
+{
+    long long l, r;
+    size_t i, n;
+
+    l = arith_unary(sp, err);
+    while (!*err) {
+	*sp += strspn(*sp, " \t");
+	for (i = 0; i < sizeof(arith_ops) / sizeof(arith_ops[0]); i++)
+	    if (!strncmp(*sp, arith_ops[i].op, n = strlen(arith_ops[i].op)))
+		break;
+	if (i == sizeof(arith_ops) / sizeof(arith_ops[0]) || arith_ops[i].prec < minprec)
+	    return l;
+	*sp += n;
+	r = arith_binary(sp, arith_ops[i].prec + 1, err);
+	if ((arith_ops[i].op[0] == '/' || arith_ops[i].op[0] == '%')
+	    && (r == 0 || (r == -1 && l == LLONG_MIN))) {
+	    *err = 1;		/* division by zero, or LLONG_MIN / -1 */
+	    return 0;
+	}
+	if ((arith_ops[i].op[0] == '<' || arith_ops[i].op[0] == '>') && arith_ops[i].op[1] == arith_ops[i].op[0]
+	    && (r < 0 || r >= 64 || (arith_ops[i].op[0] == '<' && l < 0))) {
+	    *err = 1;		/* shift count out of range, or of a negative number */
+	    return 0;
+	}
+	switch (arith_ops[i].op[0] << 8 | arith_ops[i].op[1]) {
+	case '|' << 8 | '|': l = l || r; break;
+	case '&' << 8 | '&': l = l && r; break;
+	case '=' << 8 | '=': l = l == r; break;
+	case '!' << 8 | '=': l = l != r; break;
+	case '<' << 8 | '=': l = l <= r; break;
+	case '>' << 8 | '=': l = l >= r; break;
+	case '<' << 8 | '<': l = l << r; break;
+	case '>' << 8 | '>': l = l >> r; break;
+	case '|' << 8: l = l | r; break;
+	case '^' << 8: l = l ^ r; break;
+	case '&' << 8: l = l & r; break;
+	case '<' << 8: l = l < r; break;
+	case '>' << 8: l = l > r; break;
+	case '+' << 8: *err = __builtin_add_overflow(l, r, &l); break;
+	case '-' << 8: *err = __builtin_sub_overflow(l, r, &l); break;
+	case '*' << 8: *err = __builtin_mul_overflow(l, r, &l); break;
+	case '/' << 8: l = l / r; break;
+	case '%' << 8: l = l % r; break;
+	}
+    }
+    return 0;
+}
+
+/* 
+ * arith - Evaluate the n-byte integer expression at s, as in $(( )):
+ *    C operators on long longs and variables by name, without assignment. Sets *err (and
+ *    returns 0) on a syntax error, division by zero or overflow.
+ */
+long long arith(const char *s, size_t n, int *err)
+{
+    char expr[MAXLINE];
+    const char *p = expr;
+    long long v;
+
+    if (n >= sizeof(expr)) {
+	*err = 1;		/* (rather than evaluate part of it) */
+	return 0;
+    }
+    snprintf(expr, sizeof(expr), "%.*s", (int)n, s);
+    *err = 0;
+    v = arith_binary(&p, 1, err);
+    if (p[strspn(p, " \t")] != '\0')
+	*err = 1;
+    return *err ? 0 : v;
+}
+
+/* parse_cmd - Parse one simple command, ( list ), { list; } or while loop */
+struct cmd_t *parse_cmd(const char **sp, int *err)
+{
+    struct argbuf ab;
+    char num[32];
+    int i, q = 0, aerr;
+    const char *s = *sp, *e, *w;
+    long long v;
+    struct cmd_t *c;
+    int fanout = parse_fanout, br = 0;
+
+    if ((c = calloc(1, sizeof(struct cmd_t))) == NULL)
+	unix_error("calloc error");
+    if (*s == '(' || isword(s, '{')) {
+	c->type = (*s == '(') ? CMD_SUBSHELL : CMD_GROUP;
+	*sp = s + 1;
+	parse_fanout = 0;	/* (a ',' inside is a ',' again) */
+	c->body = parse_cmds(sp, (*s == '(') ? ")" : "}", err);
+	parse_fanout = fanout;
+	if (!*err && (c->body == NULL || **sp != ((*s == '(') ? ')' : '}')))
+	    *err = 1;		/* empty group, or not closed */
+	if (*err) {
+	    free_cmds(c);
+	    return NULL;
+	}
+	(*sp)++;
+	return c;
+    }
+    if (iskeyword(s, "while")) {	/* while list; do list; done */
+	c->type = CMD_WHILE;
+	*sp = s + 5;
+	c->cond = parse_cmds(sp, "do", err);
+	if (!*err && (c->cond == NULL || !iskeyword(*sp, "do")))
+	    *err = 1;
+	if (!*err) {
+	    *sp += 2;
+	    c->body = parse_cmds(sp, "done", err);
+	    if (!*err && (c->body == NULL || !iskeyword(*sp, "done")))
+		*err = 1;
+	}
+	if (*err) {
+	    free_cmds(c);
+	    return NULL;
+	}
+	*sp += 4;
+	return c;
+    }
+
+    /* A simple command: words up to an unquoted operator */
+    memset(&ab, 0, sizeof(ab));
+    for (;;) {
+	while (*s == ' ' || *s == '\t')
+	    s++;
+	if (!*s || strchr(";&()|\n", *s) || (*s == ',' && fanout))
+	    break;
+	ab_word(&ab);
+	for (w = s; *s && (q || (!strchr(" \t\n;&()|", *s) && !(*s == ',' && fanout && !br))
+			     || (*s == '&' && s > w && (s[-1] == '<' || s[-1] == '>'))); s++) {
+	    if (*s == '\'')
+		q = !q;
+	    else if (q)
+		ab_putc(&ab, *s);
+	    else if (s[0] == '$' && s[1] == '(' && s[2] == '(') {
+		if ((e = arith_end(s + 3)) == NULL) {
+		    *err = 1;	/* no closing "))" */
+		    break;
+		}
+		if (arith_dynamic(s + 3, e - s - 3)) {
+		    for (; s <= e; s++)	/* needs $1 or a variable: evaluated when run */
+			ab_putc(&ab, *s);
+		    ab_putc(&ab, ')');
+		    c->dyn = 1;
+		} else {
+		    v = arith(s + 3, e - s - 3, &aerr);
+		    if (aerr) {
+			printf("%.*s: bad arithmetic expression\n", (int)(e - s - 3), s + 3);
+			*err = -1;
+			break;
+		    }
+		    snprintf(num, sizeof(num), "%lld", v);
+		    for (i = 0; num[i]; i++)
+			ab_putc(&ab, num[i]);
+		    s = e + 1;
+		}
+	    }
+	    else if (*s == '$' && (isalpha((unsigned char)s[1]) || strchr("_{?#@*0123456789", s[1]))) {
+		ab_putc(&ab, *s);	/* a parameter: expanded when run */
+		c->dyn = 1;
+	    }
+	    else if (*s == '{')
+		ab_putc(&ab, BR_OPEN), br++;
+	    else if (*s == '}')
+		ab_putc(&ab, BR_CLOSE), br--;
+	    else if (*s == ',')
+		ab_putc(&ab, BR_COMMA);
+	    else
+		ab_putc(&ab, *s);
+	}
+	ab_putc(&ab, '\0');
+	if (*err || (*err = brace_word(&ab)) != 0)
+	    break;
+    }
+    *sp = s;
+    if (ab.argc == 0 || q || *err) {
+	if (!*err || q)
+	    *err = 1;
+	free(ab.buf);
+	free(ab.off);
+	free(c);
+	return NULL;
+    }
+    c->type = CMD_SIMPLE;
+    s += strspn(s, " \t");
+    if (ab.argc == 1 && s[0] == '(' && s[1 + strspn(s + 1, " \t")] == ')') {
+	s = strchr(s, ')') + 1;	/* name(): a function definition */
+	s += strspn(s, " \t\n");
+	c->type = CMD_FUNCDEF;
+	if (*s == '(' || isword(s, '{'))
+	    c->body = parse_cmd(&s, err);
+	else
+	    *err = 1;		/* (at the end of the line: body comes next) */
+	*sp = s;
+    }
+    c->argv = ab_argv(&ab);
+    if (*err) {
+	free_cmds(c);
+	return NULL;
+    }
+    return c;
+}
+
+/* 
+ * parse_pipe - Parse a pipeline, cmd | cmd ..., which may end with a
+ *    fan-out to several consumers: |> ( pipeline, pipeline ... ).
+ *    A command with no '|' after it is returned as it is.
+ */
+struct cmd_t *parse_pipe(const char **sp, int *err)
+{
+    struct cmd_t *head, *c, *f, **tail, **ftail;
+    const char *s;
+    int fanout = parse_fanout;
+
+    if ((head = parse_cmd(sp, err)) == NULL)
+	return NULL;
+    tail = &head->next;
+    for (;;) {
+	s = *sp + strspn(*sp, " \t");
+	if (s[0] != '|')
+	    break;
+	if (s[1] == '>') {	/* |> ( ... ): the last stage */
+	    s += 2 + strspn(s + 2, " \t\n");
+	    *sp = s;
+	    if (*s != '(') {
+		*err = 1;
+		goto fail;
+	    }
+	    if ((f = calloc(1, sizeof(struct cmd_t))) == NULL)
+		unix_error("calloc error");
+	    f->type = CMD_FANOUT;
+	    *tail = f;
+	    ftail = &f->body;
+	    parse_fanout = 1;
+	    for (*sp = s + 1; ; *sp = s + 1) {
+		*sp += strspn(*sp, " \t\n");
+		if ((c = parse_pipe(sp, err)) == NULL)
+		    break;
+		*ftail = c;
+		ftail = &c->next;
+		s = *sp + strspn(*sp, " \t\n");
+		if (*s != ',') {
+		    *sp = s;
+		    if (*s != ')')
+			*err = 1;
+		    break;
+		}
+	    }
+	    parse_fanout = fanout;
+	    if (*err)
+		goto fail;
+	    (*sp)++;
+	    break;
+	}
+	*sp = s + 1 + strspn(s + 1, " \t\n");
+	if ((c = parse_cmd(sp, err)) == NULL)
+	    goto fail;
+	*tail = c;
+	tail = &c->next;
+    }
+    if (head->next == NULL)
+	return head;
+    if ((c = calloc(1, sizeof(struct cmd_t))) == NULL)
+	unix_error("calloc error");
+    c->type = CMD_PIPE;
+    c->body = head;
+    return c;
+
+fail:
+    free_cmds(head);
+    return NULL;
+}
+
+/* free_cmds - Free a parsed list */
+void free_cmds(struct cmd_t *c)
+{
+    struct cmd_t *next;
+
+    for (; c; c = next) {
+	next = c->next;
+	free_cmds(c->body);
+	free_cmds(c->cond);
+	free(c->argv);
+	free(c->text);
+	free(c);
+    }
+}
+
+/* func_hash - Hash a function or alias name (FNV-1a) */
+static unsigned func_hash(const char *name)
+{
+    unsigned h = 2166136261u;
+
+    while (*name)
+	h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h & (FUNCTAB - 1);
+}
+
+/* func_find - Find a function or alias in tab, NULL if not there */
+struct func_t *func_find(struct func_t **tab, char *name)
+{
+    struct func_t *f;
+
+    for (f = tab[func_hash(name)]; f; f = f->next)
+	if (!strcmp(f->name, name))
+	    return f;
+    return NULL;
+}
+
+/* 
+ * func_define - Define (or redefine) a function or alias with a parsed
+ *    body, which tab owns from now on. An old definition still being
+ *    run by a call in progress is replaced, and freed when it returns.
+ */
+struct func_t *func_define(struct func_t **tab, char *name, struct cmd_t *body)
+{
+    struct func_t *f;
+    unsigned h;
+
+    if ((f = func_find(tab, name)) != NULL && !f->busy) {
+	free_cmds(f->body);
+	free(f->value);
+	f->value = NULL;
+	f->body = body;
+	return f;
+    }
+    if (f != NULL)
+	func_remove(tab, name);
+    if ((f = calloc(1, sizeof(struct func_t))) == NULL
+	|| (f->name = strdup(name)) == NULL)
+	unix_error("malloc error");
+    f->body = body;
+    h = func_hash(name);
+    f->next = tab[h];
+    tab[h] = f;
+    return f;
+}
+
+/*
+ * func_remove - Remove a function or alias from tab. One that is being
+ *    called is only unlinked; call_func frees it when the call returns.
+ */
+void func_remove(struct func_t **tab, char *name)
+{
+    struct func_t **fp, *f;
+
+    for (fp = &tab[func_hash(name)]; (f = *fp) != NULL; fp = &f->next)
+	if (!strcmp(f->name, name)) {
+	    *fp = f->next;
+	    if (f->busy)
+		f->dead = 1;
+	    else
+		func_free(f);
+	    return;
+	}
+}
+
+/* func_free - Free a function or alias that is no longer in any table */
+void func_free(struct func_t *f)
+{
+    free_cmds(f->body);
+    free(f->value);
+    free(f->name);
+    free(f);
+}
+
+/* var_find - Find the variable named by the n bytes at name */
+static struct var_t *var_find(const char *name, size_t n, unsigned *h)
+{
+    struct var_t *v;
+    unsigned hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    *h = hash & (VARTAB - 1);
+    for (v = vars[*h]; v; v = v->next)
+	if (!strncmp(v->name, name, n) && v->name[n] == '\0')
+	    return v;
+    return NULL;
+}
+
+/* var_get - Value of the variable named by n bytes at name, NULL if unset */
+char *var_get(const char *name, size_t n)
+{
+    struct var_t *v;
+    unsigned h;
+
+    return (v = var_find(name, n, &h)) != NULL ? v->value : NULL;
+}
+
+/* 
+ * var_set - Set the variable named by n bytes at name. The value's
+ *    buffer is reused when it is big enough, so a loop that sets the
+ *    same variable on each pass does not allocate.
+ */
+void var_set(const char *name, const char *value, size_t n)
+{
+    struct var_t *v;
+    size_t len = strlen(value);
+    unsigned h;
+
+    if ((v = var_find(name, n, &h)) == NULL) {
+	if ((v = calloc(1, sizeof(struct var_t))) == NULL
+	    || (v->name = strndup(name, n)) == NULL)
+	    unix_error("malloc error");
+	v->next = vars[h];
+	vars[h] = v;
+    }
+    if (len >= v->size) {
+	v->size = len < 32 ? 32 : 2 * len;
+	if ((v->value = realloc(v->value, v->size)) == NULL)
+	    unix_error("realloc error");
+    }
+    memcpy(v->value, value, len + 1);
+}
+
+/* var_unset - Remove a variable */
+void var_unset(const char *name)
+{
+    struct var_t **vp, *v;
+    unsigned h;
+
+    if (var_find(name, strlen(name), &h) == NULL)
+	return;
+    for (vp = &vars[h]; (v = *vp) != NULL; vp = &v->next)
+	if (!strcmp(v->name, name)) {
+	    *vp = v->next;
+	    free(v->name);
+	    free(v->value);
+	    free(v);
+	    return;
+	}
+}
+
+/* 
+ * builtin_cmd - If the user has typed a built-in command then execute
+ *    it immediately.  
+ */
+int builtin_cmd(char **argv) 
+{
+								/* If argv[0] is quit, exit the shell */ 
+	if(!strcmp(argv[0], "quit"))				/* strcmp compares the C string str1 to the C string str2 */
+		{
+		gang_release();					/* Don't leave time-sliced jobs stopped */
+		exit(0);          
+		}          
+	else if((!strcmp(argv[0], "bg")) || (!strcmp(argv[0], "fg")))
+								/* If arv[0] is "bg" or "fg", do: */
+		{ 
+		do_bgfg(argv);     				/* Call fucntion that executes those commands */
+		return 1;
+		}
+	else if(!strcmp(argv[0], "jobs"))    			/* If arv[0] is "jobs", do: */ 
+		{
+		listjobs(jobs, argv[1] && !strcmp(argv[1], "-l")); /* Call fucntion that executes those commands */		
+		return 1;
+		}
+	else if(!strcmp(argv[0], "batch"))			/* If argv[0] is "batch", launch a file of jobs */
+		{
+		do_batch(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "repeat"))			/* If argv[0] is "repeat", benchmark a command */
+		{
+		do_repeat(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "outmux"))			/* If argv[0] is "outmux", set the output mode */
+		{
+		do_outmux(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "spool"))			/* If argv[0] is "spool", set up log spooling */
+		{
+		do_spool(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "joblog"))			/* If argv[0] is "joblog", print a job's log */
+		{
+		do_joblog(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "throttle"))			/* If argv[0] is "throttle", set an output budget */
+		{
+		do_throttle(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "gang"))			/* If argv[0] is "gang", set up time slicing */
+		{
+		do_gang(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "resources"))			/* If argv[0] is "resources", set the host budget */
+		{
+		do_resources(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "bgstdin"))			/* If argv[0] is "bgstdin", set the bg stdin policy */
+		{
+		do_bgstdin(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "feed"))			/* If argv[0] is "feed", write to a job's stdin */
+		{
+		do_feed(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "agents"))			/* If argv[0] is "agents", manage worker agents */
+		{
+		do_agents(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "kill"))			/* If argv[0] is "kill", signal a job */
+		{
+		do_kill(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "disown"))			/* If argv[0] is "disown", forget a job */
+		{
+		do_disown(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "source") || !strcmp(argv[0], "."))
+								/* If argv[0] is "source", run a script in this shell */
+		{
+		do_source(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "alias"))			/* If argv[0] is "alias", define or list aliases */
+		{
+		do_alias(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "unalias"))			/* If argv[0] is "unalias", remove an alias */
+		{
+		if(argv[1] && func_find(aliases, argv[1]))
+			func_remove(aliases, argv[1]);
+		else
+			printf("unalias: %s: not found \n", argv[1] ? argv[1] : "");
+		return 1;
+		}
+	else if(!strcmp(argv[0], "unset") && argv[1] && !strcmp(argv[1], "-f"))
+								/* If argv[0] is "unset -f", remove functions */
+		{
+		for(argv += 2; *argv; argv++)
+			func_remove(funcs, *argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "unset"))			/* If argv[0] is "unset", remove variables */
+		{
+		for(argv++; *argv; argv++)
+			var_unset(*argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "pipestat"))			/* If argv[0] is "pipestat", set pipeline measuring */
+		{
+		do_pipestat(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "ulimit"))			/* If argv[0] is "ulimit", show or set the shell's limits */
+		{
+		do_ulimit(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "read"))			/* If argv[0] is "read", read a line into variables */
+		{
+		do_read(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "print"))			/* If argv[0] is "print", write a line to an fd */
+		{
+		do_print(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "hash"))			/* If argv[0] is "hash", show or clear the exec cache */
+		{
+		do_hash(argv);
+		return 1;
+		}
+	else if(!strcmp(argv[0], "coproc"))			/* If argv[0] is "coproc", start a coprocess */
+		{
+		do_coproc(argv);
+		return 1;
+		}
+	else
+		{						/* Not a builtin command */
+		return 0;
+		}    	
+} 
+
+/* 
+ * do_bgfg - Execute the builtin bg and fg commands
+ */
+void do_bgfg(char **argv) 
+{
+
+	int jobid;              				/* Pointers get information about process */ 
+	pid_t pidt; 	
+	struct job_t *jid; 
+	int is_BG = (!strcmp(argv[0], "bg"));  			/* True if argv is a bg process */ 	
+	
+	if(is_BG)
+								/* Error checking */  
+		{
+		if(!argv[1]) 					/* Bg job */			
+			{
+			printf("bg command requires PID or %%jobid argument \n");
+			return; 
+			}					/* atoi parses the C string str interpreting its content as an 
+								 * integral number, which is returned as an int value. */
+		if((atoi(argv[1]+1) == 0 && argv[1][0] == '%') || (atoi(argv[1]) == 0 && argv[1][0] != '%')) 
+			{
+			printf("bg: argument must be a PID or %%jobid \n");
+			return;
+			}
+		}
+	else
+		{ 
+		if(!argv[1]) 					/* Fg job */
+			{
+			printf("fg command requires PID or %%jobid argument \n");
+			return; 
+			}
+		if((atoi(argv[1]+1) == 0 && argv[1][0] == '%') || (atoi(argv[1]) == 0 && argv[1][0] != '%')) 
+			{
+			printf("fg: argument must be a PID or %%jobid \n");
+			return;
+			}
+		}			
+	if(argv[1][0] == '%')
+								/* If either command is denoting process by Job ID */ 
+		{
+		jobid = atoi(argv[1]+1);      
+								/* Get job ID from command line */ 
+		if((jid = getjobjid(jobs, jobid)) == NULL)
+								/* Get job struct of job ID */  
+			{
+			printf("%%%d: No such job \n", jobid);
+			return; 
+			}
+		pidt = jid->pid;  
+								/* Get process ID of that job */ 
+		}
+								/* Similar idea for command using pid */ 
+	else 
+		{
+		pidt = atoi(argv[1]);
+			if((jid = getjobpid(jobs, pidt)) == NULL)
+			{
+			printf("(%d): No such process \n", pidt); 
+			return;
+			}
+		jobid = jid->pid; 
+		}  
+	 
+								/* If command is bg */ 
+	if(is_BG && jid->state == SL)
+		{						/* Already running as far as the user is concerned: */
+		printf("[%d] (%d) %s", jobid, pidt, jid->cmdline);  /* gang continues it with its next slice */
+		}
+	else if(is_BG) 
+		{ 
+		jid->state = BG;      				/* Change state to bg */ 
+		jid->stopsig = 0;
+		signaljob(jid, SIGCONT);			/* Reset and continue command */ 
+		printf("[%d] (%d) %s", jobid, pidt, jid->cmdline);   /* Print out info */ 
+		}
+								/* Similar idea for fg, but now we must wait since it is now in 								 * the fg */ 
+	else 
+		{
+		jid->state = FG; 				/* If command is fg */
+		jid->stopsig = 0;
+		tty_give(jid);					/* Terminal (and its modes) before it runs */
+		signaljob(jid, SIGCONT);			/* Change state to fg */ 
+		waitfg(pidt);		
+		}
+ 	return;
+}
+
+/*
+ * do_batch - Execute the builtin batch command:
+ *    batch [-j n|auto] [-w tag=weight ...] file
+ *
+ * Every non-empty line of file is started as a background job, keeping
+ * at most n of them running at once (default: as many as fit in the job
+ * list). With -j auto the limit follows the completions instead (see
+ * aimd_done). Launches go out in bursts through the spawner pool, and
+ * the builtin returns once the last batch job has been reaped.
+ *
+ * Lines wait for a slot in a pending queue, read up to BATCHAHEAD lines
+ * ahead. A line may start with prio=N (default 0, higher first),
+ * deadline=S (seconds from the start of the batch; earliest first among
+ * equal priorities) and tag=name. Lines with neither go out in fair
+ * share across their tags, in proportion to the -w weights (default 1).
+ */
+void do_batch(char **argv)
+{
+	FILE *fp;
+	char line[MAXLINE];
+	char *args[MAXARGS];
+	sigset_t mask, prev;
+	int par = MAXJOBS;					/* Max batch jobs running at once */
+	int autopar = 0;					/* If true, par follows aimd.limit */
+	int i, n, room, started = 0, failed = 0, eof = 0;
+	struct spawn_req *req;
+	struct pq_t pq = { NULL, 0, 0 };			/* Lines waiting for a slot */
+	struct pend_t e;
+	long long start;
+	long seq = 0;
+	char *p, *cmd;
+
+	ntags = 0;						/* Tags and weights are per batch */
+	tag_find("", 1);					/* tags[0]: untagged lines */
+	vclock = 0;
+	i = 1;
+	while(argv[i] && (!strcmp(argv[i], "-j") || !strcmp(argv[i], "-w")))
+		{
+		if(!strcmp(argv[i], "-w"))
+			{
+			if(!argv[i+1] || (p = strchr(argv[i+1], '=')) == NULL || atof(p + 1) <= 0)
+				{
+				printf("batch: -w requires tag=weight with a positive weight \n");
+				return;
+				}
+			*p = '\0';
+			if((n = tag_find(argv[i+1], 1)) < 0)
+				{
+				printf("batch: too many tags \n");
+				return;
+				}
+			tags[n].weight = atof(p + 1);
+			}
+		else if(argv[i+1] && !strcmp(argv[i+1], "auto"))
+			autopar = 1;
+		else if(!argv[i+1] || (par = atoi(argv[i+1])) <= 0)
+			{
+			printf("batch: -j requires a positive count or auto \n");
+			return;
+			}
+		i += 2;
+		}
+	if(!argv[i])
+		{
+		printf("batch command requires a file argument \n");
+		return;
+		}
+	if((fp = fopen(argv[i], "r")) == NULL)
+		{
+		printf("batch: %s: %s \n", argv[i], strerror(errno));
+		return;
+		}
+
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGCHLD);
+	Sigprocmask(SIG_BLOCK, &mask, &prev);			/* SIGCHLD stays blocked until each burst is in jobs[] */
+	if(autopar)
+		aimd_start(MAXJOBS);
+	start = now_ns();
+	deadmiss = 0;
+	while(!eof || pq.n || batchjobs(jobs))
+		{
+		while(!eof && pq.n < BATCHAHEAD)		/* Top up the pending queue */
+			{
+			if(fgets(line, MAXLINE - 1, fp) == NULL)
+				{
+				eof = 1;
+				break;
+				}
+			if(line[strlen(line)-1] != '\n')		/* parseline expects the trailing newline */
+				strcat(line, "\n");
+			if((cmd = pend_parse(line, &e, start)) == NULL)
+				{
+				printf("batch: bad prio, deadline or tag: %s", line);
+				failed++;
+				continue;
+				}
+			parseline(cmd, args);
+			if(args[0] == NULL || args[0][0] == '#')
+				continue;
+			if((e.line = strdup(cmd)) == NULL)
+				unix_error("strdup error");
+			e.seq = seq++;
+			e.vfinish = (vclock > tags[e.tag].vfinish ? vclock : tags[e.tag].vfinish) + 1 / tags[e.tag].weight;
+			tags[e.tag].vfinish = e.vfinish;
+			pq_push(&pq, &e);
+			}
+		if(autopar)
+			par = aimd.limit;
+		room = par - batchjobs(jobs);			/* Size the next burst */
+		if(MAXJOBS - numjobs(jobs) < room)		/* ... and to the free slots in jobs[] */
+			room = MAXJOBS - numjobs(jobs);
+		if(room > SPAWNQ)
+			room = SPAWNQ;
+		for(n = 0; pq.n > 0 && n < room; )
+			{
+			pq_pop(&pq, &e);				/* The most urgent line */
+			vclock = e.vfinish;
+			strcpy(line, e.line);
+			free(e.line);
+			parseline(line, args);
+			req = &spawnreqs[n];
+			req->deadline = e.deadline == LLONG_MAX ? 0 : e.deadline;
+			n++;
+			strcpy(req->cmdline, line);
+			req->t0 = now_ns();
+			req->cap = (outmux || spooldir[0] || throttle_rate) ? capture_open() : NULL;
+			req->infd = (bgstdin == IN_PIPE) ? bgstdin_open(&req->feedfd) : -1;
+			for(i = 0, p = req->buf; args[i]; i++)	/* parseline's buffer is static, so copy out */
+				{
+				req->argv[i] = strcpy(p, args[i]);
+				p += strlen(args[i]) + 1;
+				}
+			req->argv[i] = NULL;
+			}
+		if(n > 0)
+			{
+			spawn_burst(spawnreqs, n);
+			for(i = 0; i < n; i++)			/* Register the whole burst before any SIGCHLD runs */
+				{
+				req = &spawnreqs[i];
+				if(req->err)
+					{
+					printf("%s: Command not found. \n", req->argv[0]);
+					failed++;
+					}
+				else if(addjob(jobs, req->pid, BG, req->cmdline))
+					{
+					getjobpid(jobs, req->pid)->batch = BATCH_JOB;
+					getjobpid(jobs, req->pid)->t0 = req->t0;
+					getjobpid(jobs, req->pid)->deadline = req->deadline;
+					started++;
+					if(verbose)
+						printf("[%d] (%d) %s", pid2jid(req->pid), req->pid, req->cmdline);
+					}
+				if(req->cap)
+					capture_attach(req->cap, pid2jid(req->pid), req->pid);
+				if(req->infd >= 0)
+					{
+					close(req->infd);
+					if(getjobpid(jobs, req->pid))
+						getjobpid(jobs, req->pid)->feedfd = req->feedfd;
+					else
+						close(req->feedfd);
+					}
+				}
+			}
+		else if(numjobs(jobs))
+			{
+			evl_wait(-1, &prev);			/* Wait for a job to finish, draining output */
+			}
+		}
+	aimd.on = 0;
+	Sigprocmask(SIG_SETMASK, &prev, NULL);
+	fclose(fp);
+	free(pq.v);
+	printf("batch: %d jobs started, %d failed", started, failed);
+	if(autopar)
+		printf(", %d to %d at a time", aimd.lo, aimd.hi);
+	if(deadmiss)
+		printf(", %d past their deadline", deadmiss);
+	printf(" \n");
+	return;
+}
+
+/* cmp_ll - qsort comparison for long longs */
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * do_repeat - Execute the builtin repeat command: repeat n [-j p|auto] cmd ...
+ *
+ * Run cmd n times, at most p at a time (default 1, or adapted to the
+ * completions with -j auto, as batch does), as background jobs
+ * launched and reaped the way batch jobs are. Then print the throughput
+ * and the spread of the latencies, each from the launch request to the
+ * reap. Ctrl-c stops further launches.
+ */
+void do_repeat(char **argv)
+{
+	char cmdline[MAXLINE];
+	char **cmd;
+	sigset_t mask, prev;
+	int runs, par = 1;					/* Runs in all, and at once */
+	int autopar = 0;					/* If true, par follows aimd.limit */
+	int i, j, n, room, started = 0, failed = 0;
+	long long t0, elapsed, sum = 0;
+	struct spawn_req *req;
+	char *p;
+
+	if(!argv[1] || (runs = atoi(argv[1])) <= 0)
+		{
+		printf("repeat: usage: repeat n [-j p|auto] command ... \n");
+		return;
+		}
+	i = 2;
+	if(argv[i] && !strcmp(argv[i], "-j"))
+		{
+		if(argv[i+1] && !strcmp(argv[i+1], "auto"))
+			autopar = 1;
+		else if(!argv[i+1] || (par = atoi(argv[i+1])) <= 0)
+			{
+			printf("repeat: -j requires a positive count or auto \n");
+			return;
+			}
+		i += 2;
+		}
+	if(!argv[i])
+		{
+		printf("repeat: no command to run \n");
+		return;
+		}
+	cmd = argv + i;
+	for(cmdline[0] = '\0', j = 0; cmd[j]; j++)		/* For the job list */
+		{
+		strncat(cmdline, cmd[j], MAXLINE - strlen(cmdline) - 3);
+		strcat(cmdline, cmd[j+1] ? " " : "\n");
+		}
+	if((replat = malloc(runs * sizeof(long long))) == NULL)
+		unix_error("malloc error");
+	repmax = runs;
+	repdone = 0;
+	intrpending = 0;
+
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGCHLD);
+	Sigprocmask(SIG_BLOCK, &mask, &prev);
+	if(autopar)
+		aimd_start(MAXJOBS);
+	t0 = now_ns();
+	while((started + failed < runs && !intrpending) || batchjobs(jobs))
+		{
+		if(autopar)
+			par = aimd.limit;
+		room = par - batchjobs(jobs);			/* Size the next burst as batch does */
+		if(MAXJOBS - numjobs(jobs) < room)
+			room = MAXJOBS - numjobs(jobs);
+		if(room > SPAWNQ)
+			room = SPAWNQ;
+		if(room > runs - started - failed)
+			room = runs - started - failed;
+		if(intrpending)
+			room = 0;
+		for(n = 0; n < room; n++)
+			{
+			req = &spawnreqs[n];
+			strcpy(req->cmdline, cmdline);
+			req->cap = (outmux || spooldir[0] || throttle_rate) ? capture_open() : NULL;
+			req->infd = (bgstdin == IN_PIPE) ? bgstdin_open(&req->feedfd) : -1;
+			for(j = 0, p = req->buf; cmd[j] && j < MAXARGS - 1 && p + strlen(cmd[j]) < req->buf + MAXLINE; j++)
+				{
+				req->argv[j] = strcpy(p, cmd[j]);
+				p += strlen(cmd[j]) + 1;
+				}
+			req->argv[j] = NULL;
+			req->t0 = now_ns();
+			}
+		if(n > 0)
+			{
+			spawn_burst(spawnreqs, n);
+			for(i = 0; i < n; i++)
+				{
+				req = &spawnreqs[i];
+				if(req->err && failed++ == 0)
+					printf("%s: Command not found. \n", req->argv[0]);
+				else if(req->err)
+					;
+				else if(addjob(jobs, req->pid, BG, req->cmdline))
+					{
+					getjobpid(jobs, req->pid)->batch = REPEAT_JOB;
+					getjobpid(jobs, req->pid)->t0 = req->t0;
+					started++;
+					}
+				if(req->cap)
+					capture_attach(req->cap, pid2jid(req->pid), req->pid);
+				if(req->infd >= 0)
+					{
+					close(req->infd);
+					if(getjobpid(jobs, req->pid))
+						getjobpid(jobs, req->pid)->feedfd = req->feedfd;
+					else
+						close(req->feedfd);
+					}
+				}
+			}
+		else if(numjobs(jobs))
+			{
+			evl_wait(-1, &prev);			/* Wait for a run to finish */
+			}
+		}
+	elapsed = now_ns() - t0;
+	aimd.on = 0;
+	Sigprocmask(SIG_SETMASK, &prev, NULL);
+
+	if(autopar)
+		sprintf(sbuf, "%d to %d", aimd.lo, aimd.hi);
+	else
+		sprintf(sbuf, "%d", par);
+	printf("repeat: %d runs (%s at a time), %d failed, in %.3f s: %.1f runs/s \n",
+	       started, sbuf, failed, elapsed / 1e9, started ? started / (elapsed / 1e9) : 0.0);
+	if(repdone > 0)
+		{
+		qsort(replat, repdone, sizeof(long long), cmp_ll);
+		for(i = 0; i < repdone; i++)
+			sum += replat[i];
+		printf("latency ms: min %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f mean %.3f \n",
+		       replat[0] / 1e6, replat[(repdone - 1) * 50 / 100] / 1e6,
+		       replat[(repdone - 1) * 90 / 100] / 1e6, replat[(repdone - 1) * 99 / 100] / 1e6,
+		       replat[repdone - 1] / 1e6, sum / 1e6 / repdone);
+		}
+	free(replat);
+	replat = NULL;
+	exitstatus = failed ? 1 : 0;
+}
+
+/*
+ * do_outmux - Execute the builtin outmux command: outmux [on [-t] | off]
+ *
+ * With outmux on, the stdout and stderr of each new background job go
+ * through a pipe to the shell, which writes them out a whole line at a
+ * time prefixed with [jid] (and a timestamp with -t).
+ */
+void do_outmux(char **argv)
+{
+	if(!argv[1])
+		{
+		printf("outmux %s%s \n", outmux ? "on" : "off", outmux && outmux_ts ? " -t" : "");
+		return;
+		}
+	if(!strcmp(argv[1], "on"))
+		{
+		outmux = 1;
+		outmux_ts = (argv[2] && !strcmp(argv[2], "-t"));
+		}
+	else if(!strcmp(argv[1], "off"))
+		{
+		outmux = 0;					/* Pipes already open drain as usual */
+		}
+	else
+		{
+		printf("outmux: argument must be on or off \n");
+		}
+	return;
+}
+
+/*
+ * do_pipestat - Execute the builtin pipestat command: pipestat [on | off]
+ *
+ * With pipestat on, each new pipeline has a relay between every two
+ * stages that counts the bytes passing and the time spent waiting for
+ * the stage before it and for the stage after it. jobs -l shows the
+ * numbers, and they are printed when the job ends, with the stage the
+ * others waited on most.
+ */
+void do_pipestat(char **argv)
+{
+	if(!argv[1])
+		printf("pipestat %s \n", pipestat ? "on" : "off");
+	else if(!strcmp(argv[1], "on"))
+		pipestat = 1;
+	else if(!strcmp(argv[1], "off"))
+		pipestat = 0;					/* Jobs already measured keep their relays */
+	else
+		printf("pipestat: argument must be on or off \n");
+}
+
+/*
+ * do_spool - Execute the builtin spool command:
+ *    spool [on [-d dir] [-s size] | off]
+ *
+ * With spool on, the output of each new background job is written to
+ * dir/job-<pid>-<time>.log, time being when it started. When that file
+ * reaches size bytes it is rotated to job-<pid>-<time>.log.<n> and
+ * compressed to .<n>.gz in the background.
+ */
+void do_spool(char **argv)
+{
+	int i;
+	long long size = spoolmax;
+	char *dir = ".";
+
+	if(!argv[1])
+		{
+		if(spooldir[0])
+			printf("spool on -d %s -s %lld \n", spooldir, spoolmax);
+		else
+			printf("spool off \n");
+		return;
+		}
+	if(!strcmp(argv[1], "off"))
+		{
+		spooldir[0] = '\0';				/* Open spools run until their jobs exit */
+		return;
+		}
+	if(strcmp(argv[1], "on"))
+		{
+		printf("spool: argument must be on or off \n");
+		return;
+		}
+	for(i = 2; argv[i]; i += 2)
+		{
+		if(!strcmp(argv[i], "-d") && argv[i+1])
+			dir = argv[i+1];
+		else if(!strcmp(argv[i], "-s") && argv[i+1] && (size = parse_size(argv[i+1])) > 0)
+			;
+		else
+			{
+			printf("spool: usage: spool on [-d dir] [-s size] \n");
+			return;
+			}
+		}
+	if(strlen(dir) >= MAXLINE/2)
+		{
+		printf("spool: directory name too long \n");
+		return;
+		}
+	if(access(dir, W_OK) < 0)
+		{
+		printf("spool: %s: %s \n", dir, strerror(errno));
+		return;
+		}
+	strcpy(spooldir, dir);
+	spoolmax = size;
+	return;
+}
+
+/*
+ * do_joblog - Execute the builtin joblog command: joblog PID|%jobid
+ *
+ * Print the spooled output of a job, oldest segment first. Compressed
+ * and uncompressed segments are both read through zlib.
+ */
+void do_joblog(char **argv)
+{
+	char path[MAXLINE], seg[MAXLINE+16];
+	char buf[8192];
+	struct job_t *job;
+	struct stat st;
+	gzFile in;
+	pid_t pid;
+	long id;
+	int i, n;
+
+	if(!argv[1] || (argv[1][0] == '%' ? atoi(argv[1]+1) : atoi(argv[1])) <= 0)
+		{
+		printf("joblog command requires PID or %%jobid argument \n");
+		return;
+		}
+	if(argv[1][0] == '%')					/* Finished jobs can only be named by pid */
+		{
+		if((job = getjobjid(jobs, atoi(argv[1]+1))) == NULL)
+			{
+			printf("%s: No such job \n", argv[1]);
+			return;
+			}
+		pid = job->pid;
+		}
+	else
+		{
+		pid = atoi(argv[1]);
+		job = getjobpid(jobs, pid);
+		}
+	if(!spooldir[0])
+		{
+		printf("joblog: spooling is off \n");
+		return;
+		}
+	if(job && job->cap && job->cap->logfd >= 0)		/* Else the newest log with that pid */
+		id = job->cap->spoolid;
+	else if((id = spool_find(pid)) < 0)
+		{
+		printf("joblog: %d: no spooled output \n", pid);
+		return;
+		}
+	spool_path(path, pid, id);
+	fflush(stdout);
+	for(i = 1; ; i++)					/* Rotated segments, then the live one */
+		{
+		sprintf(seg, "%s.%d.gz", path, i);
+		if(stat(seg, &st) < 0)
+			sprintf(seg, "%s.%d", path, i);
+		if(stat(seg, &st) < 0)
+			strcpy(seg, path);
+		if((in = gzopen(seg, "rb")) == NULL)
+			{
+			if(i == 1)
+				printf("joblog: %s: %s \n", path, strerror(errno));
+			return;
+			}
+		while((n = gzread(in, buf, sizeof(buf))) > 0)
+			fwrite(buf, 1, n, stdout);
+		gzclose(in);
+		if(!strcmp(seg, path))
+			break;
+		}
+	return;
+}
+
+/*
+ * do_resources - Execute the builtin resources command:
+ *    resources [cpus=N] [mem=SIZE] [wait=S]
+ *
+ * Set the budget that jobs declared as cmd & cpus=N mem=SIZE are packed
+ * into (default: the online CPUs and the physical memory), and how long
+ * the oldest waiting launch lets smaller ones backfill past it. Without
+ * arguments, show the budget and what is reserved and waiting.
+ */
+void do_resources(char **argv)
+{
+	struct res_t used;
+	long long v;
+	int i;
+
+	res_init();
+	if(!argv[1])
+		{
+		res_used(&used);
+		printf("resources: cpus %d of %d reserved, mem %lldM of %lldM reserved, %d waiting, backfill for %d s \n",
+		       used.cpus, resbudget.cpus, used.mem >> 20, resbudget.mem >> 20, nresq, reswait);
+		return;
+		}
+	for(i = 1; argv[i]; i++)
+		{
+		if(!strncmp(argv[i], "cpus=", 5) && (v = atoi(argv[i] + 5)) > 0)
+			resbudget.cpus = v;
+		else if(!strncmp(argv[i], "mem=", 4) && (v = parse_size(argv[i] + 4)) > 0)
+			resbudget.mem = v;
+		else if(!strncmp(argv[i], "wait=", 5) && (v = atoi(argv[i] + 5)) >= 0 && isdigit(argv[i][5]))
+			reswait = v;
+		else
+			{
+			printf("resources: usage: resources [cpus=N] [mem=SIZE] [wait=S] \n");
+			return;
+			}
+		}
+	res_sched();						/* A bigger budget may let some start */
+	return;
+}
+
+/*
+ * do_gang - Execute the builtin gang command: gang [off | n|cpus [ms]]
+ *
+ * When more local background jobs are running than n (cpus: one per
+ * online CPU), run n of them at a time and rotate them every ms
+ * milliseconds (default 200) with SIGSTOP and SIGCONT, each job's whole
+ * process group together. Jobs run in longer stretches than the
+ * kernel's own time sharing gives them, so they thrash the caches less.
+ * Without arguments, show the setting.
+ */
+void do_gang(char **argv)
+{
+	int n, ms = gang_quantum;
+
+	if(!argv[1])
+		{
+		if(gang_slots)
+			printf("gang %d jobs at a time, %d ms slices \n", gang_slots, gang_quantum);
+		else
+			printf("gang off \n");
+		return;
+		}
+	if(!strcmp(argv[1], "off"))
+		{
+		gang_release();
+		gang_slots = 0;
+		return;
+		}
+	n = !strcmp(argv[1], "cpus") ? sysconf(_SC_NPROCESSORS_ONLN) : atoi(argv[1]);
+	if(argv[2])
+		ms = atoi(argv[2]);
+	if(n <= 0 || ms <= 0 || (argv[2] && argv[3]))
+		{
+		printf("gang: usage: gang [off | n|cpus [ms]] \n");
+		return;
+		}
+	gang_slots = n;
+	gang_quantum = ms;
+	gang_owner = getpid();
+	gang_next = 0;
+	gang_tick();
+	return;
+}
+
+/*
+ * do_throttle - Execute the builtin throttle command:
+ *    throttle [PID|%jobid] [-m drop|block] rate
+ *
+ * Give a job an output budget of rate bytes per second (0 removes it).
+ * Without a job, set the budget for background jobs started from now
+ * on; their output then always goes through the shell. With -m drop,
+ * output over budget is thrown away and summarized; with -m block the
+ * shell stops reading and the job blocks on its full pipe.
+ */
+void do_throttle(char **argv)
+{
+	char *arg[2];
+	int i, n = 0, mode = -1;
+	long long rate;
+	struct job_t *job = NULL;
+
+	if(!argv[1])
+		{
+		printf("throttle %lld bytes/s (%s) \n", throttle_rate, throttle_mode == THR_BLOCK ? "block" : "drop");
+		return;
+		}
+	for(i = 1; argv[i]; i++)
+		{
+		if(!strcmp(argv[i], "-m") && argv[i+1])
+			{
+			if(!strcmp(argv[++i], "drop"))
+				mode = THR_DROP;
+			else if(!strcmp(argv[i], "block"))
+				mode = THR_BLOCK;
+			else
+				n = 3;
+			}
+		else if(n < 2)
+			arg[n++] = argv[i];
+		else
+			n = 3;
+		}
+	if(n == 0 || n == 3 || (rate = parse_size(arg[n-1])) < 0)
+		{
+		printf("throttle: usage: throttle [PID|%%jobid] [-m drop|block] rate \n");
+		return;
+		}
+	if(n == 1)						/* Default for new background jobs */
+		{
+		throttle_rate = rate;
+		if(mode >= 0)
+			throttle_mode = mode;
+		return;
+		}
+	if((job = getjobarg(jobs, arg[0])) == NULL)
+		{
+		printf("%s: No such job \n", arg[0]);
+		return;
+		}
+	if(job->cap == NULL)
+		{
+		printf("%s: output does not go through the shell \n", arg[0]);
+		return;
+		}
+	job->cap->rate = rate;
+	job->cap->tokens = rate;
+	if(mode >= 0)
+		job->cap->mode = mode;
+	throttle_resume();					/* (a paused job may be free to go now) */
+	return;
+}
+
+/*
+ * do_bgstdin - Execute the builtin bgstdin command:
+ *    bgstdin [tty | null | file PATH | pipe]
+ *
+ * Choose what background jobs read as stdin. With tty (the default) a
+ * job that reads the terminal is stopped by SIGTTIN until it is moved
+ * to the foreground. With pipe, each job gets a pipe the shell writes
+ * to with feed.
+ */
+void do_bgstdin(char **argv)
+{
+	static char *names[] = { "tty", "null", "file", "pipe" };
+
+	if(!argv[1])
+		{
+		printf("bgstdin %s%s%s \n", names[bgstdin], bgstdin == IN_FILE ? " " : "", bgstdin == IN_FILE ? bgstdin_path : "");
+		return;
+		}
+	if(!strcmp(argv[1], "tty"))
+		bgstdin = IN_TTY;
+	else if(!strcmp(argv[1], "null"))
+		bgstdin = IN_NULL;
+	else if(!strcmp(argv[1], "pipe"))
+		bgstdin = IN_PIPE;
+	else if(!strcmp(argv[1], "file") && argv[2])
+		{
+		if(access(argv[2], R_OK) < 0)
+			{
+			printf("bgstdin: %s: %s \n", argv[2], strerror(errno));
+			return;
+			}
+		strcpy(bgstdin_path, argv[2]);
+		bgstdin = IN_FILE;
+		}
+	else
+		printf("bgstdin: argument must be tty, null, file PATH or pipe \n");
+	return;
+}
+
+/*
+ * do_feed - Execute the builtin feed command: feed [-e] PID|%jobid [text ...]
+ *
+ * Write text (and a newline) to the stdin pipe of a job started with
+ * bgstdin pipe. With -e, close the pipe afterwards so the job sees EOF.
+ */
+void do_feed(char **argv)
+{
+	char buf[MAXLINE];
+	struct job_t *job;
+	sigset_t mask, prev;
+	int i = 1, eof = 0, n = 0;
+
+	if(argv[i] && !strcmp(argv[i], "-e"))
+		{
+		eof = 1;
+		i++;
+		}
+	if(!argv[i])
+		{
+		printf("feed command requires PID or %%jobid argument \n");
+		return;
+		}
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGCHLD);
+	Sigprocmask(SIG_BLOCK, &mask, &prev);			/* deletejob closes feedfd too */
+	if((job = getjobarg(jobs, argv[i])) == NULL)
+		printf("%s: No such job \n", argv[i]);
+	else if(job->feedfd < 0)
+		printf("%s: stdin is not a shell pipe \n", argv[i]);
+	else
+		{
+		for(i++; argv[i] && n < MAXLINE - 2; i++)	/* Join the words back into one line */
+			n += snprintf(buf + n, MAXLINE - 1 - n, "%s%s", n ? " " : "", argv[i]);
+		if(n >= MAXLINE - 2)				/* (snprintf counts what didn't fit) */
+			{
+			printf("feed: line too long \n");
+			exitstatus = 1;
+			Sigprocmask(SIG_SETMASK, &prev, NULL);
+			return;
+			}
+		if(n > 0 || !eof)
+			{
+			buf[n++] = '\n';
+			if(write(job->feedfd, buf, n) < n)	/* The pipe is non-blocking: never hang the shell */
+				printf("feed: %s \n", errno == EAGAIN ? "pipe full, job is not reading" : strerror(errno));
+			}
+		if(eof)
+			{
+			close(job->feedfd);
+			job->feedfd = -1;
+			}
+		}
+	Sigprocmask(SIG_SETMASK, &prev, NULL);
+	return;
+}
+
+/*
+ * do_agents - Execute the builtin agents command: agents [listen ADDR]
+ *
+ * With listen, accept worker agents (tsh --agent ADDR) on a Unix socket
+ * path or a TCP host:port. Without arguments, list connected agents.
+ */
+void do_agents(char **argv)
+{
+	int i;
+
+	if(argv[1] && !strcmp(argv[1], "listen") && argv[2])
+		{
+		if(agent_lsrc.fd >= 0)
+			{
+			printf("agents: already listening \n");
+			return;
+			}
+		if((agent_lsrc.fd = sock_open(argv[2], 1)) < 0)
+			{
+			printf("agents: %s: %s \n", argv[2], strerror(errno));
+			return;
+			}
+		agent_lsrc.handler = agent_accept;
+		evl_add(&agent_lsrc, EPOLLIN);
+		return;
+		}
+	if(argv[1])
+		{
+		printf("agents: usage: agents [listen ADDR] \n");
+		return;
+		}
+	for(i = 1; i <= MAXAGENTS; i++)
+		if(agents[i])
+			printf("agent %d @%s: %d/%d slots busy \n", i, agents[i]->pool, agents[i]->running, agents[i]->slots);
+	return;
+}
+
+/*
+ * do_kill - Execute the builtin kill command: kill [-SIG] PID|%jobid
+ *
+ * Send a signal (default SIGTERM) to a job's process group. Jobs on an
+ * agent are signaled by their agent.
+ */
+void do_kill(char **argv)
+{
+	static struct { char *name; int sig; } names[] = {
+		{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+		{ "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "TERM", SIGTERM }, { "CONT", SIGCONT },
+		{ "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { NULL, 0 } };
+	struct job_t *job;
+	int i = 1, sig = SIGTERM, k;
+
+	if(argv[i] && argv[i][0] == '-')
+		{
+		if((sig = atoi(argv[i]+1)) <= 0)
+			for(k = 0; names[k].name; k++)
+				if(!strcmp(argv[i]+1, names[k].name) || (!strncmp(argv[i]+1, "SIG", 3) && !strcmp(argv[i]+4, names[k].name)))
+					sig = names[k].sig;
+		if(sig <= 0 || sig >= NSIG)
+			{
+			printf("kill: %s: invalid signal \n", argv[i]);
+			return;
+			}
+		i++;
+		}
+	if(!argv[i])
+		{
+		printf("kill command requires PID or %%jobid argument \n");
+		return;
+		}
+	if((job = getjobarg(jobs, argv[i])) == NULL)
+		{
+		printf("%s: No such job \n", argv[i]);
+		return;
+		}
+	signaljob(job, sig);
+	if(job->state == SL && (sig == SIGSTOP || sig == SIGTSTP))
+		{
+		job->state = ST;				/* The user's stop now: gang lets it be */
+		job->stopsig = sig;
+		}
+	else if(job->state == SL && sig != SIGKILL)
+		{
+		job->state = BG;				/* A stopped job only sees sig once it runs */
+		signaljob(job, SIGCONT);
+		}
+	return;
+}
+
+/*
+ * do_source - Execute the builtin source command: source file
+ *
+ * Run the lines of file in this shell, as if they had been typed, so
+ * that functions and aliases it defines stay defined. Each line is
+ * parsed once; function bodies are kept in their parsed form.
+ */
+void do_source(char **argv)
+{
+	rio_t rio;
+	char line[MAXLINE];
+	ssize_t n;
+	int fd;
+
+	if(!argv[1])
+		{
+		printf("source: file name argument required \n");
+		return;
+		}
+	if(depth >= MAXDEPTH)
+		{
+		printf("source: maximum nesting depth exceeded \n");
+		return;
+		}
+	if((fd = open(argv[1], O_RDONLY|O_CLOEXEC)) < 0)
+		{
+		printf("source: %s: %s \n", argv[1], strerror(errno));
+		return;
+		}
+	depth++;
+	rio_readinitb(&rio, fd);
+	while((n = rio_readlineb(&rio, line, MAXLINE - 1)) > 0)
+		{
+		if(line[n-1] != '\n')
+			strcpy(line + n, "\n");
+		eval(line);
+		}
+	if(pending[0])						/* A group or quote was never closed */
+		{
+		printf("source: %s: unexpected end of file \n", argv[1]);
+		pending[0] = '\0';
+		}
+	close(fd);
+	depth--;
+}
+
+/*
+ * do_read - Execute the builtin read command: read [-u fd] [name ...]
+ *
+ * Read a line and split it at blanks into the named variables, the
+ * last one getting the rest of the line (REPLY if none are named).
+ * Lines come from the same Rio buffer the shell reads its commands
+ * from (or one kept per fd for -u), a block at a time, never a byte at
+ * a time. A line longer than MAXLINE is read whole into a bigger buffer.
+ * Sets $? to 1 at end of file.
+ */
+void do_read(char **argv)
+{
+	char *line, *p, *w;
+	char *reply[] = { "REPLY", NULL };
+	rio_t *rp = &rio_stdin;
+	size_t size = MAXLINE, len = 0;
+	ssize_t n;
+	int fd;
+
+	argv++;
+	if(*argv && !strcmp(*argv, "-u"))
+		{
+		if(!argv[1] || (fd = atoi(argv[1])) < 0 || fd >= RIO_MAXFD || (fd == 0 && strcmp(argv[1], "0")))
+			{
+			printf("read: -u requires a file descriptor \n");
+			exitstatus = 2;
+			return;
+			}
+		if(fd != STDIN_FILENO && rio_fds[fd] == NULL)
+			{
+			if((rio_fds[fd] = malloc(sizeof(rio_t))) == NULL)
+				unix_error("malloc error");
+			rio_readinitb(rio_fds[fd], fd);
+			}
+		if(fd != STDIN_FILENO)
+			rp = rio_fds[fd];
+		argv += 2;
+		}
+	if(!*argv)
+		argv = reply;
+	if((line = malloc(size)) == NULL)
+		unix_error("malloc error");
+	while((n = rio_readlineb(rp, line + len, size - len)) > 0)
+		{
+		len += n;
+		if(line[len-1] == '\n' || len < size - 1)	/* The whole line, or end of file */
+			break;
+		size *= 2;					/* Full: the line goes on */
+		if((line = realloc(line, size)) == NULL)
+			unix_error("realloc error");
+		}
+	if(len == 0)
+		{
+		free(line);
+		exitstatus = 1;					/* End of file (or an error) */
+		return;
+		}
+	if(line[len-1] == '\n')
+		line[--len] = '\0';
+	for(p = line; *argv; argv++)
+		{
+		p += strspn(p, " \t");
+		w = p;
+		if(argv[1])					/* Not the last name: one word */
+			{
+			p += strcspn(p, " \t");
+			if(*p)
+				*p++ = '\0';
+			}
+		else						/* The rest, less trailing blanks */
+			for(n = strlen(w); n > 0 && (w[n-1] == ' ' || w[n-1] == '\t'); n--)
+				w[n-1] = '\0';
+		var_set(*argv, w, strlen(*argv));
+		}
+	free(line);
+}
+
+/*
+ * do_print - Execute the builtin print command: print [-n] [-u fd] [word ...]
+ *
+ * Write the words and a newline (not with -n) to fd, stdout by default,
+ * without starting a process: the way to talk to a coprocess. A reader
+ * that has gone away sets $? to 1 rather than killing the shell.
+ */
+void do_print(char **argv)
+{
+	char buf[MAXLINE], *p = buf, *end = buf + MAXLINE - 1;
+	int fd = STDOUT_FILENO, nl = 1;
+	struct timespec zero = { 0, 0 };
+	sigset_t mask, prev;
+	ssize_t n, k;
+
+	for(argv++; *argv && argv[0][0] == '-'; argv++)
+		{
+		if(!strcmp(*argv, "-n"))
+			nl = 0;
+		else if(!strcmp(*argv, "-u") && argv[1])
+			fd = atoi(*++argv);
+		else
+			break;
+		}
+	for(; *argv && p < end; argv++)
+		{
+		p += snprintf(p, end - p, "%s%s", *argv, argv[1] ? " " : "");
+		if(p > end)
+			p = end;
+		}
+	if(nl)
+		*p++ = '\n';
+	if(fd == STDOUT_FILENO)
+		{
+		fwrite(buf, 1, p - buf, stdout);
+		return;
+		}
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGPIPE);
+	Sigprocmask(SIG_BLOCK, &mask, &prev);			/* EPIPE, not death */
+	for(n = 0; buf + n < p; n += k)
+		if((k = write(fd, buf + n, p - buf - n)) < 0)
+			{
+			k = 0;
+			if(errno == EINTR)
+				continue;
+			printf("print: %d: %s \n", fd, strerror(errno));
+			exitstatus = 1;
+			if(errno == EPIPE)
+				sigtimedwait(&mask, NULL, &zero);	/* (drop the pending SIGPIPE) */
+			break;
+			}
+	Sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * do_coproc - Execute the builtin coproc command:
+ *    coproc [NAME] command [args]  |  coproc -c NAME  |  coproc
+ *
+ * Start command as a background job with its stdin and stdout on pipes
+ * to the shell. $NAME_0 is the fd that reads its output (read -u) and
+ * $NAME_1 the one that writes to it (print -u, or >&fd on a command);
+ * $NAME_PID is its pid. NAME defaults to COPROC. The job is in jobs[]
+ * like any other, so fg, bg and kill work on it. coproc -c NAME closes
+ * the pipe to its stdin, so it sees end of file; with no arguments the
+ * coprocesses are listed.
+ */
+void do_coproc(char **argv)
+{
+	char *name = "COPROC", *args[MAXARGS], redir[2][16], cmdline[MAXLINE], var[48], num[16];
+	struct coproc_t *cp = NULL;
+	int to[2], from[2], i, len;
+	pid_t pid;
+
+	argv++;
+	coproc_reap();						/* (frees the slots of finished ones) */
+	if(!*argv)						/* List them */
+		{
+		for(i = 0; i < MAXCOPROCS; i++)
+			if(coprocs[i].pid)
+				printf("%s (%d) read %d write %d \n", coprocs[i].name, coprocs[i].pid, coprocs[i].rfd, coprocs[i].wfd);
+		return;
+		}
+	if(!strcmp(*argv, "-c"))				/* Close its stdin */
+		{
+		for(i = 0; i < MAXCOPROCS && (!argv[1] || strcmp(coprocs[i].name, argv[1])); i++)
+			;
+		if(i == MAXCOPROCS || coprocs[i].wfd < 0)
+			{
+			printf("coproc: %s: no such coprocess \n", argv[1] ? argv[1] : "");
+			exitstatus = 1;
+			return;
+			}
+		close(coprocs[i].wfd);
+		coprocs[i].wfd = -1;
+		snprintf(var, sizeof(var), "%s_1", coprocs[i].name);
+		var_unset(var);
+		return;
+		}
+	if(argv[1] && strspn(*argv, NAMECHARS) == strlen(*argv) && !isdigit((unsigned char)**argv))
+		name = *argv++;					/* (commands are paths, names aren't) */
+	if(strlen(name) >= sizeof(cp->name))
+		{
+		printf("coproc: %s: name too long \n", name);
+		exitstatus = 2;
+		return;
+		}
+	for(i = 0; i < MAXCOPROCS && !cp; i++)			/* NAME again replaces the old one */
+		if(!strcmp(coprocs[i].name, name))
+			cp = &coprocs[i];
+	for(i = 0; i < MAXCOPROCS && !cp; i++)
+		if(!coprocs[i].pid)
+			cp = &coprocs[i];
+	if(cp == NULL)
+		{
+		printf("coproc: too many coprocesses \n");
+		exitstatus = 1;
+		return;
+		}
+	if(cp->pid)
+		coproc_close(cp);
+	if(pipe2(to, O_CLOEXEC) < 0 || pipe2(from, O_CLOEXEC) < 0)
+		unix_error("pipe error");
+	len = snprintf(cmdline, MAXLINE - 1, "coproc %s", name);
+	for(i = 0; argv[i] && i < MAXARGS - 3; i++)
+		{
+		args[i] = argv[i];
+		if(len < MAXLINE - 1)
+			len += snprintf(cmdline + len, MAXLINE - 1 - len, " %s", argv[i]);
+		}
+	strcpy(cmdline + (len < MAXLINE - 1 ? len : MAXLINE - 2), "\n");
+	snprintf(redir[0], sizeof(redir[0]), "<&%d", to[0]);	/* (done by exec_cmd in the child) */
+	snprintf(redir[1], sizeof(redir[1]), ">&%d", from[1]);
+	args[i++] = redir[0];
+	args[i++] = redir[1];
+	args[i] = NULL;
+	pid = launch(args, NULL, 1, cmdline, 0, NULL);
+	close(to[0]);
+	close(from[1]);
+	snprintf(cp->name, sizeof(cp->name), "%s", name);
+	cp->pid = pid;
+	cp->rfd = from[0];
+	cp->wfd = to[1];
+	snprintf(var, sizeof(var), "%s_0", name);
+	snprintf(num, sizeof(num), "%d", cp->rfd);
+	var_set(var, num, strlen(var));
+	snprintf(var, sizeof(var), "%s_1", name);
+	snprintf(num, sizeof(num), "%d", cp->wfd);
+	var_set(var, num, strlen(var));
+	snprintf(var, sizeof(var), "%s_PID", name);
+	snprintf(num, sizeof(num), "%d", pid);
+	var_set(var, num, strlen(var));
+}
+
+/*
+ * do_hash - Execute the builtin hash command: hash [-r]
+ *
+ * List the programs in the exec cache, most recently launched first,
+ * with how many launches went through the open fd; -r empties it.
+ */
+void do_hash(char **argv)
+{
+	struct exec_t *order[EXECCACHE];
+	int i, j, n = 0;
+
+	if(argv[1] && !strcmp(argv[1], "-r"))
+		{
+		exec_flush();
+		return;
+		}
+	for(i = 0; i < EXECCACHE; i++)				/* (insertion sort by last use) */
+		if(execs[i].fd >= 0)
+			{
+			for(j = n++; j > 0 && order[j-1]->used < execs[i].used; j--)
+				order[j] = order[j-1];
+			order[j] = &execs[i];
+			}
+	if(n)
+		printf("hits\tcommand \n");
+	for(i = 0; i < n; i++)
+		printf("%4d\t%s \n", order[i]->hits, order[i]->path);
+}
+
+/* coproc_close - Close the shell's ends of a coprocess's pipes and free its slot */
+void coproc_close(struct coproc_t *cp)
+{
+	close(cp->rfd);
+	if(cp->rfd < RIO_MAXFD && rio_fds[cp->rfd])		/* (read -u's buffer for it) */
+		{
+		free(rio_fds[cp->rfd]);
+		rio_fds[cp->rfd] = NULL;
+		}
+	if(cp->wfd >= 0)
+		close(cp->wfd);
+	memset(cp, 0, sizeof(*cp));
+}
+
+/*
+ * coproc_reap - Free the slots of coprocesses that are no longer in jobs[],
+ *    closing their pipes and unsetting $NAME_0, $NAME_1 and $NAME_PID.
+ *    Called outside the handler, since var_unset isn't async-signal-safe.
+ */
+void coproc_reap(void)
+{
+    static const char *suffix[] = { "_0", "_1", "_PID" };
+    char var[48];
+    int i, j;
+
+    for (i = 0; i < MAXCOPROCS; i++) {
+	if (!coprocs[i].pid || getjobpid(jobs, coprocs[i].pid))
+	    continue;
+	for (j = 0; j < 3; j++) {
+	    snprintf(var, sizeof(var), "%.*s%s", (int)sizeof(coprocs[i].name) - 1, coprocs[i].name, suffix[j]);
+	    var_unset(var);
+	}
+	coproc_close(&coprocs[i]);
+    }
+}
+
+/*
+ * do_ulimit - Execute the builtin ulimit command:
+ *    ulimit [-S|-H] [-a | -c|-d|-f|-n|-s|-t|-u|-v [value|unlimited]]
+ *
+ * Shows or sets the shell's own limits, which every job inherits. Sizes
+ * are in kbytes unless they have a K, M or G suffix. Without -S or -H
+ * both the soft and the hard limit are set, and the soft one is shown.
+ */
+void do_ulimit(char **argv)
+{
+	struct rlimname_t *r = NULL;
+	struct rlimit rl;
+	rlim_t val, cur;
+	int hard = 0, soft = 0, all = 0;
+	char *o;
+
+	for(argv++; *argv && argv[0][0] == '-' && argv[0][1]; argv++)
+		for(o = *argv + 1; *o; o++)			/* (options may be run together: -Hn) */
+			{
+			if(*o == 'H')
+				hard = 1;
+			else if(*o == 'S')
+				soft = 1;
+			else if(*o == 'a')
+				all = 1;
+			else if((r = rlim_find(*o, NULL)) == NULL)
+				{
+				printf("ulimit: -%c: invalid option \n", *o);
+				exitstatus = 2;
+				return;
+				}
+			}
+	if(all)							/* Show them all */
+		{
+		for(r = rlimnames; r->opt; r++)
+			{
+			getrlimit(r->res, &rl);
+			cur = hard ? rl.rlim_max : rl.rlim_cur;
+			if(cur == RLIM_INFINITY)
+				printf("%-28s(-%c) unlimited\n", r->desc, r->opt);
+			else
+				printf("%-28s(-%c) %llu\n", r->desc, r->opt, (unsigned long long)cur / r->unit);
+			}
+		return;
+		}
+	if(r == NULL)
+		r = rlim_find('f', NULL);				/* As in sh: file size by default */
+	getrlimit(r->res, &rl);
+	if(!*argv)						/* Show one */
+		{
+		cur = hard ? rl.rlim_max : rl.rlim_cur;
+		if(cur == RLIM_INFINITY)
+			printf("unlimited\n");
+		else
+			printf("%llu\n", (unsigned long long)cur / r->unit);
+		return;
+		}
+	if(rlim_value(r, *argv, 1, &val) < 0)
+		{
+		printf("ulimit: %s: invalid limit \n", *argv);
+		exitstatus = 2;
+		return;
+		}
+	if(hard || !soft)
+		rl.rlim_max = val;
+	if(soft || !hard)
+		rl.rlim_cur = val;
+	if(setrlimit(r->res, &rl) < 0)
+		{
+		printf("ulimit: %s: %s \n", r->desc, strerror(errno));
+		exitstatus = 1;
+		}
+}
+
+/*
+ * do_alias - Execute the builtin alias command: alias [name[=value]]
+ *
+ * The value is parsed when the alias is defined. An alias for a simple
+ * command has its words put in front of the arguments; an alias for a
+ * list or group is run like a function.
+ */
+void do_alias(char **argv)
+{
+	char name[MAXLINE], value[MAXLINE], *eq;
+	struct cmd_t *body;
+	struct func_t *a;
+	int i;
+
+	if(!argv[1])						/* List them all */
+		{
+		for(i = 0; i < FUNCTAB; i++)
+			for(a = aliases[i]; a; a = a->next)
+				printf("alias %s='%s' \n", a->name, a->value);
+		return;
+		}
+	if((eq = strchr(argv[1], '=')) == NULL)
+		{
+		if((a = func_find(aliases, argv[1])) != NULL)
+			printf("alias %s='%s' \n", a->name, a->value);
+		else
+			printf("alias: %s: not found \n", argv[1]);
+		return;
+		}
+	snprintf(name, sizeof(name), "%.*s", (int)(eq++ - argv[1]), argv[1]);
+	value[0] = '\0';					/* Rejoin words split by parseline */
+	for(i = 1; argv[i]; i++)
+		{
+		strncat(value, i == 1 ? eq : argv[i], MAXLINE - strlen(value) - 3);
+		strcat(value, argv[i+1] ? " " : "");
+		}
+	if(value[0] == '\'' && value[strlen(value)-1] == '\'')
+		{
+		value[strlen(value)-1] = '\0';
+		memmove(value, value + 1, strlen(value));
+		}
+	strcat(value, "\n");
+	if(!name[0] || (body = parse_list(value)) == NULL)
+		{
+		printf("alias: %s: invalid value \n", name);
+		return;
+		}
+	value[strlen(value)-1] = '\0';
+	a = func_define(aliases, name, body);
+	if((a->value = strdup(value)) == NULL)
+		unix_error("strdup error");
+}
+
+/*
+ * do_disown - Execute the builtin disown command: disown [PID|%jobid]
+ *
+ * Remove a job from the job list: it is no longer listed, waited for or
+ * signaled by the shell. Its pid goes into a side table so that the
+ * reaper can still say what it was. Without an argument, list the
+ * disowned processes that are still running.
+ */
+void do_disown(char **argv)
+{
+	struct job_t *job;
+	sigset_t mask, prev;
+	int i;
+
+	if(!argv[1])
+		{
+		for(i = 0; i < DISOWNTAB; i++)
+			if(disowned[i].pid)
+				printf("(%d) %s \n", disowned[i].pid, disowned[i].cmd);
+		return;
+		}
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGCHLD);
+	Sigprocmask(SIG_BLOCK, &mask, &prev);			/* The reaper uses both tables */
+	if((job = getjobarg(jobs, argv[1])) == NULL)
+		printf("%s: No such job \n", argv[1]);
+	else if(job->agent)
+		printf("%s: job runs on an agent and cannot be disowned \n", argv[1]);
+	else
+		{
+		if(job->cap)
+			job->cap->jid = 0;				/* Its output keeps draining, labeled by pid */
+		disown_add(job->pid, job->cmdline);
+		deletejob(jobs, job->pid);
+		}
+	Sigprocmask(SIG_SETMASK, &prev, NULL);
+	return;
+}
+
+/* 
+ * reap_untracked - Account for a reaped child that is not in jobs[]:
+ *    a disowned job, or (with -r) an orphan reparented to the shell.
+ */
+void reap_untracked(pid_t pid, int status)
+{
+	struct disown_t *d;
+
+	if(WIFSTOPPED(status))					/* Not ours to manage */
+		return;
+	if((d = disown_find(pid)) != NULL)
+		{
+		if(verbose)
+			printf("sigchld_handler: disowned (%d) %s %s %d \n", pid, d->cmd,
+			       WIFSIGNALED(status) ? "terminated by signal" : "exited with status",
+			       WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+		disown_remove(d);
+		}
+	else if(verbose)
+		printf("sigchld_handler: orphan (%d) reaped \n", pid);
+}
+
+/* 
+ * bgstdin_open - Create the stdin pipe of a background job. Returns the
+ *    read end for the child and stores the shell's write end in *feedfd.
+ */
+int bgstdin_open(int *feedfd)
+{
+	int fds[2];
+
+	if(pipe2(fds, O_CLOEXEC) < 0)
+		return -1;
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	*feedfd = fds[1];
+	return fds[0];
+}
+
+/* 
+ * bgstdin_child - In a background child, replace the terminal stdin as
+ *    the bgstdin policy says. infd is the pipe from bgstdin_open.
+ */
+void bgstdin_child(int infd)
+{
+	int fd;
+
+	if(infd >= 0)
+		{
+		dup2(infd, STDIN_FILENO);
+		return;
+		}
+	if(bgstdin == IN_TTY)
+		return;
+	if((fd = open(bgstdin == IN_FILE ? bgstdin_path : "/dev/null", O_RDONLY)) < 0)
+		{
+		printf("%s: %s \n", bgstdin_path, strerror(errno));
+		exit(1);
+		}
+	dup2(fd, STDIN_FILENO);
+	close(fd);
+}
+
+/* 
+ * tty_init - If the shell runs on a terminal, wait until it is in the
+ *    foreground, put it in its own process group and take the terminal.
+ *    Foreground jobs then get the terminal while they run, so ctrl-c and
+ *    ctrl-z reach them straight from the kernel.
+ */
+void tty_init(void)
+{
+	pid_t pgid;
+
+	if(!isatty(STDIN_FILENO))
+		return;
+	while(tcgetpgrp(STDIN_FILENO) != (pgid = getpgrp()))
+		kill(-pgid, SIGTTIN);				/* Started in the background: stop until fg */
+	setpgid(0, 0);						/* (fails harmlessly for a session leader) */
+	shell_pgid = getpgrp();
+	if((ttyfd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10)) < 0)
+		return;
+	tty_handoff(shell_pgid);
+	tcgetattr(ttyfd, &shell_tmodes);
+}
+
+/* tty_owner - True in the shell itself (not a subshell) when it has a terminal */
+int tty_owner(void)
+{
+	return ttyfd >= 0 && getpgrp() == shell_pgid;
+}
+
+/* 
+ * tty_handoff - Make pgid the terminal's foreground process group.
+ *    SIGTTOU is blocked, since the caller may be in the background.
+ */
+void tty_handoff(pid_t pgid)
+{
+	sigset_t mask, prev;
+
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGTTOU);
+	Sigprocmask(SIG_BLOCK, &mask, &prev);
+	tcsetpgrp(ttyfd, pgid);
+	Sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* tty_give - Hand the terminal to a job about to run in the foreground */
+void tty_give(struct job_t *job)
+{
+	if(!tty_owner() || job == NULL || job->agent)		/* (a remote job has no group here) */
+		return;
+	if(job->tmodes_saved)
+		tcsetattr(ttyfd, TCSADRAIN, &job->tmodes);	/* As it left them when it stopped */
+	tty_handoff(job->pid);
+}
+
+/* 
+ * tty_take - Take the terminal back after a foreground job stopped
+ *    (job, whose modes are saved for fg) or ended (NULL)
+ */
+void tty_take(struct job_t *job)
+{
+	if(!tty_owner())
+		return;
+	if(job && job->state == ST && tcgetattr(ttyfd, &job->tmodes) == 0)
+		job->tmodes_saved = 1;
+	tty_handoff(shell_pgid);
+	tcsetattr(ttyfd, TCSADRAIN, &shell_tmodes);
+}
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process
+ */
+void waitfg(pid_t pid)
+{
+	struct job_t *jid;
+	sigset_t mask, prev;
+	jid = getjobpid(jobs, pid);      			/* Get job struct from PID */ 
+
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGCHLD);
+	Sigprocmask(SIG_BLOCK, &mask, &prev);			/* Test and wait atomically w.r.t. SIGCHLD */
+								/* Run a loop while there is still a fg process 
+								 * and the fg process is not in ST joblist state */
+	while(fgpid(jobs) && jid->state != ST) 			
+		{
+		evl_wait(-1, &prev);				/* Sleep until a signal, draining bg output */
+		} 
+	tty_take(getjobpid(jobs, pid));				/* Stopped or gone: the terminal is ours again */
+	Sigprocmask(SIG_SETMASK, &prev, NULL);
+	if(verbose)
+		{
+		printf("waitfg: process (%d) is no longer the foreground process \n", pid); 
+		}
+  return;
+}
+
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/*
+ * child_status - Update the job list for a child that was reaped or
+ *     stopped with the given wait status
+ */
+void child_status(pid_t pid, int status)
+{
+	int jobid;
+
+	jobid = pid2jid(pid);      			/* Get the job ID from the PID */
+	if(jobid == 0)					/* Disowned or orphaned: not a job */
+		{
+		reap_untracked(pid, status);
+		return;
+		}
+	if(getjobpid(jobs, pid)->state == FG)
+		fgstatus = status;			/* Lists stop after a ctrl-c */
+	if(getjobpid(jobs, pid)->batch == REPEAT_JOB && !WIFSTOPPED(status) && replat && repdone < repmax)
+		replat[repdone++] = now_ns() - getjobpid(jobs, pid)->t0;
+	if(getjobpid(jobs, pid)->batch && !WIFSTOPPED(status) && aimd.on)
+		aimd_done(now_ns() - getjobpid(jobs, pid)->t0);	/* Feed -j auto */
+	if(getjobpid(jobs, pid)->deadline && !WIFSTOPPED(status) && now_ns() > getjobpid(jobs, pid)->deadline)
+		deadmiss++;
+	if(WIFSTOPPED(status) && WSTOPSIG(status) == SIGSTOP && getjobpid(jobs, pid)->state == SL)
+		return;					/* gang stopped it between time slices */
+							/* If the child is stopped */ 
+	if(WIFSTOPPED(status)) 				/* Returns true if the child that caused the return is stopped */
+		{
+		getjobpid(jobs, pid)->state = ST;  	/* Adjust the state of that job to stopped */ 
+		getjobpid(jobs, pid)->stopsig = WSTOPSIG(status); /* SIGTTIN: waiting for terminal input */
+		printf("Job [%d] (%d) stopped by signal %d \n", jobid, pid, WSTOPSIG(status));
+		}
+							/* If the process was terminated by a signal */ 
+	if(!WIFSTOPPED(status) && getjobpid(jobs, pid)->pstat)
+		{
+		printf("Job [%d] (%d) pipeline: \n", jobid, pid);
+		pstat_print(getjobpid(jobs, pid)->pstat);
+		}
+	if(WIFSIGNALED(status)) 			/* Return true if the child process terminated because of a
+							 * signal that was not caught */
+		{
+							/* Delete the job */ 
+		deletejob(jobs,pid); 
+		if(verbose) 
+			printf("sigchld_handler: Job [%d] (%d) deleted \n", jobid, pid );
+			printf("Job [%d] (%d) terminated by signal %d \n", jobid, pid, WTERMSIG(status));
+		}
+	if(WIFEXITED(status))				/* Returns true if child terminates normally */ 		
+		{
+		deletejob(jobs,pid); 
+		if(verbose) 
+			{
+			printf("sigchld_handler: Job [%d] (%d) deleted \n", jobid, pid );
+			printf("sigchld_handler: Job [%d] (%d) terminated okay (status 0) \n", jobid, pid );
+			}
+		}
+}
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
+ *     available zombie children, but doesn't wait for any other
+ *     currently running children to terminate.  
+ */
+void sigchld_handler(int sig) 
+{
+	pid_t pid; 
+	int status; 
+
+	if(ring.fd >= 0)					/* io_uring: the ring's waits reap instead */
+		return;
+	if(verbose)
+		{ 
+		printf("sigchld_handler: entering \n"); 
+		}
+								/* While there are un-reaped children:
+		 						 * WNOHANG: Don't block waiting
+		 						 * WUNTRACED: Report status of stopped children */ 
+	while((pid = waitpid(-1, &status, WNOHANG|WUNTRACED)) > 0)
+  		{
+		child_status(pid, status);
+		}
+								/* Allow ECHILD and EINTR errors */ 
+								/* i.e., if the calling process has not children (ECHILD),
+								 * or waitpid was interrupted (EINTR) */
+	if(pid < 0 && ECHILD != errno && EINTR != errno) 
+		{
+		unix_error("waitpid error");
+		} 
+	if(verbose) 
+		{
+		printf("sigchld_handler: exiting \n"); 	
+		}				
+	return;
+}
+
+/* 
+ * sigint_handler - The kernel sends a SIGINT to the shell whenver the
+ *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    to the foreground job.  
+ */
+void sigint_handler(int sig) 
+{
+								/* Search jobs for fg process */
+	if(verbose)
+		{ 
+		printf("sigint_handler: entering \n");
+		}
+	pid_t pid = fgpid(jobs);
+	int jobid = pid2jid(pid);
+								/* Send SIGINT to fg porcess. */ 
+	 							/* Negative PID kills the entire process group */
+	if(pid == 0)
+		intrpending = 1;				/* No fg job: just note it (for repeat) */
+	else if(getjobpid(jobs, pid)->agent)
+		signaljob(getjobpid(jobs, pid), sig);		/* Remote job: its agent delivers it */
+	else
+		Kill(-pid, sig);
+	if(verbose)
+		{ 
+		printf("sigint_handler: Job [%d] (%d) killed \n",jobid, pid);
+		}
+	if(verbose)
+		{ 
+		printf("sigint_handler: exiting \n");
+		}
+  	return;
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     the user types ctrl-z at the keyboard. Catch it and suspend the
+ *     foreground job by sending it a SIGTSTP.  
+ */
+void sigtstp_handler(int sig) 
+{
+								/* Search jobs for fg process */
+	if(verbose) 
+		{
+		printf("sigtstp_handler: entering \n");
+		}
+	pid_t pid = fgpid(jobs);
+	int jobid = pid2jid(pid);
+								/* Send SIGINT to fg porcess. */ 
+	 							/* Negative PID kills the entire process group */
+	if(pid && getjobpid(jobs, pid)->agent)
+		signaljob(getjobpid(jobs, pid), SIGTSTP);	/* Remote job: its agent delivers it */
+	else
+		Kill(-pid, SIGTSTP);   
+	if(verbose) 
+		{
+		printf("sigtstp_handler: Job [%d] (%d) stopped \n",jobid, pid);
+		}
+	if(verbose) 
+		{
+		printf("sigtstp_handler: exiting \n");
+		}
+  	return;
+}
+
+/*********************
+ * End signal handlers
+ *********************/
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/* clearjob - Clear the entries in a job struct */
+void clearjob(struct job_t *job) {
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    job->cmdline[0] = '\0';
+    job->batch = 0;
+    job->cap = NULL;
+    job->stopsig = 0;
+    job->feedfd = -1;
+    job->agent = 0;
+    job->rid = 0;
+    job->rpid = 0;
+    job->t0 = 0;
+    job->pstat = NULL;
+    job->tmodes_saved = 0;
+    job->deadline = 0;
+    job->sliced = 0;
+    job->cpus = 0;
+    job->mem = 0;
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(struct job_t *jobs) {
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+	clearjob(&jobs[i]);
+}
+
+/* maxjid - Returns largest allocated job ID */
+int maxjid(struct job_t *jobs) 
+{
+    int i, max=0;
+
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].jid > max)
+	    max = jobs[i].jid;
+    return max;
+}
+
+/* addjob - Add a job to the job list */
+int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
+{
+    int i;
+    
+    if (pid < 1)
+	return 0;
+
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].pid == 0) {
+	    jobs[i].pid = pid;
+	    jobs[i].state = state;
+	    jobs[i].jid = nextjid++;
+	    if (nextjid > MAXJOBS)
+		nextjid = 1;
+	    strcpy(jobs[i].cmdline, cmdline);
+  	    if(verbose){
+	        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
+            }
+            return 1;
+	}
+    }
+    printf("Tried to create too many jobs\n");
+    return 0;
+}
+
+/* deletejob - Delete a job whose PID=pid from the job list */
+int deletejob(struct job_t *jobs, pid_t pid) 
+{
+    int i;
+
+    if (pid < 1)
+	return 0;
+
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].pid == pid) {
+	    if (jobs[i].feedfd >= 0)
+		close(jobs[i].feedfd);
+	    if (jobs[i].pstat)
+		munmap(jobs[i].pstat, sizeof(struct pstat_t));
+	    clearjob(&jobs[i]);
+	    nextjid = maxjid(jobs)+1;
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/* numjobs - Return the number of jobs in the job list */
+int numjobs(struct job_t *jobs)
+{
+    int i, n = 0;
+
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].pid != 0)
+	    n++;
+    return n;
+}
+
+/* batchjobs - Return the number of jobs started by the batch builtin */
+int batchjobs(struct job_t *jobs)
+{
+    int i, n = 0;
+
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].pid != 0 && jobs[i].batch)
+	    n++;
+    return n;
+}
+
+/* aimd_start - Start pacing a batch or repeat run, at most max at a time */
+void aimd_start(int max)
+{
+    memset(&aimd, 0, sizeof(aimd));
+    aimd.limit = aimd.lo = aimd.hi = 1;
+    aimd.max = max;
+    aimd.slow = 1;
+    aimd.wstart = now_ns();
+    aimd.on = 1;
+}
+
+/*
+ * aimd_done - Count one batch or repeat completion with the given
+ *    latency (launch request to reap), and once a window of them is
+ *    in, move the limit: add while throughput still rises or latency
+ *    holds, cut by a quarter when latency degrades without a gain.
+ *    Until the first cut the limit doubles instead (slow start), so
+ *    long jobs don't take a window per step. Runs in child_status.
+ */
+void aimd_done(long long lat)
+{
+    long long now;
+    double tput, mean;
+    int degraded, rising;
+
+    aimd.wdone++;
+    aimd.wlat += lat;
+    if (aimd.wdone < aimd.limit || aimd.wdone < AIMD_MINWIN)
+	return;
+
+    now = now_ns();
+    tput = aimd.wdone / ((now - aimd.wstart + 1) / 1e9);
+    mean = (double)aimd.wlat / aimd.wdone;
+    degraded = aimd.nwin > 0 && mean > aimd.base * AIMD_TOL;
+    rising = aimd.nwin == 0 || tput > aimd.tput * 1.10;
+
+    if (degraded && !rising) {
+	aimd.limit -= (aimd.limit >= 4) ? aimd.limit / 4 : 1;
+	if (aimd.limit < 1)
+	    aimd.limit = 1;
+	aimd.slow = 0;
+    }
+    else
+	aimd.limit += aimd.slow ? aimd.limit : 1;
+    if (aimd.limit > aimd.max)
+	aimd.limit = aimd.max;
+
+    if (aimd.nwin == 0 || mean < aimd.base)	/* fastest yet, or drift up slowly */
+	aimd.base = mean;
+    else
+	aimd.base += (mean - aimd.base) / AIMD_DRIFT;
+    aimd.tput = tput;
+    aimd.lat = mean;
+    aimd.hist[aimd.nwin++ % AIMD_HIST] = aimd.limit;
+    if (aimd.limit < aimd.lo)
+	aimd.lo = aimd.limit;
+    if (aimd.limit > aimd.hi)
+	aimd.hi = aimd.limit;
+    aimd.wstart = now;
+    aimd.wdone = 0;
+    aimd.wlat = 0;
+}
+
+/* aimd_print - Print the -j auto limit, with its recent history, for jobs */
+void aimd_print(void)
+{
+    int i;
+
+    printf("%s -j auto: %d at a time (%d to %d over %d windows), %.1f jobs/s, %.3f ms mean latency\n",
+	   aimd.on ? "running" : "last run", aimd.limit, aimd.lo, aimd.hi, aimd.nwin,
+	   aimd.tput, aimd.lat / 1e6);
+    printf("    limit history:");
+    for (i = aimd.nwin > AIMD_HIST ? aimd.nwin - AIMD_HIST : 0; i < aimd.nwin; i++)
+	printf(" %d", aimd.hist[i % AIMD_HIST]);
+    printf("\n");
+}
+
+/*
+ * tag_find - Return the index in tags[] of the named tag, adding it
+ *    (weight 1) if add is set. -1 if it is not there or tags[] is full.
+ */
+int tag_find(const char *name, int add)
+{
+    int i;
+
+    for (i = 0; i < ntags; i++)
+	if (!strcmp(tags[i].name, name))
+	    return i;
+    if (!add || ntags == MAXTAGS)
+	return -1;
+    snprintf(tags[ntags].name, TAGLEN, "%s", name);
+    tags[ntags].weight = 1;
+    tags[ntags].vfinish = 0;
+    return ntags++;
+}
+
+/*
+ * pend_parse - Take the leading prio=, deadline= and tag= words off a
+ *    batch line into e (deadlines are seconds after start). Return the
+ *    rest of the line, or NULL if a value is bad.
+ */
+char *pend_parse(char *line, struct pend_t *e, long long start)
+{
+    char *p = line, *end, name[TAGLEN];
+    size_t len;
+    double secs;
+
+    e->prio = 0;
+    e->deadline = LLONG_MAX;
+    e->tag = 0;
+    for (;;) {
+	p += strspn(p, " \t");
+	len = strcspn(p, " \t\n");
+	if (!strncmp(p, "prio=", 5)) {
+	    e->prio = strtol(p + 5, &end, 10);
+	    if (end != p + len || len == 5)
+		return NULL;
+	}
+	else if (!strncmp(p, "deadline=", 9)) {
+	    secs = strtod(p + 9, &end);
+	    if (end != p + len || len == 9 || secs < 0)
+		return NULL;
+	    e->deadline = start + (long long)(secs * 1e9);
+	}
+	else if (!strncmp(p, "tag=", 4)) {
+	    if (len == 4 || len - 4 >= TAGLEN)
+		return NULL;
+	    memcpy(name, p + 4, len - 4);
+	    name[len - 4] = '\0';
+	    if ((e->tag = tag_find(name, 1)) < 0)
+		return NULL;
+	}
+	else
+	    return p;
+	p += len;
+    }
+}
+
+/* pend_before - Return true if a should leave the pending queue before b */
+static int pend_before(struct pend_t *a, struct pend_t *b)
+{
+    if (a->prio != b->prio)
+	return a->prio > b->prio;
+    if (a->deadline != b->deadline)
+	return a->deadline < b->deadline;
+    if (a->vfinish != b->vfinish)
+	return a->vfinish < b->vfinish;
+    return a->seq < b->seq;
+}
+
+/* pq_push - Add a line to the pending queue, O(log n) */
+void pq_push(struct pq_t *q, struct pend_t *e)
+{
+    int i, parent;
+
+    if (q->n == q->size) {
+	q->size = q->size ? 2 * q->size : 64;
+	if ((q->v = realloc(q->v, q->size * sizeof(struct pend_t))) == NULL)
+	    unix_error("realloc error");
+    }
+    for (i = q->n++; i > 0; i = parent) {	/* sift up */
+	parent = (i - 1) / 2;
+	if (!pend_before(e, &q->v[parent]))
+	    break;
+	q->v[i] = q->v[parent];
+    }
+    q->v[i] = *e;
+}
+
+/* pq_pop - Take the first line off a non-empty pending queue, O(log n) */
+void pq_pop(struct pq_t *q, struct pend_t *e)
+{
+    struct pend_t last;
+    int i, child;
+
+    *e = q->v[0];
+    last = q->v[--q->n];
+    for (i = 0; (child = 2 * i + 1) < q->n; i = child) {	/* sift down */
+	if (child + 1 < q->n && pend_before(&q->v[child + 1], &q->v[child]))
+	    child++;
+	if (!pend_before(&q->v[child], &last))
+	    break;
+	q->v[i] = q->v[child];
+    }
+    q->v[i] = last;
+}
+
+/* cmp_sliced - qsort comparison of jobs by when they last ran */
+static int cmp_sliced(const void *a, const void *b)
+{
+    long long x = (*(struct job_t **)a)->sliced, y = (*(struct job_t **)b)->sliced;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * gang_slice - The work of gang_tick, with SIGCHLD blocked so that no
+ *    job in run[] is deleted under it
+ */
+static void gang_slice(void)
+{
+    struct job_t *run[MAXJOBS];
+    int i, n = 0, running = 0;
+    long long now;
+
+    now = now_ns();
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].pid == 0 || jobs[i].agent || (jobs[i].state != BG && jobs[i].state != SL))
+	    continue;
+	if (jobs[i].state == BG)
+	    running++;
+	run[n++] = &jobs[i];
+    }
+    if (n <= gang_slots) {		/* room for all: no slicing */
+	gang_release();
+	gang_next = 0;
+	return;
+    }
+    if (gang_next == 0)
+	gang_next = now;
+    if (now < gang_next && running >= gang_slots)
+	return;
+
+    if (now >= gang_next)		/* the slice is over for the running jobs */
+	for (i = 0; i < n; i++)
+	    if (run[i]->state == BG)
+		run[i]->sliced = now;
+    qsort(run, n, sizeof(run[0]), cmp_sliced);
+    if (now < gang_next) {		/* mid-slice: just fill the free slots */
+	for (i = 0; i < n && running < gang_slots; i++)
+	    if (run[i]->state == SL) {
+		run[i]->state = BG;
+		Kill(-run[i]->pid, SIGCONT);
+		running++;
+	    }
+	return;
+    }
+    for (i = 0; i < n; i++) {
+	if (i >= gang_slots && run[i]->state == BG) {
+	    run[i]->state = SL;		/* (before the stop is reported) */
+	    Kill(-run[i]->pid, SIGSTOP);
+	}
+	else if (i < gang_slots && run[i]->state == SL) {
+	    run[i]->state = BG;
+	    Kill(-run[i]->pid, SIGCONT);
+	}
+    }
+    gang_next = now + gang_quantum * 1000000LL;
+}
+
+/*
+ * gang_tick - Time-slice the local background jobs, gang_slots at a
+ *    time. When a slice ends, the jobs that waited longest get the next
+ *    one and the others stop (SL). Between slices, a slot freed by a
+ *    job that ended goes to the longest waiting job at once. Called
+ *    from evl_wait, which wakes up for the end of each slice.
+ */
+void gang_tick(void)
+{
+    sigset_t mask, prev;
+
+    if (gang_slots == 0 || getpid() != gang_owner)
+	return;
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &mask, &prev);	/* (evl_wait may run with it unblocked) */
+    gang_slice();
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* gang_release - Continue every job gang has stopped */
+void gang_release(void)
+{
+    sigset_t mask, prev;
+    int i;
+
+    if (gang_slots == 0 || getpid() != gang_owner)
+	return;
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &mask, &prev);	/* jobs[] must hold still */
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].pid != 0 && jobs[i].state == SL) {
+	    jobs[i].state = BG;
+	    Kill(-jobs[i].pid, SIGCONT);
+	}
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * res_strip - If cmdline ends in "& cpus=N mem=SIZE" (either or both),
+ *    cut the declaration off after the '&' into res and return 1.
+ *    Return 0 if there is none, -1 if a value is bad.
+ */
+int res_strip(char *cmdline, struct res_t *res)
+{
+    char *amp = strrchr(cmdline, '&'), *p, *end, word[32];
+    size_t len;
+    int n = 0;
+
+    if (amp == NULL || amp == cmdline || amp[-1] == '&')
+	return 0;
+    res->cpus = 0;
+    res->mem = 0;
+    for (p = amp + 1; *(p += strspn(p, " \t\n")); p += len, n++) {
+	len = strcspn(p, " \t\n");
+	if (strncmp(p, "cpus=", 5) && strncmp(p, "mem=", 4))
+	    return 0;			/* something else follows the '&' */
+    }
+    if (n == 0)
+	return 0;
+    for (p = amp + 1; *(p += strspn(p, " \t\n")); p += len) {
+	len = strcspn(p, " \t\n");
+	if (!strncmp(p, "cpus=", 5)) {
+	    res->cpus = strtol(p + 5, &end, 10);
+	    if (end != p + len || len == 5 || res->cpus <= 0)
+		return -1;
+	}
+	else {
+	    snprintf(word, sizeof(word), "%.*s", (int)(len - 4), p + 4);
+	    if ((res->mem = parse_size(word)) <= 0)
+		return -1;
+	}
+    }
+    strcpy(amp + 1, "\n");
+    return 1;
+}
+
+/* res_init - Default the resource budget to this host, once */
+void res_init(void)
+{
+    if (resbudget.cpus > 0)
+	return;
+    resbudget.cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    resbudget.mem = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+}
+
+/* res_used - Add up the resources reserved by running jobs */
+void res_used(struct res_t *used)
+{
+    int i;
+
+    used->cpus = 0;
+    used->mem = 0;
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].pid != 0) {
+	    used->cpus += jobs[i].cpus;
+	    used->mem += jobs[i].mem;
+	}
+}
+
+/*
+ * res_queue - Queue a background launch with declared resources and
+ *    start whatever fits. A declaration over the whole budget is refused.
+ */
+void res_queue(char **argv, char *cmdline, struct res_t *res)
+{
+    struct resreq_t *rq;
+    long long t0 = now_ns();
+    char *p;
+    int i;
+
+    res_init();
+    if (res->cpus > resbudget.cpus || res->mem > resbudget.mem) {
+	printf("%s: declares more than the budget (cpus=%d mem=%lldM)\n",
+	       argv[0], resbudget.cpus, resbudget.mem >> 20);
+	return;
+    }
+    if (nresq == MAXRESQ) {
+	printf("%s: too many launches waiting for resources\n", argv[0]);
+	return;
+    }
+    rq = &resq[nresq];
+    for (i = 0, p = rq->buf; argv[i] && i < MAXARGS - 1; i++) {
+	if (p + strlen(argv[i]) >= rq->buf + MAXLINE)
+	    break;
+	p = stpcpy(p, argv[i]) + 1;
+    }
+    rq->argc = i;
+    strcpy(rq->cmdline, cmdline);
+    rq->res = *res;
+    rq->t0 = t0;
+    res_owner = getpid();
+    nresq++;
+    res_sched();
+    for (i = 0; i < nresq; i++)	/* (t0 tells it apart) */
+	if (resq[i].t0 == t0)
+	    printf("(waiting for cpus=%d mem=%lldM) %s", res->cpus, res->mem >> 20, cmdline);
+}
+
+/*
+ * res_sched - Start waiting launches while they fit the budget. The
+ *    oldest goes first if it fits. If not, the launch that fits the
+ *    free resources best (least left over) backfills around it, but
+ *    only for reswait seconds: after that the oldest waits for the
+ *    room to drain. Runs at the top of evl_wait and after each queue.
+ */
+void res_sched(void)
+{
+    struct res_t used;
+    struct resreq_t rq;
+    char *argv[MAXARGS], *p;
+    double score, best;
+    sigset_t mask, prev;
+    pid_t pid;
+    int i, pick;
+
+    if (nresq == 0 || getpid() != res_owner)
+	return;
+    res_used(&used);
+    for (;;) {
+	pick = -1;
+	if (resq[0].res.cpus <= resbudget.cpus - used.cpus && resq[0].res.mem <= resbudget.mem - used.mem)
+	    pick = 0;
+	else if (now_ns() - resq[0].t0 < reswait * 1000000000LL) {
+	    best = 3;
+	    for (i = 1; i < nresq; i++) {
+		if (resq[i].res.cpus > resbudget.cpus - used.cpus || resq[i].res.mem > resbudget.mem - used.mem)
+		    continue;
+		score = (double)(resbudget.cpus - used.cpus - resq[i].res.cpus) / resbudget.cpus
+		    + (double)(resbudget.mem - used.mem - resq[i].res.mem) / resbudget.mem;
+		if (score < best) {
+		    best = score;
+		    pick = i;
+		}
+	    }
+	}
+	if (pick < 0)
+	    return;
+
+	rq = resq[pick];		/* off the queue before it runs */
+	memmove(&resq[pick], &resq[pick + 1], (nresq - pick - 1) * sizeof(struct resreq_t));
+	nresq--;
+	for (i = 0, p = rq.buf; i < rq.argc; i++, p += strlen(p) + 1)
+	    argv[i] = p;
+	argv[i] = NULL;
+	Sigemptyset(&mask);
+	Sigaddset(&mask, SIGCHLD);
+	Sigprocmask(SIG_BLOCK, &mask, &prev);	/* launch unblocks it: keep our caller's mask */
+	pid = launch(argv, NULL, 1, rq.cmdline, 0, NULL);
+	if (getjobpid(jobs, pid)) {
+	    getjobpid(jobs, pid)->cpus = rq.res.cpus;
+	    getjobpid(jobs, pid)->mem = rq.res.mem;
+	    used.cpus += rq.res.cpus;
+	    used.mem += rq.res.mem;
+	}
+	Sigprocmask(SIG_SETMASK, &prev, NULL);
+	if (nresq == 0)
+	    return;
+    }
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct job_t *jobs) {
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].state == FG)
+	    return jobs[i].pid;
+    return 0;
+}
+
+/* getjobpid  - Find a job (by PID) on the job list */
+struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
+    int i;
+
+    if (pid < 1)
+	return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].pid == pid)
+	    return &jobs[i];
+    return NULL;
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct job_t *jobs, int jid) 
+{
+    int i;
+
+    if (jid < 1)
+	return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].jid == jid)
+	    return &jobs[i];
+    return NULL;
+}
+
+/* getjobarg - Find a job named by a "%jid" or "pid" argument */
+struct job_t *getjobarg(struct job_t *jobs, char *arg)
+{
+    if (arg[0] == '%')
+	return getjobjid(jobs, atoi(arg+1));
+    return getjobpid(jobs, atoi(arg));
+}
+
+/* signaljob - Send sig to the process group of a job, wherever it runs */
+void signaljob(struct job_t *job, int sig)
+{
+    if (job->agent && agents[job->agent])
+	agent_send(agents[job->agent], "SIG %d %d\n", job->rid, sig);
+    else
+	Kill(-job->pid, sig);
+}
+
+/* disown_find - Find pid in the disowned table, NULL if absent */
+struct disown_t *disown_find(pid_t pid)
+{
+    int i = pid & (DISOWNTAB - 1);
+
+    while (disowned[i].pid != 0) {
+	if (disowned[i].pid == pid)
+	    return &disowned[i];
+	i = (i + 1) & (DISOWNTAB - 1);
+    }
+    return NULL;
+}
+
+/* disown_add - Record a disowned process */
+void disown_add(pid_t pid, char *cmdline)
+{
+    int i = pid & (DISOWNTAB - 1);
+
+    if (ndisowned >= DISOWNTAB / 2)	/* keep probes short; forget the rest */
+	return;
+    while (disowned[i].pid != 0)
+	i = (i + 1) & (DISOWNTAB - 1);
+    disowned[i].pid = pid;
+    snprintf(disowned[i].cmd, sizeof(disowned[i].cmd), "%.*s",
+	     (int)strcspn(cmdline, "\n"), cmdline);
+    ndisowned++;
+}
+
+/* 
+ * disown_remove - Free a slot of the disowned table, moving later
+ *    entries of the same probe chain back so lookups still find them.
+ */
+void disown_remove(struct disown_t *d)
+{
+    int i = d - disowned, j = i, k;
+
+    disowned[i].pid = 0;
+    ndisowned--;
+    for (;;) {
+	j = (j + 1) & (DISOWNTAB - 1);
+	if (disowned[j].pid == 0)
+	    return;
+	k = disowned[j].pid & (DISOWNTAB - 1);
+	if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+	    continue;		/* j's home slot lies after the hole */
+	disowned[i] = disowned[j];
+	disowned[j].pid = 0;
+	i = j;
+    }
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid) 
+{
+    int i;
+
+    if (pid < 1)
+	return 0;
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].pid == pid) {
+            return jobs[i].jid;
+        }
+    return 0;
+}
+
+/* listjobs - Print the job list */
+void listjobs(struct job_t *jobs, int details) 
+{
+    int i;
+    
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].pid != 0) {
+	    printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
+	    switch (jobs[i].state) {
+		case BG: 
+		    printf("Running ");
+		    break;
+		case FG: 
+		    printf("Foreground ");
+		    break;
+		case SL: 
+		    printf("Running (between time slices) ");
+		    break;
+		case ST: 
+		    printf("Stopped ");
+		    if (jobs[i].stopsig == SIGTTIN)
+			printf("(tty input) ");
+		    else if (jobs[i].stopsig == SIGTTOU)
+			printf("(tty output) ");
+		    break;
+	    default:
+		    printf("listjobs: Internal error: job[%d].state=%d ", 
+			   i, jobs[i].state);
+	    }
+	    printf("%s", jobs[i].cmdline);
+	    if (details)
+		jobdetails(&jobs[i]);
+	}
+    }
+    if (details)
+	for (i = 0; i < nresq; i++)
+	    printf("(waiting %.1f s for cpus=%d mem=%lldM) %s", (now_ns() - resq[i].t0) / 1e9,
+		   resq[i].res.cpus, resq[i].res.mem >> 20, resq[i].cmdline);
+    if (aimd.nwin > 0)
+	aimd_print();
+}
+
+/* jobdetails - Print the extra lines of jobs -l for one job */
+void jobdetails(struct job_t *job)
+{
+    struct capture_t *cap = job->cap;
+
+    if (job->agent && agents[job->agent])
+	printf("    on agent %d (@%s) as pid %d\n", job->agent, agents[job->agent]->pool, job->rpid);
+    if (job->cpus || job->mem)
+	printf("    reserved cpus=%d mem=%lldM\n", job->cpus, job->mem >> 20);
+    if (cap && cap->rate > 0)
+	printf("    throttle %lld bytes/s (%s)%s: %lld bytes passed, %lld dropped\n",
+	       cap->rate, cap->mode == THR_BLOCK ? "block" : "drop",
+	       cap->paused ? ", backpressured" : "", cap->passed, cap->dropped);
+    else if (cap)
+	printf("    output through shell: %lld bytes passed\n", cap->passed);
+    if (job->pstat)
+	pstat_print(job->pstat);
+}
+
+/*
+ * pstat_open - Make the shared record for measuring a pipeline job,
+ *    with a name for each of its stages (at most MAXSTAGES)
+ */
+struct pstat_t *pstat_open(struct cmd_t *pipe)
+{
+    struct pstat_t *ps;
+    struct cmd_t *c;
+    char *name;
+
+    ps = mmap(NULL, sizeof(struct pstat_t), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (ps == MAP_FAILED)
+	return NULL;		/* (the job runs unmeasured) */
+    for (c = pipe->body; c && ps->n < MAXSTAGES; c = c->next) {
+	if (c->type == CMD_SIMPLE)
+	    name = strrchr(c->argv[0], '/') ? strrchr(c->argv[0], '/') + 1 : c->argv[0];
+	else
+	    name = c->type == CMD_FANOUT ? "|> (...)" : c->type == CMD_GROUP ? "{ ... }" : "( ... )";
+	snprintf(ps->name[ps->n++], sizeof(ps->name[0]), "%s", name);
+    }
+    return ps;
+}
+
+/*
+ * pstat_print - Print what the relays of a pipeline have measured, and
+ *    its bottleneck. A slow stage makes the relays before it wait for
+ *    room (the pipes back up behind it) and the ones after it wait for
+ *    input, so it is the stage after the last relay that mostly waited
+ *    for room.
+ */
+void pstat_print(struct pstat_t *ps)
+{
+    struct pstage_t *b;
+    long long wait = 0;
+    double secs;
+    int i, slow = 0;
+
+    for (i = 0; i < ps->n - 1; i++) {
+	b = &ps->b[i];
+	secs = (b->t1 - b->t0) / 1e9;
+	printf("    %s | %s: %lld bytes, %.1f MB/s, waited %.2fs for input, %.2fs for room\n",
+	       ps->name[i], ps->name[i+1], b->bytes, secs > 0 ? b->bytes / secs / 1e6 : 0.0,
+	       b->inwait / 1e9, b->outwait / 1e9);
+	if (b->outwait > b->inwait)
+	    slow = i + 1;
+	wait += b->inwait + b->outwait;
+    }
+    if (ps->n > 1 && wait >= 10000000)	/* (under 10ms: nobody really waited) */
+	printf("    bottleneck: %s\n", ps->name[slow]);
+}
+/******************************
+ * end job list helper routines
+ ******************************/
+
+
+/*****************************************************
+ * Spawner pool
+ *
+ * Worker threads that run posix_spawn for the batch builtin. Requests
+ * and results travel through two lock-free queues; only the main
+ * thread ever touches jobs[] or runs a signal handler.
+ *****************************************************/
+
+/* lfq_init - Initialize an empty queue */
+void lfq_init(struct lfq *q)
+{
+    size_t i;
+
+    for (i = 0; i < SPAWNQ; i++)
+	atomic_init(&q->cell[i].seq, i);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+}
+
+/* lfq_push - Append data to the queue, return 0 if it is full */
+int lfq_push(struct lfq *q, void *data)
+{
+    struct lfq_cell *cell;
+    size_t pos, seq;
+    long dif;
+
+    pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    for (;;) {
+	cell = &q->cell[pos & (SPAWNQ - 1)];
+	seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+	dif = (long)seq - (long)pos;
+	if (dif == 0) {
+	    if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+		    memory_order_relaxed, memory_order_relaxed))
+		break;
+	}
+	else if (dif < 0)
+	    return 0;
+	else
+	    pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+    cell->data = data;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+/* lfq_pop - Remove the oldest entry of the queue, NULL if it is empty */
+void *lfq_pop(struct lfq *q)
+{
+    struct lfq_cell *cell;
+    size_t pos, seq;
+    long dif;
+    void *data;
+
+    pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    for (;;) {
+	cell = &q->cell[pos & (SPAWNQ - 1)];
+	seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+	dif = (long)seq - (long)(pos + 1);
+	if (dif == 0) {
+	    if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+		    memory_order_relaxed, memory_order_relaxed))
+		break;
+	}
+	else if (dif < 0)
+	    return NULL;
+	else
+	    pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    }
+    data = cell->data;
+    atomic_store_explicit(&cell->seq, pos + SPAWNQ, memory_order_release);
+    return data;
+}
+
+/* 
+ * spawn_attr_init - Spawn attributes shared by every batch launch: a
+ *    new process group (as setpgid(0,0) in eval) and an empty signal
+ *    mask, since the caller launches with SIGCHLD blocked.
+ */
+void spawn_attr_init(posix_spawnattr_t *attr)
+{
+    sigset_t empty;
+
+    sigemptyset(&empty);
+    posix_spawnattr_init(attr);
+    posix_spawnattr_setflags(attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(attr, 0);
+    posix_spawnattr_setsigmask(attr, &empty);
+}
+
+/* spawn_one - Launch one request, recording its pid or error */
+void spawn_one(struct spawn_req *req, posix_spawnattr_t *attr)
+{
+    posix_spawn_file_actions_t fa;
+    int usefa = (req->cap || bgstdin != IN_TTY);
+
+    if (usefa) {
+	posix_spawn_file_actions_init(&fa);
+	if (req->cap) {
+	    posix_spawn_file_actions_adddup2(&fa, req->cap->wfd, STDOUT_FILENO);
+	    posix_spawn_file_actions_adddup2(&fa, req->cap->wfd, STDERR_FILENO);
+	}
+	if (req->infd >= 0)
+	    posix_spawn_file_actions_adddup2(&fa, req->infd, STDIN_FILENO);
+	else if (bgstdin != IN_TTY)
+	    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO,
+		bgstdin == IN_FILE ? bgstdin_path : "/dev/null", O_RDONLY, 0);
+    }
+    req->err = posix_spawn(&req->pid, req->argv[0], usefa ? &fa : NULL,
+			   attr, req->argv, environ);
+    if (usefa)
+	posix_spawn_file_actions_destroy(&fa);
+    if (req->err)
+	req->pid = 0;
+}
+
+/* 
+ * spawner_thread - Take requests off spawnq, spawn them, and post the
+ *    results on doneq for the main thread to register.
+ */
+void *spawner_thread(void *arg)
+{
+    posix_spawnattr_t attr;
+    struct spawn_req *req;
+
+    spawn_attr_init(&attr);
+    for (;;) {
+	while (sem_wait(&spawn_sem) < 0)
+	    ;
+	if ((req = lfq_pop(&spawnq)) == NULL)
+	    continue;
+	spawn_one(req, &attr);
+	while (!lfq_push(&doneq, req))
+	    sched_yield();
+	sem_post(&done_sem);
+    }
+    return NULL;
+}
+
+/*
+ * spawner_init - Start n spawner threads. They are created with every
+ *    signal blocked, so SIGCHLD (and ctrl-c/ctrl-z) are only ever
+ *    handled on the main thread.
+ */
+void spawner_init(int n)
+{
+    sigset_t all, prev;
+    pthread_t tid;
+    int i;
+
+    if (n == 0)
+	return;
+    lfq_init(&spawnq);
+    lfq_init(&doneq);
+    if (sem_init(&spawn_sem, 0, 0) < 0 || sem_init(&done_sem, 0, 0) < 0)
+	unix_error("sem_init error");
+
+    sigfillset(&all);
+    Sigprocmask(SIG_BLOCK, &all, &prev);
+    for (i = 0; i < n; i++) {
+	if ((errno = pthread_create(&tid, NULL, spawner_thread, NULL)) != 0)
+	    unix_error("pthread_create error");
+	pthread_detach(tid);
+    }
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * spawn_burst - Launch n requests and wait until all of them have a pid
+ *    or an error. The caller must have SIGCHLD blocked: a child that
+ *    exits right away stays pending until its job has been added.
+ *    Without a pool the requests are spawned from the main thread.
+ */
+int spawn_burst(struct spawn_req *reqs, int n)
+{
+    static posix_spawnattr_t attr;
+    static int attr_ready = 0;
+    int i;
+
+    if (nspawners == 0) {
+	if (!attr_ready) {
+	    spawn_attr_init(&attr);
+	    attr_ready = 1;
+	}
+	for (i = 0; i < n; i++)
+	    spawn_one(&reqs[i], &attr);
+	return n;
+    }
+
+    for (i = 0; i < n; i++) {
+	lfq_push(&spawnq, &reqs[i]);
+	sem_post(&spawn_sem);
+    }
+    for (i = 0; i < n; ) {
+	if (sem_wait(&done_sem) < 0)
+	    continue;
+	if (lfq_pop(&doneq) != NULL)
+	    i++;
+    }
+    return n;
+}
+
+/*****************
+ * End spawner pool
+ *****************/
+
+
+/*****************************************************
+ * Event loop and output multiplexer
+ *
+ * One epoll instance watches every pipe the shell reads from. The shell
+ * sleeps in evl_wait() whenever it waits for a job or for input, so job
+ * output keeps flowing while the prompt is idle. With tsh -u, an io_uring
+ * instance takes epoll's place and also reaps the children (see below).
+ *****************************************************/
+
+int evl_fdready = 0;        /* set when the fd passed to evl_waitfd is readable */
+char outpfx[64];            /* prefix for the lines of the current capture */
+size_t outpfxlen = 0;
+
+/* evl_init - Create the shell's epoll instance */
+void evl_init(void)
+{
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	unix_error("epoll_create1 error");
+    if (use_ring && uring_init() < 0 && verbose)
+	printf("evl_init: io_uring unavailable, using epoll\n");
+}
+
+/* evl_add - Start watching src for events */
+void evl_add(struct evsrc_t *src, unsigned events)
+{
+    struct epoll_event ev;
+
+    if (ring.fd >= 0) {
+	uring_add(src, events);
+	return;
+    }
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0)
+	unix_error("epoll_ctl error");
+}
+
+/* evl_mod - Change the events watched for src */
+void evl_mod(struct evsrc_t *src, unsigned events)
+{
+    struct epoll_event ev;
+
+    if (ring.fd >= 0) {
+	uring_mod(src, events);
+	return;
+    }
+    ev.events = events;
+    ev.data.ptr = src;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, src->fd, &ev);
+}
+
+/* evl_del - Stop watching src */
+void evl_del(struct evsrc_t *src)
+{
+    if (ring.fd >= 0)
+	uring_del(src);
+    else
+	epoll_ctl(epfd, EPOLL_CTL_DEL, src->fd, NULL);
+}
+
+/*
+ * evl_wait - Wait up to timeout ms (-1 = forever) for events, with the
+ *    signal mask set to mask while asleep, and dispatch them. A signal
+ *    (e.g. SIGCHLD) ends the wait early. Returns the number of events.
+ */
+int evl_wait(int timeout, sigset_t *mask)
+{
+    struct epoll_event evs[MAXEVENTS];
+    struct evsrc_t *src;
+    int i, n;
+
+    gang_tick();		/* (sets gang_next while jobs are sliced) */
+    res_sched();		/* start waiting launches that fit now */
+    if (gzq != NULL)
+	timeout = 0;		/* compression pending: poll, don't sleep */
+    else if (pausedq != NULL && (timeout < 0 || timeout > THROTTLE_TICK))
+	timeout = THROTTLE_TICK; /* come back for backpressured jobs */
+    if (gang_next && (timeout < 0 || timeout > (gang_next - now_ns()) / 1000000))
+	timeout = gang_next > now_ns() ? (gang_next - now_ns()) / 1000000 + 1 : 0; /* end of the slice */
+    if (ring.fd >= 0)
+	n = uring_wait(timeout, mask);
+    else {
+	if ((n = epoll_pwait(epfd, evs, MAXEVENTS, timeout, mask)) < 0) {
+	    if (errno != EINTR)
+		unix_error("epoll_pwait error");
+	    n = 0;
+	}
+	for (i = 0; i < n; i++) {
+	    src = evs[i].data.ptr;
+	    src->handler(src, evs[i].events);
+	}
+    }
+    throttle_resume();
+    outmux_flush();
+    spool_work();
+    return n;
+}
+
+/* evl_active - Return true if the event loop has anything to do */
+int evl_active(void)
+{
+    return ncaptures > 0 || gzq != NULL || pausedq != NULL || gang_slots > 0 || nresq > 0
+	|| agent_lsrc.fd >= 0;
+}
+
+/* evl_ready - Handler for evl_waitfd */
+void evl_ready(struct evsrc_t *src, unsigned events)
+{
+    evl_fdready = 1;
+}
+
+/* 
+ * evl_waitfd - Run the event loop until fd is readable. Regular files
+ *    cannot be polled and are always readable, so return at once.
+ */
+void evl_waitfd(int fd)
+{
+    struct evsrc_t src;
+    struct epoll_event ev;
+
+    src.fd = fd;
+    src.handler = evl_ready;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &src;
+    evl_fdready = 0;
+    if (ring.fd >= 0)
+	evl_add(&src, EPOLLIN);
+    else if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+	if (errno != EPERM)
+	    unix_error("epoll_ctl error");
+	return;
+    }
+    while (!evl_fdready)
+	evl_wait(-1, NULL);
+    evl_del(&src);
+}
+
+/*
+ * The io_uring backend. Sources are polled with one-shot polls that are
+ * queued again after each event, which keeps epoll's level-triggered
+ * behaviour. A few waitid operations for any child are kept queued too,
+ * and the evl_wait timeout is a timer on the ring, so a burst of child
+ * exits, the output they leave in their pipes and the timer all come
+ * back from a single io_uring_enter. SIGCHLD then only interrupts the
+ * wait; sigchld_handler leaves the reaping to the ring.
+ */
+
+/* ring_data - Make the user_data of a ring operation */
+static unsigned long long ring_data(int kind, unsigned gen, int slot)
+{
+    return (unsigned long long)kind << 56 | (unsigned long long)gen << 24 | slot;
+}
+
+/* ring_enter - Submit what is queued and wait for min completions */
+static int ring_enter(unsigned min, sigset_t *mask)
+{
+    unsigned n = *ring.sqtail - __atomic_load_n(ring.sqhead, __ATOMIC_ACQUIRE);
+
+    return syscall(__NR_io_uring_enter, ring.fd, n, min,
+		   min ? IORING_ENTER_GETEVENTS : 0, mask, _NSIG / 8);
+}
+
+/* ring_sqe - Queue a cleared submission entry, submitting if the queue is full */
+static struct io_uring_sqe *ring_sqe(int op, int fd, unsigned long long data)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *ring.sqtail;
+
+    while (tail - __atomic_load_n(ring.sqhead, __ATOMIC_ACQUIRE) > *ring.sqmask)
+	if (ring_enter(0, NULL) < 0 && errno != EINTR && errno != EBUSY)
+	    unix_error("io_uring_enter error");
+    sqe = &ring.sqes[tail & *ring.sqmask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    ring.sqarray[tail & *ring.sqmask] = tail & *ring.sqmask;
+    __atomic_store_n(ring.sqtail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/*
+ * uring_init - Set up the ring. Returns -1, leaving the event loop on
+ *    epoll, if io_uring is missing, disabled or cannot wait for children.
+ */
+int uring_init(void)
+{
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    size_t sqlen, cqlen;
+    char *sq, *cq;
+    int fd, ok;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 4 * RINGSIZE;
+    if ((fd = syscall(__NR_io_uring_setup, RINGSIZE, &p)) < 0)
+	return -1;
+    probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    ok = probe && (p.features & IORING_FEAT_NODROP)
+	&& syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0
+	&& probe->last_op >= RING_OP_WAITID
+	&& (probe->ops[RING_OP_WAITID].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	sqlen = cqlen = sqlen > cqlen ? sqlen : cqlen;
+    if (!ok || (sq = mmap(NULL, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			  fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+	close(fd);
+	return -1;
+    }
+    cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+	cq = mmap(NULL, cqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		  fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		     PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (cq == MAP_FAILED || ring.sqes == MAP_FAILED) {
+	close(fd);		/* (the mappings stay; this happens once at most) */
+	return -1;
+    }
+    ring.sqhead = (unsigned *)(sq + p.sq_off.head);
+    ring.sqtail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sqarray = (unsigned *)(sq + p.sq_off.array);
+    ring.cqhead = (unsigned *)(cq + p.cq_off.head);
+    ring.cqtail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.fd = fd;
+    pthread_atfork(NULL, NULL, uring_forget);
+    return 0;
+}
+
+/*
+ * uring_forget - (forked child) Drop the parent's ring: its queued waits
+ *    are for the parent's children. The child falls back to epoll.
+ */
+void uring_forget(void)
+{
+    if (ring.fd >= 0)
+	close(ring.fd);
+    ring.fd = -1;
+}
+
+/* ring_poll - Queue a poll for the current generation of slot i */
+static void ring_poll(int i)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_sqe(IORING_OP_POLL_ADD, ringsrcs[i].src->fd,
+		   ring_data(RING_SRC, ringsrcs[i].gen, i));
+    sqe->poll32_events = ringsrcs[i].events; /* (EPOLLIN == POLLIN etc.) */
+    ringsrcs[i].armed = 1;
+}
+
+/* ring_unpoll - Cancel slot i's queued poll, if any, and retire its generation */
+static void ring_unpoll(int i)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ringsrcs[i].armed) {
+	sqe = ring_sqe(IORING_OP_POLL_REMOVE, -1, ring_data(RING_NONE, 0, 0));
+	sqe->addr = ring_data(RING_SRC, ringsrcs[i].gen, i);
+    }
+    ringsrcs[i].armed = 0;
+    ringsrcs[i].gen++;		/* (a late completion of the old poll is ignored) */
+}
+
+/* uring_add - evl_add for the ring */
+void uring_add(struct evsrc_t *src, unsigned events)
+{
+    int i;
+
+    for (i = 0; i < RINGSRCS; i++)
+	if (ringsrcs[i].src == NULL)
+	    break;
+    if (i == RINGSRCS)
+	app_error("io_uring: too many event sources");
+    ringsrcs[i].src = src;
+    ringsrcs[i].events = events;
+    src->ring = i;
+    if (events)
+	ring_poll(i);
+}
+
+/* uring_mod - evl_mod for the ring */
+void uring_mod(struct evsrc_t *src, unsigned events)
+{
+    int i = src->ring;
+
+    ring_unpoll(i);
+    ringsrcs[i].events = events;
+    if (events)
+	ring_poll(i);
+}
+
+/* uring_del - evl_del for the ring */
+void uring_del(struct evsrc_t *src)
+{
+    int i = src->ring;
+
+    ring_unpoll(i);
+    ringsrcs[i].src = NULL;
+}
+
+/*
+ * ring_waits - Keep RINGWAITS child waits queued. Once they have found
+ *    no children, only queue them again when a child exists.
+ */
+static void ring_waits(void)
+{
+    struct io_uring_sqe *sqe;
+    siginfo_t si;
+    int i;
+
+    if (ring.nwaits == RINGWAITS)
+	return;
+    if (ring.nochild) {
+	if (waitid(P_ALL, 0, &si, WEXITED|WSTOPPED|WNOHANG|WNOWAIT) < 0)
+	    return;
+	ring.nochild = 0;
+    }
+    for (i = 0; i < RINGWAITS; i++) {
+	if (ringwaiting[i])
+	    continue;
+	sqe = ring_sqe(RING_OP_WAITID, 0, ring_data(RING_WAIT, 0, i));
+	sqe->len = P_ALL;
+	sqe->file_index = WEXITED|WSTOPPED; /* (waitid options) */
+	sqe->addr2 = (unsigned long long)(unsigned long)&ringwaits[i];
+	ringwaiting[i] = 1;
+	ring.nwaits++;
+    }
+}
+
+/* ring_timer - Make sure a timer fires within timeout ms */
+static void ring_timer(int timeout)
+{
+    struct io_uring_sqe *sqe;
+    long long when = now_ns() + timeout * 1000000LL;
+
+    if (ring.deadline && ring.deadline <= when)
+	return;			/* an earlier one will do: callers loop */
+    if (ring.deadline) {
+	sqe = ring_sqe(IORING_OP_TIMEOUT_REMOVE, -1, ring_data(RING_NONE, 0, 0));
+	sqe->addr = ring_data(RING_TIMER, ring.timergen, 0);
+    }
+    ring.timergen++;
+    ring.deadline = when;
+    ring.ts.tv_sec = timeout / 1000;
+    ring.ts.tv_nsec = (timeout % 1000) * 1000000LL;
+    sqe = ring_sqe(IORING_OP_TIMEOUT, -1, ring_data(RING_TIMER, ring.timergen, 0));
+    sqe->addr = (unsigned long long)(unsigned long)&ring.ts;
+    sqe->len = 1;
+}
+
+/*
+ * uring_reap - Handle every completion on the ring: child state changes
+ *    go to child_status and ready sources to their handlers. Needs no
+ *    system call. Returns the number handled.
+ */
+int uring_reap(void)
+{
+    struct io_uring_cqe cqe;
+    struct ringsrc_t *rs;
+    unsigned head;
+    int i, n = 0;
+
+    while ((head = *ring.cqhead) != __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE)) {
+	cqe = ring.cqes[head & *ring.cqmask];
+	__atomic_store_n(ring.cqhead, head + 1, __ATOMIC_RELEASE);
+	i = cqe.user_data & 0xffffff;
+	switch (cqe.user_data >> 56) {
+	case RING_WAIT:
+	    ringwaiting[i] = 0;
+	    ring.nwaits--;
+	    if (cqe.res == -ECHILD)
+		ring.nochild = 1;
+	    else if (cqe.res == 0 && ringwaits[i].si_pid > 0) {
+		child_status(ringwaits[i].si_pid, tsh_wait_status(&ringwaits[i]));
+		n++;
+	    }
+	    break;
+	case RING_TIMER:
+	    if ((unsigned)(cqe.user_data >> 24) == ring.timergen)
+		ring.deadline = 0;
+	    break;
+	case RING_SRC:
+	    rs = &ringsrcs[i];
+	    if (rs->src == NULL || (unsigned)(cqe.user_data >> 24) != rs->gen)
+		break;		/* stale: the source was changed or removed */
+	    rs->armed = 0;
+	    if (cqe.res < 0)
+		break;
+	    rs->src->handler(rs->src, cqe.res);
+	    n++;
+	    if (rs->src != NULL && (unsigned)(cqe.user_data >> 24) == rs->gen && rs->events)
+		ring_poll(i);	/* still watched: poll again (level-triggered) */
+	    break;
+	}
+    }
+    return n;
+}
+
+/*
+ * uring_wait - evl_wait for the ring: queue the child waits and the
+ *    timer, then submit and wait in one io_uring_enter
+ */
+int uring_wait(int timeout, sigset_t *mask)
+{
+    int n;
+
+    ring_waits();
+    if (timeout > 0)
+	ring_timer(timeout);
+    if ((n = uring_reap()) > 0)
+	timeout = 0;		/* (already have something to report) */
+    if (ring_enter(timeout ? 1 : 0, mask) < 0 && errno != EINTR && errno != EBUSY)
+	unix_error("io_uring_enter error");
+    return n + uring_reap();
+}
+
+/* 
+ * capture_open - Create an output pipe for a job that is about to be
+ *    started. Both ends are close-on-exec; the child dup2s the write
+ *    end onto stdout and stderr. Returns NULL if no pipe is available,
+ *    in which case the job writes to the terminal directly.
+ */
+struct capture_t *capture_open(void)
+{
+    struct capture_t *cap;
+    int fds[2];
+
+    if ((cap = capture_new()) == NULL)
+	return NULL;
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+	free(cap);
+	return NULL;
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, 1<<20); /* fewer wakeups; best effort */
+    cap->src.fd = fds[0];
+    cap->wfd = fds[1];
+    return cap;
+}
+
+/* capture_new - Allocate a capture with no pipe yet */
+struct capture_t *capture_new(void)
+{
+    struct capture_t *cap;
+
+    if ((cap = malloc(sizeof(struct capture_t))) == NULL)
+	return NULL;
+    cap->src.fd = -1;
+    cap->src.handler = capture_read;
+    cap->wfd = -1;
+    cap->jid = 0;
+    cap->pid = 0;
+    cap->logfd = -1;
+    cap->logsize = 0;
+    cap->seg = 0;
+    cap->spoolid = 0;
+    cap->prefix = outmux;
+    cap->rate = throttle_rate;
+    cap->mode = throttle_mode;
+    cap->tokens = throttle_rate;
+    cap->refill = now_ns();
+    cap->passed = cap->dropped = cap->noted = cap->notetime = 0;
+    cap->skipline = 0;
+    cap->paused = 0;
+    cap->len = 0;
+    return cap;
+}
+
+/* 
+ * capture_attach - The job is running: drop our write end and start
+ *    reading. If spooling is on, open the job's log file as well.
+ */
+void capture_attach(struct capture_t *cap, int jid, pid_t pid)
+{
+    char path[MAXLINE];
+    struct job_t *job;
+    int i;
+
+    close(cap->wfd);
+    cap->wfd = -1;
+    cap->jid = jid;
+    cap->pid = pid;
+    if ((job = getjobjid(jobs, jid)) != NULL)
+	job->cap = cap;
+    if (spooldir[0]) {		/* (O_EXCL: a reused pid must not clobber a log) */
+	cap->spoolid = time(NULL);
+	for (i = 0; i < 8; i++, cap->spoolid++) {
+	    spool_path(path, pid, cap->spoolid);
+	    if ((cap->logfd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644)) >= 0
+		|| errno != EEXIST)
+		break;
+	}
+    }
+    fcntl(cap->src.fd, F_SETFL, O_NONBLOCK);
+    evl_add(&cap->src, EPOLLIN);
+    ncaptures++;
+}
+
+/* 
+ * capture_read - Drain a job's output pipe, within the job's output
+ *    budget if it has one. At end of file the last partial line is
+ *    terminated and the pipe is released.
+ */
+void capture_read(struct evsrc_t *src, unsigned events)
+{
+    static char buf[65536];
+    struct capture_t *cap = (struct capture_t *)src;
+    struct job_t *job;
+    size_t want = sizeof(buf);
+    char *data = buf;
+    ssize_t n;
+
+    capture_prefix(cap);
+
+    if (cap->rate > 0) {
+	throttle_refill(cap);
+	if (cap->mode == THR_BLOCK) {
+	    if (cap->tokens <= 0) {	/* out of budget: let the pipe fill up */
+		evl_del(src);		/* (a hangup would still wake us) */
+		cap->paused = 1;
+		cap->pnext = pausedq;
+		pausedq = cap;
+		return;
+	    }
+	    if ((long long)want > cap->tokens)
+		want = cap->tokens;
+	}
+    }
+
+    if ((n = read(src->fd, buf, want)) > 0) {
+	if (cap->rate > 0 && cap->mode == THR_DROP)
+	    n = throttle_drop(cap, &data, n);
+	else if (cap->rate > 0)
+	    cap->tokens -= n;
+	cap->passed += n;
+	if (cap->logfd >= 0)
+	    spool_write(cap, data, n);
+	else
+	    capture_emit(cap, data, n);
+	throttle_note(cap, 0);
+	return;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+	return;
+    if (cap->len > 0)
+	capture_emit(cap, "\n", 1);
+    throttle_note(cap, 1);
+    if (cap->logfd >= 0)
+	close(cap->logfd);
+    if ((job = getjobjid(jobs, cap->jid)) != NULL && job->cap == cap)
+	job->cap = NULL;
+    evl_del(src);
+    close(src->fd);
+    free(cap);
+    ncaptures--;
+}
+
+/* capture_prefix - Set up outpfx for the lines of cap */
+void capture_prefix(struct capture_t *cap)
+{
+    struct timespec ts;
+    struct tm tm;
+
+    outpfxlen = 0;
+    if (cap->prefix) {
+	if (cap->jid)
+	    outpfxlen = sprintf(outpfx, "[%d] ", cap->jid);
+	else			/* disowned: no job ID any more */
+	    outpfxlen = sprintf(outpfx, "(%d) ", cap->pid);
+	if (outmux_ts) {
+	    clock_gettime(CLOCK_REALTIME, &ts);
+	    localtime_r(&ts.tv_sec, &tm);
+	    outpfxlen += strftime(outpfx + outpfxlen, 16, "%H:%M:%S", &tm);
+	    outpfxlen += sprintf(outpfx + outpfxlen, ".%03ld ", ts.tv_nsec / 1000000);
+	}
+    }
+}
+
+/* 
+ * outmux_line - Append one prefixed line to outbuf: the unfinished
+ *    part held in cap->line followed by n bytes of data.
+ */
+void outmux_line(struct capture_t *cap, const char *data, size_t n, int addnl)
+{
+    if (outlen + outpfxlen + cap->len + n + 1 > OUTBUFSIZE)
+	outmux_flush();
+    memcpy(outbuf + outlen, outpfx, outpfxlen);
+    outlen += outpfxlen;
+    memcpy(outbuf + outlen, cap->line, cap->len);
+    outlen += cap->len;
+    memcpy(outbuf + outlen, data, n);
+    outlen += n;
+    if (addnl)
+	outbuf[outlen++] = '\n';
+    cap->len = 0;
+}
+
+/* 
+ * capture_emit - Split n bytes of job output into lines. Complete lines
+ *    go to outbuf; a trailing partial line is held until its newline
+ *    arrives. Lines longer than CAPLINE are broken up.
+ */
+void capture_emit(struct capture_t *cap, const char *data, size_t n)
+{
+    const char *nl;
+    size_t seg;
+
+    while (n > 0) {
+	if ((nl = memchr(data, '\n', n)) != NULL) {
+	    seg = nl - data + 1;
+	    outmux_line(cap, data, seg, 0);
+	}
+	else if (cap->len + n <= CAPLINE) {
+	    memcpy(cap->line + cap->len, data, n);
+	    cap->len += n;
+	    return;
+	}
+	else {
+	    seg = CAPLINE - cap->len;
+	    outmux_line(cap, data, seg, 1);
+	}
+	data += seg;
+	n -= seg;
+    }
+}
+
+/* outmux_flush - Write out the lines collected in outbuf */
+void outmux_flush(void)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    if (outlen == 0)
+	return;
+    fflush(stdout);
+    while (off < outlen) {
+	if ((n = write(STDOUT_FILENO, outbuf + off, outlen - off)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	off += n;
+    }
+    outlen = 0;
+}
+
+/* 
+ * spool_path - Name of the live spool file of job pid, started at time
+ *    id. The time tells apart jobs that got the same pid.
+ */
+void spool_path(char *path, pid_t pid, long id)
+{
+    snprintf(path, MAXLINE, "%s/job-%d-%ld.log", spooldir, pid, id);
+}
+
+/* spool_find - Return the id of the newest spool file of pid, or -1 */
+long spool_find(pid_t pid)
+{
+    DIR *dir;
+    struct dirent *d;
+    long id, best = -1;
+    int p;
+
+    if ((dir = opendir(spooldir)) == NULL)
+	return -1;
+    while ((d = readdir(dir)) != NULL)
+	if (sscanf(d->d_name, "job-%d-%ld.log", &p, &id) == 2 && p == pid && id > best)
+	    best = id;
+    closedir(dir);
+    return best;
+}
+
+/* spool_write - Append job output to its spool file, rotating when full */
+void spool_write(struct capture_t *cap, const char *data, size_t n)
+{
+    ssize_t rc;
+
+    if (cap->logsize > 0 && cap->logsize + n > spoolmax)
+	spool_rotate(cap);
+    while (n > 0) {
+	if ((rc = write(cap->logfd, data, n)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return;		/* disk trouble: drop the output */
+	}
+	data += rc;
+	n -= rc;
+	cap->logsize += rc;
+    }
+}
+
+/* 
+ * spool_rotate - Rename the live spool file to the next segment number,
+ *    queue it for compression and start a fresh file.
+ */
+void spool_rotate(struct capture_t *cap)
+{
+    char path[MAXLINE], tmp[MAXLINE+16];
+    struct gzjob_t *gz;
+
+    spool_path(path, cap->pid, cap->spoolid);
+    close(cap->logfd);
+    cap->logfd = -1;
+    cap->seg++;
+    if ((gz = malloc(sizeof(struct gzjob_t))) != NULL) {
+	sprintf(gz->path, "%s/job-%d-%ld.log.%d", spooldir, cap->pid, cap->spoolid, cap->seg);
+	sprintf(tmp, "%s.gz.tmp", gz->path);
+	if (rename(path, gz->path) == 0
+	    && (gz->in = open(gz->path, O_RDONLY|O_CLOEXEC)) >= 0) {
+	    if ((gz->out = gzopen(tmp, "wb")) != NULL) {
+		gz->next = NULL;
+		if (gzqtail)
+		    gzqtail->next = gz;
+		else
+		    gzq = gz;
+		gzqtail = gz;
+	    }
+	    else {
+		close(gz->in);
+		free(gz);
+	    }
+	}
+	else
+	    free(gz);
+    }
+    cap->logfd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644); /* (still there if rename failed) */
+    cap->logsize = 0;
+}
+
+/* 
+ * spool_work - Compress the next chunk of the oldest queued segment.
+ *    Called once per event loop pass so compression never holds up
+ *    the prompt or the output pipes for long.
+ */
+void spool_work(void)
+{
+    static char buf[GZCHUNK];
+    char tmp[MAXLINE+16], dst[MAXLINE+16];
+    struct gzjob_t *gz = gzq;
+    ssize_t n;
+
+    if (gz == NULL)
+	return;
+    if ((n = read(gz->in, buf, sizeof(buf))) > 0) {
+	gzwrite(gz->out, buf, n);
+	return;
+    }
+    if (n < 0 && errno == EINTR)
+	return;
+    sprintf(tmp, "%s.gz.tmp", gz->path);
+    sprintf(dst, "%s.gz", gz->path);
+    close(gz->in);
+    if (gzclose(gz->out) == Z_OK && n == 0) {
+	rename(tmp, dst);		/* publish path.gz first ... */
+	unlink(gz->path);		/* ... then drop the plain segment */
+    }
+    else
+	unlink(tmp);			/* keep the plain segment */
+    if ((gzq = gz->next) == NULL)
+	gzqtail = NULL;
+    free(gz);
+}
+
+/* throttle_refill - Top up a job's output budget for the time elapsed */
+void throttle_refill(struct capture_t *cap)
+{
+    long long now = now_ns();
+    long long dt = now - cap->refill;
+    long long add;
+
+    if (dt > 1000000000LL)
+	dt = 1000000000LL;
+    add = dt * cap->rate / 1000000000LL;
+    if (add > 0 || cap->tokens >= cap->rate) {
+	cap->tokens += add;
+	if (cap->tokens > cap->rate)	/* allow bursts of up to one second */
+	    cap->tokens = cap->rate;
+	cap->refill = now;
+    }
+}
+
+/* 
+ * throttle_drop - Cut n bytes of output down to the job's budget. Only
+ *    whole lines are kept: output past the budget is dropped up to the
+ *    next newline, even if that newline arrives in a later read.
+ *    Returns the number of bytes to pass on, starting at *data.
+ */
+size_t throttle_drop(struct capture_t *cap, char **data, size_t n)
+{
+    char *p = *data, *nl;
+    size_t keep, skip;
+
+    if (cap->skipline) {
+	if ((nl = memchr(p, '\n', n)) == NULL) {
+	    cap->dropped += n;
+	    return 0;
+	}
+	skip = nl - p + 1;
+	cap->dropped += skip;
+	p += skip;
+	n -= skip;
+	cap->skipline = 0;
+    }
+    if ((long long)n > cap->tokens) {
+	keep = cap->tokens > 0 ? cap->tokens : 0;
+	nl = keep ? memrchr(p, '\n', keep) : NULL;
+	keep = nl ? nl - p + 1 : 0;
+	if (keep == 0 && cap->len > 0) { /* the held partial line goes too */
+	    cap->dropped += cap->len;
+	    cap->len = 0;
+	}
+	cap->dropped += n - keep;
+	cap->skipline = (p[n-1] != '\n');
+	n = keep;
+    }
+    cap->tokens -= n;
+    *data = p;
+    return n;
+}
+
+/* 
+ * throttle_note - Report dropped output, at most once a second, as a
+ *    line of its own. force skips the wait (end of file).
+ */
+void throttle_note(struct capture_t *cap, int force)
+{
+    long long now;
+
+    if (cap->dropped == cap->noted)
+	return;
+    now = now_ns();
+    if (!force && now - cap->notetime < 1000000000LL)
+	return;
+    cap->notetime = now;
+    if (outlen + 128 > OUTBUFSIZE)
+	outmux_flush();
+    outlen += sprintf(outbuf + outlen, "[%d] tsh: output over %lld bytes/s, dropped %lld bytes\n",
+		      cap->jid, cap->rate, cap->dropped - cap->noted);
+    cap->noted = cap->dropped;
+}
+
+/* 
+ * throttle_resume - Start reading again from jobs whose budget refilled,
+ *    or that are no longer limited (rate 0 or -m drop)
+ */
+void throttle_resume(void)
+{
+    struct capture_t **pp = &pausedq, *cap;
+
+    while ((cap = *pp) != NULL) {
+	throttle_refill(cap);
+	if (cap->tokens > 0 || cap->rate == 0 || cap->mode != THR_BLOCK) {
+	    *pp = cap->pnext;
+	    cap->paused = 0;
+	    evl_add(&cap->src, EPOLLIN);
+	}
+	else
+	    pp = &cap->pnext;
+    }
+}
+
+/***********************
+ * End event loop
+ ***********************/
+
+
+/*****************************************************
+ * Remote agents
+ *
+ * A coordinating shell listens with "agents listen ADDR"; workers run
+ * "tsh --agent ADDR" and connect to it. "@pool cmd" starts cmd on the
+ * least-loaded agent of that pool, and the job lives in jobs[] like a
+ * local one. The protocol is newline-terminated text:
+ *
+ *   agent -> shell: HELLO pool slots | START id pid | FAIL id |
+ *                   OUT id n (then n bytes of output) | STOP id sig |
+ *                   EXIT id status
+ *   shell -> agent: RUN id cmdline | SIG id sig
+ *****************************************************/
+
+/* 
+ * sock_open - Connect to (server = 0) or listen on (server = 1) addr,
+ *    a Unix socket path if it contains a '/', else TCP host:port.
+ *    Returns the socket, or -1 with errno set.
+ */
+int sock_open(char *addr, int server)
+{
+    struct sockaddr_un un;
+    struct addrinfo hints, *ai, *p;
+    char host[MAXLINE], *port;
+    int fd = -1, one = 1, rc;
+
+    if (strchr(addr, '/')) {
+	if (strlen(addr) >= sizeof(un.sun_path)) {
+	    errno = ENAMETOOLONG;
+	    return -1;
+	}
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	strcpy(un.sun_path, addr);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0)
+	    return -1;
+	if (server)
+	    unlink(addr);
+	rc = server ? bind(fd, (struct sockaddr *)&un, sizeof(un))
+		    : connect(fd, (struct sockaddr *)&un, sizeof(un));
+	if (rc < 0 || (server && listen(fd, MAXAGENTS) < 0)) {
+	    close(fd);
+	    return -1;
+	}
+	return fd;
+    }
+
+    strncpy(host, addr, MAXLINE - 1);
+    host[MAXLINE-1] = '\0';
+    if ((port = strrchr(host, ':')) == NULL) {
+	errno = EINVAL;
+	return -1;
+    }
+    *port++ = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = server ? AI_PASSIVE : 0;
+    if (getaddrinfo(host[0] ? host : NULL, port, &hints, &ai) != 0) {
+	errno = EHOSTUNREACH;
+	return -1;
+    }
+    for (p = ai; p; p = p->ai_next) {
+	if ((fd = socket(p->ai_family, p->ai_socktype|SOCK_CLOEXEC, p->ai_protocol)) < 0)
+	    continue;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	rc = server ? bind(fd, p->ai_addr, p->ai_addrlen)
+		    : connect(fd, p->ai_addr, p->ai_addrlen);
+	if (rc == 0 && (!server || listen(fd, MAXAGENTS) == 0))
+	    break;
+	close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(ai);
+    return fd;
+}
+
+/* sock_write - Write all n bytes to a (blocking) socket */
+int sock_write(int fd, const char *buf, size_t n)
+{
+    ssize_t rc;
+
+    while (n > 0) {
+	if ((rc = write(fd, buf, n)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += rc;
+	n -= rc;
+    }
+    return 0;
+}
+
+/* agent_send - Send a formatted message to an agent */
+void agent_send(struct agent_t *a, char *fmt, ...)
+{
+    char buf[MAXLINE + 64];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n >= (int)sizeof(buf))
+	n = sizeof(buf) - 1;
+    sock_write(a->src.fd, buf, n);
+}
+
+/* agent_accept - A new agent connected to the listening socket */
+void agent_accept(struct evsrc_t *src, unsigned events)
+{
+    struct agent_t *a;
+    int fd, id;
+
+    if ((fd = accept4(src->fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+	return;
+    for (id = 1; id <= MAXAGENTS && agents[id]; id++)
+	;
+    if (id > MAXAGENTS || (a = malloc(sizeof(struct agent_t))) == NULL) {
+	close(fd);
+	return;
+    }
+    a->src.fd = fd;
+    a->src.handler = agent_read;
+    a->id = id;
+    strcpy(a->pool, "default");
+    a->slots = 1;
+    a->running = 0;
+    a->len = 0;
+    agents[id] = a;
+    evl_add(&a->src, EPOLLIN);
+}
+
+/* 
+ * agent_read - Read from an agent and handle each complete message.
+ *    An OUT message is complete once its n bytes of output are in.
+ */
+void agent_read(struct evsrc_t *src, unsigned events)
+{
+    struct agent_t *a = (struct agent_t *)src;
+    char *line, *nl;
+    size_t off = 0, hdr;
+    ssize_t n;
+    int rid, cnt;
+
+    if ((n = read(src->fd, a->buf + a->len, AGENTBUF - a->len)) <= 0) {
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+	    return;
+	agent_drop(a);
+	return;
+    }
+    a->len += n;
+    while ((nl = memchr(a->buf + off, '\n', a->len - off)) != NULL) {
+	line = a->buf + off;
+	hdr = nl - line + 1;
+	*nl = '\0';
+	if (sscanf(line, "OUT %d %d", &rid, &cnt) == 2) {
+	    if (cnt < 0 || cnt > AGENTOUT) {
+		agent_drop(a);
+		return;
+	    }
+	    if (a->len - off - hdr < (size_t)cnt) {
+		*nl = '\n';		/* wait for the rest of the output */
+		break;
+	    }
+	    agent_msg(a, line, nl + 1, cnt);
+	    off += hdr + cnt;
+	}
+	else {
+	    agent_msg(a, line, NULL, 0);
+	    off += hdr;
+	}
+    }
+    memmove(a->buf, a->buf + off, a->len - off);
+    a->len -= off;
+}
+
+/* agent_job - Find the job an agent runs under launch ID rid */
+struct job_t *agent_job(struct agent_t *a, int rid)
+{
     int i;
 
     for (i = 0; i < MAXJOBS; i++)
-	clearjob(&jobs[i]);
+	if (jobs[i].pid != 0 && jobs[i].agent == a->id && jobs[i].rid == rid)
+	    return &jobs[i];
+    return NULL;
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *jobs) 
+/* agent_msg - Handle one message from an agent */
+void agent_msg(struct agent_t *a, char *line, char *data, int n)
 {
-    int i, max=0;
+    struct job_t *job;
+    int rid, arg;
+    char pool[32];
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid > max)
-	    max = jobs[i].jid;
-    return max;
+    if (sscanf(line, "HELLO %31s %d", pool, &arg) == 2) {
+	strcpy(a->pool, pool);
+	a->slots = arg > 0 ? arg : 1;
+	if (verbose)
+	    printf("agent %d @%s connected with %d slots\n", a->id, a->pool, a->slots);
+	return;
+    }
+    if (sscanf(line, "%*s %d %d", &rid, &arg) < 1)
+	return;
+
+    if (!strncmp(line, "START ", 6) && rid == rlaunch.rid) {
+	rlaunch.pid = RPID_BASE + rid;	/* (remote pids can repeat, or be ours) */
+	rlaunch.done = 1;
+	if (addjob(jobs, rlaunch.pid, rlaunch.state, rlaunch.cmdline)) {
+	    job = getjobpid(jobs, rlaunch.pid);
+	    job->agent = a->id;
+	    job->rid = rid;
+	    job->rpid = arg;
+	    if ((job->cap = capture_new()) != NULL) {
+		job->cap->jid = job->jid;
+		job->cap->pid = rlaunch.pid;
+		job->cap->prefix = 1;	/* remote output is always labeled */
+	    }
+	    a->running++;
+	}
+	else
+	    agent_send(a, "SIG %d %d\n", rid, SIGKILL);
+	return;
+    }
+    if (!strncmp(line, "FAIL ", 5) && rid == rlaunch.rid) {
+	rlaunch.done = 1;
+	return;
+    }
+    if ((job = agent_job(a, rid)) == NULL) {
+	if (!strncmp(line, "START ", 6))	/* started after we gave up on it */
+	    agent_send(a, "SIG %d %d\n", rid, SIGKILL);
+	return;
+    }
+
+    if (!strncmp(line, "OUT ", 4)) {
+	if (job->cap) {
+	    capture_prefix(job->cap);
+	    job->cap->passed += n;
+	    capture_emit(job->cap, data, n);
+	}
+    }
+    else if (!strncmp(line, "STOP ", 5)) {
+	job->state = ST;
+	job->stopsig = arg;
+	printf("Job [%d] (%d) stopped by signal %d \n", job->jid, job->pid, arg);
+    }
+    else if (!strncmp(line, "EXIT ", 5)) {
+	if (WIFSIGNALED(arg))
+	    printf("Job [%d] (%d) terminated by signal %d \n", job->jid, job->pid, WTERMSIG(arg));
+	if (job->cap) {
+	    capture_prefix(job->cap);
+	    if (job->cap->len > 0)
+		capture_emit(job->cap, "\n", 1);
+	    free(job->cap);
+	    job->cap = NULL;
+	}
+	a->running--;
+	deletejob(jobs, job->pid);
+    }
 }
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) 
+/* agent_drop - An agent went away: its jobs are lost with it */
+void agent_drop(struct agent_t *a)
 {
     int i;
-    
-    if (pid < 1)
-	return 0;
 
     for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == 0) {
-	    jobs[i].pid = pid;
-	    jobs[i].state = state;
-	    jobs[i].jid = nextjid++;
-	    if (nextjid > MAXJOBS)
-		nextjid = 1;
-	    strcpy(jobs[i].cmdline, cmdline);
-  	    if(verbose){
-	        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
+	if (jobs[i].pid != 0 && jobs[i].agent == a->id) {
+	    printf("Job [%d] (%d) lost with agent %d \n", jobs[i].jid, jobs[i].pid, a->id);
+	    free(jobs[i].cap);
+	    jobs[i].cap = NULL;
+	    deletejob(jobs, jobs[i].pid);
 	}
     }
-    printf("Tried to create too many jobs\n");
-    return 0;
+    evl_del(&a->src);
+    close(a->src.fd);
+    agents[a->id] = NULL;
+    free(a);
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) 
+/* 
+ * agent_launch - Run "@pool cmd ..." on the least-loaded agent of pool.
+ *    The job is added to jobs[] when the agent reports its pid; then it
+ *    is waited for (fg) or announced (bg) like a local job.
+ */
+void agent_launch(char *cmdline, int bg)
 {
-    int i;
+    char pool[32], *rest;
+    struct agent_t *a = NULL;
+    long long deadline;
+    int i, len;
 
-    if (pid < 1)
-	return 0;
+    rest = cmdline + strspn(cmdline, " ") + 1;	/* skip the '@' */
+    len = strcspn(rest, " \n");
+    snprintf(pool, sizeof(pool), "%.*s", len, rest);
+    rest += len;
+    rest += strspn(rest, " ");
+    for (i = 1; i <= MAXAGENTS; i++)	/* least loaded = lowest busy fraction */
+	if (agents[i] && !strcmp(agents[i]->pool, pool)
+	    && (a == NULL || agents[i]->running * a->slots < a->running * agents[i]->slots))
+	    a = agents[i];
+    if (a == NULL) {
+	printf("@%s: No agents in pool\n", pool);
+	return;
+    }
 
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == pid) {
-	    clearjob(&jobs[i]);
-	    nextjid = maxjid(jobs)+1;
-	    return 1;
-	}
+    rlaunch.rid = nextrid++;
+    rlaunch.agent = a->id;
+    rlaunch.state = bg ? BG : FG;
+    rlaunch.cmdline = cmdline;
+    rlaunch.pid = 0;
+    rlaunch.done = 0;
+    agent_send(a, "RUN %d %s", rlaunch.rid, rest);
+    deadline = now_ns() + AGENT_TIMEOUT * 1000000LL;
+    while (!rlaunch.done && agents[rlaunch.agent] && now_ns() < deadline)
+	evl_wait(100, NULL);
+    rlaunch.rid = 0;
+    if (!rlaunch.done || !getjobpid(jobs, rlaunch.pid)) {
+	if (rlaunch.pid == 0)
+	    printf("@%s: job could not be started\n", pool);
+	return;
     }
-    return 0;
+    if (bg)
+	printf("[%d] (%d) %s", pid2jid(rlaunch.pid), rlaunch.pid, cmdline);
+    else
+	waitfg(rlaunch.pid);
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
-    int i;
+/* 
+ * agent_main - Body of tsh --agent: connect to the coordinating shell
+ *    and run the jobs it sends until the connection closes.
+ */
+int agent_main(char *addr, char *pool, int slots)
+{
+    static struct evsrc_t conn, chld;
+    sigset_t mask;
 
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].state == FG)
-	    return jobs[i].pid;
+    if ((agent_conn = sock_open(addr, 0)) < 0) {
+	fprintf(stderr, "tsh --agent: %s: %s\n", addr, strerror(errno));
+	return 1;
+    }
+    evl_init();
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &mask, NULL);	/* children are reaped via signalfd */
+    if ((chld.fd = signalfd(-1, &mask, SFD_CLOEXEC|SFD_NONBLOCK)) < 0)
+	unix_error("signalfd error");
+    chld.handler = agent_reap;
+    evl_add(&chld, EPOLLIN);
+    conn.fd = agent_conn;
+    conn.handler = agent_conn_read;
+    evl_add(&conn, EPOLLIN);
+
+    dprintf(agent_conn, "HELLO %s %d\n", pool, slots);
+    for (;;)
+	evl_wait(-1, NULL);
     return 0;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
+/* agent_conn_read - (agent side) Handle RUN and SIG from the coordinator */
+void agent_conn_read(struct evsrc_t *src, unsigned events)
+{
+    static char buf[AGENTBUF];
+    static size_t len = 0;
+    char cmdline[MAXLINE], *line, *nl, *cmd;
+    size_t off = 0;
+    ssize_t n;
+    int i, id, sig;
 
-    if (pid < 1)
-	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid)
-	    return &jobs[i];
-    return NULL;
+    if ((n = read(src->fd, buf + len, sizeof(buf) - len)) <= 0) {
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+	    return;
+	for (i = 0; i < MAXJOBS; i++)	/* coordinator is gone: hang up our jobs */
+	    if (tasks[i] && tasks[i]->pid)
+		kill(-tasks[i]->pid, SIGHUP);
+	exit(0);
+    }
+    len += n;
+    while ((nl = memchr(buf + off, '\n', len - off)) != NULL) {
+	line = buf + off;
+	off = nl - buf + 1;
+	if (sscanf(line, "RUN %d", &id) == 1 && (cmd = memchr(line + 4, ' ', nl - line - 4)) != NULL) {
+	    snprintf(cmdline, MAXLINE, "%.*s\n", (int)(nl - cmd - 1), cmd + 1);
+	    agent_run(id, cmdline);
+	}
+	else if (sscanf(line, "SIG %d %d", &id, &sig) == 2) {
+	    for (i = 0; i < MAXJOBS; i++)
+		if (tasks[i] && tasks[i]->id == id && tasks[i]->pid)
+		    kill(-tasks[i]->pid, sig);
+	}
+    }
+    memmove(buf, buf + off, len - off);
+    len -= off;
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid) 
+/* 
+ * agent_run - (agent side) Start a job in its own process group with
+ *    its output on a pipe to us, and report its pid.
+ */
+void agent_run(int id, char *cmdline)
 {
-    int i;
+    char *argv[MAXARGS];
+    struct task_t *t;
+    sigset_t mask;
+    int i, fds[2], null;
+    pid_t pid;
 
-    if (jid < 1)
-	return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].jid == jid)
-	    return &jobs[i];
-    return NULL;
+    for (i = 0; i < MAXJOBS && tasks[i]; i++)
+	;
+    parseline(cmdline, argv);
+    if (i == MAXJOBS || argv[0] == NULL || pipe2(fds, O_CLOEXEC) < 0
+	|| (t = malloc(sizeof(struct task_t))) == NULL) {
+	dprintf(agent_conn, "FAIL %d\n", id);
+	return;
+    }
+    if ((pid = Fork()) == 0) {
+	Sigemptyset(&mask);
+	Sigprocmask(SIG_SETMASK, &mask, NULL);
+	setpgid(0, 0);
+	dup2(fds[1], STDOUT_FILENO);
+	dup2(fds[1], STDERR_FILENO);
+	if ((null = open("/dev/null", O_RDONLY)) >= 0)
+	    dup2(null, STDIN_FILENO);
+	if (execve(argv[0], argv, environ) < 0) {
+	    printf("%s: Command not found. \n", argv[0]);
+	    exit(0);
+	}
+    }
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    t->src.fd = fds[0];
+    t->src.handler = agent_task_read;
+    t->id = id;
+    t->pid = pid;
+    tasks[i] = t;
+    evl_add(&t->src, EPOLLIN);
+    dprintf(agent_conn, "START %d %d\n", id, pid);
 }
 
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid) 
+/* agent_task_release - (agent side) Free a task once reaped and drained */
+void agent_task_release(struct task_t *t)
 {
     int i;
 
-    if (pid < 1)
-	return 0;
+    if (t->pid != 0 || t->src.fd >= 0)
+	return;
     for (i = 0; i < MAXJOBS; i++)
-	if (jobs[i].pid == pid) {
-            return jobs[i].jid;
-        }
-    return 0;
+	if (tasks[i] == t)
+	    tasks[i] = NULL;
+    free(t);
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) 
+/* 
+ * agent_task_forward - (agent side) Forward one read of a job's output
+ *    to the coordinator. At end of file the pipe is closed. Returns the
+ *    read() result.
+ */
+ssize_t agent_task_forward(struct task_t *t)
 {
-    int i;
-    
-    for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid != 0) {
-	    printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-	    switch (jobs[i].state) {
-		case BG: 
-		    printf("Running ");
-		    break;
-		case FG: 
-		    printf("Foreground ");
-		    break;
-		case ST: 
-		    printf("Stopped ");
-		    break;
-	    default:
-		    printf("listjobs: Internal error: job[%d].state=%d ", 
-			   i, jobs[i].state);
-	    }
-	    printf("%s", jobs[i].cmdline);
+    char buf[AGENTOUT + 64];
+    ssize_t n;
+    int hdr;
+
+    if ((n = read(t->src.fd, buf + 64, AGENTOUT)) > 0) {
+	hdr = sprintf(buf, "OUT %d %d\n", t->id, (int)n);
+	memmove(buf + hdr, buf + 64, n);
+	sock_write(agent_conn, buf, hdr + n);
+    }
+    else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+	evl_del(&t->src);
+	close(t->src.fd);
+	t->src.fd = -1;
+    }
+    return n;
+}
+
+/* agent_task_read - (agent side) Handler for a job's output pipe */
+void agent_task_read(struct evsrc_t *src, unsigned events)
+{
+    struct task_t *t = (struct task_t *)src;
+
+    agent_task_forward(t);
+    agent_task_release(t);
+}
+
+/* 
+ * agent_reap - (agent side) Report stopped and finished jobs. Output
+ *    still in a finished job's pipe is forwarded before its EXIT.
+ */
+void agent_reap(struct evsrc_t *src, unsigned events)
+{
+    struct signalfd_siginfo si;
+    struct task_t *t;
+    pid_t pid;
+    int i, status;
+
+    while (read(src->fd, &si, sizeof(si)) == sizeof(si))
+	;
+    while ((pid = waitpid(-1, &status, WNOHANG|WUNTRACED)) > 0) {
+	for (i = 0, t = NULL; i < MAXJOBS; i++)
+	    if (tasks[i] && tasks[i]->pid == pid)
+		t = tasks[i];
+	if (t == NULL)
+	    continue;
+	if (WIFSTOPPED(status)) {
+	    dprintf(agent_conn, "STOP %d %d\n", t->id, WSTOPSIG(status));
+	    continue;
 	}
+	while (t->src.fd >= 0 && agent_task_forward(t) > 0)
+	    ;			/* drain what the job left in its pipe */
+	dprintf(agent_conn, "EXIT %d %d\n", t->id, status);
+	t->pid = 0;
+	agent_task_release(t);
     }
 }
-/******************************
- * end job list helper routines
- ******************************/
+
+/*****************
+ * End remote agents
+ *****************/
 
 
 /***********************
  * Other helper routines
  ***********************/
 
+/*
+ * rio_readinitb - Associate a descriptor with a read buffer
+ */
+void rio_readinitb(rio_t *rp, int fd)
+{
+    rp->rio_pipe = 0;
+    rp->rio_fd = fd;
+    rp->rio_cnt = 0;
+    rp->rio_bufptr = rp->rio_buf;
+}
+
+/*
+ * rio_fill - Refill an empty read buffer. While job output is being
+ *    captured, the event loop runs until the descriptor is readable.
+ *    Returns the number of bytes read, 0 on EOF, -1 on error.
+ */
+ssize_t rio_fill(rio_t *rp)
+{
+    while (rp->rio_cnt <= 0) {
+	if (evl_active())
+	    evl_waitfd(rp->rio_fd);
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+	if (rp->rio_cnt < 0) {
+	    if (errno != EINTR)
+		return -1;
+	}
+	else if (rp->rio_cnt == 0)
+	    return 0;
+	else
+	    rp->rio_bufptr = rp->rio_buf;
+    }
+    return rp->rio_cnt;
+}
+
+/*
+ * rio_sync - Hand unread buffered input back to the file, so that a
+ *    job started now reads on from where the shell has got to. Only
+ *    possible if the file can seek; a pipe keeps its bytes buffered.
+ */
+void rio_sync(rio_t *rp)
+{
+    if (rp->rio_cnt <= 0 || rp->rio_pipe)
+	return;
+    if (lseek(rp->rio_fd, -rp->rio_cnt, SEEK_CUR) < 0)
+	rp->rio_pipe = 1;
+    else
+	rp->rio_cnt = 0;
+}
+
+/*
+ * rio_readlineb - Read a text line (up to maxlen-1 bytes, including the
+ *    newline) into usrbuf and null-terminate it. Returns the number of
+ *    bytes read, 0 on EOF, -1 on error.
+ */
+ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    char *bufp = usrbuf, *nl;
+    size_t n = 0, cnt;
+    ssize_t rc;
+
+    while (n < maxlen - 1) {
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;
+	if (rc == 0)
+	    break;
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen - 1 - n)
+	    cnt = maxlen - 1 - n;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	n += cnt;
+	if (nl)
+	    break;
+    }
+    bufp[n] = '\0';
+    return n;
+}
+
 /*
  * usage - print a help message
  */
 void usage(void) 
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpru] [-s n]\n");
+    printf("       shell --agent addr [--pool name] [--slots n]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -r   become a subreaper and reap orphaned descendants\n");
+    printf("   -u   use io_uring for the event loop and child waits (else epoll)\n");
+    printf("   -s   launch batch jobs from a pool of n spawner threads\n");
+    printf("   --agent  run jobs for the shell listening on addr (path or host:port)\n");
     exit(1);
 }
 
+/*
+ * parse_size - Parse a byte count with an optional K, M or G suffix.
+ *    Returns -1 if s is not a valid size.
+ */
+long long parse_size(const char *s)
+{
+    char *end;
+    long long n;
+
+    errno = 0;
+    n = strtoll(s, &end, 10);
+    if (errno || end == s || n < 0)
+	return -1;
+    switch (toupper(*end)) {
+    case 'G': n <<= 10; /* fall through */
+    case 'M': n <<= 10; /* fall through */
+    case 'K': n <<= 10; end++; break;
+    case '\0': break;
+    default: return -1;
+    }
+    return *end ? -1 : n;
+}
+
+/*
+ * rlim_find - Find a resource by its ulimit option or its limit keyword
+ */
+struct rlimname_t *rlim_find(int opt, const char *name)
+{
+    struct rlimname_t *r;
+
+    for (r = rlimnames; r->opt; r++)
+	if (name ? !strcmp(r->name, name) : r->opt == opt)
+	    return r;
+    return NULL;
+}
+
+/*
+ * rlim_value - Parse a limit for resource r: a number, which may have a
+ *    K, M or G suffix, or "unlimited". If units is set, a plain number
+ *    is in r's units (kbytes for sizes, as ulimit takes them), else
+ *    in bytes. Returns -1 if s is not a valid limit.
+ */
+int rlim_value(struct rlimname_t *r, const char *s, int units, rlim_t *val)
+{
+    long long n;
+
+    if (!strcmp(s, "unlimited")) {
+	*val = RLIM_INFINITY;
+	return 0;
+    }
+    if ((n = parse_size(s)) < 0)
+	return -1;
+    if (units && isdigit((unsigned char)s[strlen(s)-1]))
+	n *= r->unit;
+    *val = n;
+    return 0;
+}
+
+/*
+ * limit_parse - Parse the limit prefix of a command line:
+ *    limit name=value ... [--] cmd [args]
+ *    with names from rlimnames[] (mem, cpu, nofile, ...) and oom for
+ *    the job's oom_score_adj. Returns the command's argv, or NULL
+ *    after printing an error.
+ */
+char **limit_parse(char **argv, struct limits_t *lim)
+{
+    struct rlimname_t *r;
+    char name[32], *eq, *end;
+    long n;
+
+    lim->n = 0;
+    lim->oom = OOM_UNSET;
+    for (argv++; *argv && strcmp(*argv, "--") && (eq = strchr(*argv, '=')) != NULL; argv++) {
+	snprintf(name, sizeof(name), "%.*s", (int)(eq - *argv), *argv);
+	if (!strcmp(name, "oom")) {
+	    n = strtol(eq + 1, &end, 10);
+	    if (end == eq + 1 || *end || n < -1000 || n > 1000) {
+		printf("limit: %s: oom must be -1000 to 1000\n", *argv);
+		return NULL;
+	    }
+	    lim->oom = n;
+	    continue;
+	}
+	if ((r = rlim_find(0, name)) == NULL || lim->n == MAXLIMITS
+	    || rlim_value(r, eq + 1, 0, &lim->val[lim->n]) < 0) {
+	    printf("limit: %s: invalid limit\n", *argv);
+	    return NULL;
+	}
+	lim->res[lim->n++] = r->res;
+    }
+    if (*argv && !strcmp(*argv, "--"))
+	argv++;
+    if (!*argv) {
+	printf("usage: limit name=value ... -- command\n");
+	return NULL;
+    }
+    return argv;
+}
+
+/*
+ * limits_apply - (child) Set a job's limits on itself before it execs.
+ *    Both the soft and the hard limit are set, so the job can't raise
+ *    them again; the hard cpu limit is a second later, so the job gets
+ *    SIGXCPU before it is killed. Returns -1 after printing an error.
+ */
+int limits_apply(struct limits_t *lim)
+{
+    struct rlimname_t *r;
+    struct rlimit rl;
+    char buf[16];
+    int i, fd, len;
+
+    for (i = 0; i < lim->n; i++) {
+	getrlimit(lim->res[i], &rl);
+	rl.rlim_cur = lim->val[i];
+	if (lim->val[i] != RLIM_INFINITY)
+	    rl.rlim_max = lim->val[i] + (lim->res[i] == RLIMIT_CPU);
+	if (setrlimit(lim->res[i], &rl) < 0) {
+	    for (r = rlimnames; r->res != lim->res[i]; r++)
+		;
+	    printf("limit: %s: %s\n", r->name, strerror(errno));
+	    return -1;
+	}
+    }
+    if (lim->oom != OOM_UNSET) {
+	len = sprintf(buf, "%d\n", lim->oom);
+	if ((fd = open("/proc/self/oom_score_adj", O_WRONLY)) < 0 || write(fd, buf, len) != len) {
+	    printf("limit: oom_score_adj: %s\n", strerror(errno));
+	    return -1;
+	}
+	close(fd);
+    }
+    return 0;
+}
+
+/*
+ * exec_cache - Return an fd for the program at path from the exec
+ *    cache, for execveat, or -1. With add set, a program that isn't
+ *    there is opened (O_PATH, close-on-exec) into the slot used least
+ *    recently. An entry is dropped once the file behind it changes:
+ *    its mtime is checked on the fd every time, and once a second
+ *    path is looked up again to catch a new file put in its place.
+ */
+int exec_cache(const char *path, int add)
+{
+    struct exec_t *e, *victim = NULL;
+    struct stat st;
+    long long now;
+    int i;
+
+    if (strlen(path) >= sizeof(execs[0].path) || path[0] != '/')
+	return -1;		/* (only full paths, as the shell runs them) */
+    for (i = 0; i < EXECCACHE; i++) {
+	e = &execs[i];
+	if (e->fd < 0) {
+	    if (!victim || victim->fd >= 0)
+		victim = e;	/* a free slot beats any */
+	    continue;
+	}
+	if (!victim || (victim->fd >= 0 && e->used < victim->used))
+	    victim = e;
+	if (strcmp(e->path, path))
+	    continue;
+	now = now_ns();
+	if (fstat(e->fd, &st) < 0 || st.st_mtim.tv_sec != e->mtime.tv_sec
+	    || st.st_mtim.tv_nsec != e->mtime.tv_nsec
+	    || (now - e->checked > EXEC_RECHECK
+		&& (stat(path, &st) < 0 || st.st_dev != e->dev || st.st_ino != e->ino))) {
+	    close(e->fd);	/* changed: open it again below */
+	    e->fd = -1;
+	    victim = e;
+	    break;
+	}
+	if (now - e->checked > EXEC_RECHECK)
+	    e->checked = now;
+	if (add) {
+	    e->used = ++execclock;
+	    e->hits++;
+	}
+	return e->fd;
+    }
+    if (!add || victim == NULL)
+	return -1;
+    if (victim->fd >= 0)
+	close(victim->fd);	/* the least recently used */
+    victim->fd = -1;
+    if ((i = open(path, O_PATH|O_CLOEXEC)) < 0)
+	return -1;
+    if (fstat(i, &st) < 0 || !S_ISREG(st.st_mode)) {
+	close(i);
+	return -1;
+    }
+    strcpy(victim->path, path);
+    victim->fd = i;
+    victim->dev = st.st_dev;
+    victim->ino = st.st_ino;
+    victim->mtime = st.st_mtim;
+    victim->checked = now_ns();
+    victim->used = ++execclock;
+    victim->hits = 1;
+    return i;
+}
+
+/* exec_flush - Close everything in the exec cache */
+void exec_flush(void)
+{
+    int i;
+
+    for (i = 0; i < EXECCACHE; i++) {
+	if (execs[i].path[0] && execs[i].fd >= 0)
+	    close(execs[i].fd);	/* (a slot never used has fd 0) */
+	execs[i].fd = -1;
+    }
+}
+
+/*
+ * now_ns - Monotonic clock in nanoseconds
+ */
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 /*
  * unix_error - unix-style error routine
  */